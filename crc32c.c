@@ -0,0 +1,123 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define CRC32C_ARM 1
+#endif
+
+#define POLY 0x82F63B78 /* reversed Castagnoli polynomial */
+
+static uint32_t table[8][256];
+static uint32_t (*crc32c_impl)(uint32_t crc, const unsigned char* ptr, size_t size) = NULL;
+
+/**
+ * Portable slicing-by-8 implementation.
+ */
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char* ptr, size_t size){
+	for ( ; size > 0 && ((uintptr_t)ptr & 7) != 0; size--, ptr++ ){
+		crc = table[0][(crc ^ *ptr) & 0xFF] ^ (crc >> 8);
+	}
+
+	for ( ; size >= 8; size -= 8, ptr += 8 ){
+		const uint32_t lo = crc ^ ((uint32_t)ptr[0] | (uint32_t)ptr[1] << 8 | (uint32_t)ptr[2] << 16 | (uint32_t)ptr[3] << 24);
+		crc = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^ table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24] ^
+		      table[3][ptr[4]] ^ table[2][ptr[5]] ^ table[1][ptr[6]] ^ table[0][ptr[7]];
+	}
+
+	for ( ; size > 0; size--, ptr++ ){
+		crc = table[0][(crc ^ *ptr) & 0xFF] ^ (crc >> 8);
+	}
+
+	return crc;
+}
+
+#ifdef CRC32C_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char* ptr, size_t size){
+	for ( ; size > 0 && ((uintptr_t)ptr & 7) != 0; size--, ptr++ ){
+		crc = _mm_crc32_u8(crc, *ptr);
+	}
+#ifdef __x86_64__
+	uint64_t crc64 = crc;
+	for ( ; size >= 8; size -= 8, ptr += 8 ){
+		uint64_t word;
+		memcpy(&word, ptr, sizeof(word));
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+	crc = (uint32_t)crc64;
+#endif
+	for ( ; size >= 4; size -= 4, ptr += 4 ){
+		uint32_t word;
+		memcpy(&word, ptr, sizeof(word));
+		crc = _mm_crc32_u32(crc, word);
+	}
+	for ( ; size > 0; size--, ptr++ ){
+		crc = _mm_crc32_u8(crc, *ptr);
+	}
+	return crc;
+}
+
+static int crc32c_hw_supported(void){
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.2");
+}
+#endif
+
+#ifdef CRC32C_ARM
+__attribute__((target("+crc")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char* ptr, size_t size){
+	for ( ; size > 0 && ((uintptr_t)ptr & 7) != 0; size--, ptr++ ){
+		crc = __crc32cb(crc, *ptr);
+	}
+	for ( ; size >= 8; size -= 8, ptr += 8 ){
+		uint64_t word;
+		memcpy(&word, ptr, sizeof(word));
+		crc = __crc32cd(crc, word);
+	}
+	for ( ; size > 0; size--, ptr++ ){
+		crc = __crc32cb(crc, *ptr);
+	}
+	return crc;
+}
+
+static int crc32c_hw_supported(void){
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#endif
+
+__attribute__((constructor))
+static void crc32c_init(void){
+	for ( uint32_t i = 0; i < 256; i++ ){
+		uint32_t crc = i;
+		for ( int j = 0; j < 8; j++ ){
+			crc = (crc >> 1) ^ (POLY & (0 - (crc & 1)));
+		}
+		table[0][i] = crc;
+	}
+	for ( uint32_t i = 0; i < 256; i++ ){
+		for ( int k = 1; k < 8; k++ ){
+			table[k][i] = table[0][table[k-1][i] & 0xFF] ^ (table[k-1][i] >> 8);
+		}
+	}
+
+	crc32c_impl = crc32c_sw;
+#if defined(CRC32C_X86) || defined(CRC32C_ARM)
+	if ( crc32c_hw_supported() ){
+		crc32c_impl = crc32c_hw;
+	}
+#endif
+}
+
+uint32_t datapack_crc32c(uint32_t crc, const void* data, size_t size){
+	return ~crc32c_impl(~crc, (const unsigned char*)data, size);
+}
@@ -0,0 +1,13 @@
+#ifndef DATAPACK_CRC32C_H
+#define DATAPACK_CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * CRC32C (Castagnoli) of data, continuing from crc (0 for a new checksum).
+ * Uses the SSE4.2 or ARMv8 CRC instructions when the CPU supports them.
+ */
+uint32_t datapack_crc32c(uint32_t crc, const void* data, size_t size);
+
+#endif /* DATAPACK_CRC32C_H */
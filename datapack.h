@@ -11,6 +11,22 @@ extern "C" {
 
 typedef struct datapack* datapack_t;
 
+/* entry flags */
+#define DATAPACK_STORED 0x1        /* data is stored uncompressed */
+#define DATAPACK_SEGMENTED 0x2     /* data is split into independently compressed segments */
+#define DATAPACK_CHECKSUM 0x4      /* crc holds the CRC32C of the compressed data (or of the block) */
+#define DATAPACK_DELTA 0x8         /* data is a delta against the entry with the same name in the base pack */
+#define DATAPACK_DELETED 0x10      /* entry is removed from the base pack (patches only) */
+
+struct datapack_block {
+	const char* data;          /* compressed data (NULL if data must be read from file first) */
+	long offset;               /* offset to data in file (0 if compressed data is present in data) */
+	size_t csize;              /* compressed size */
+	size_t usize;              /* uncompressed size */
+	uint32_t crc;              /* CRC32C of compressed data */
+	unsigned int volume;       /* volume file holding the data (0 unless the pack is split into volumes) */
+};
+
 struct datapack_entry {
 	datapack_t handle;         /* which pack this entry belongs to */
 	const char* filename;      /* filename (null-terminated) */
@@ -18,38 +34,385 @@ struct datapack_entry {
 	long offset;               /* offset to data in file (0 if compressed data is present in data) */
 	size_t csize;              /* compressed size */
 	size_t usize;              /* uncompressed size */
+	const struct datapack_block* block; /* solid block holding the data (NULL if entry is compressed by itself) */
+	size_t boffset;            /* offset to uncompressed data within block */
+	unsigned int flags;        /* DATAPACK_* flags */
+	size_t ssize;              /* uncompressed size of each segment (last may be shorter) */
+	const uint32_t* segments;  /* compressed size of each segment (NULL if not segmented) */
+	uint32_t crc;              /* CRC32C of compressed data (only if DATAPACK_CHECKSUM is set) */
+	unsigned int volume;       /* volume file holding the data (0 unless the pack is split into volumes) */
 };
 
 /**
  * Opens a new pack.
  *
- * @param filename Filename or NULL for reading in-process data.
+ * Packs appended to another file (`datapacker --append-to`) are found by
+ * their footer and mapped into memory instead of being read using pread.
+ * Packs split into volumes (`datapacker --volume-size`) open all volume files
+ * as a single pack. Volume files are looked up next to filename and volume
+ * names containing a directory are rejected with EBADF.
+ *
+ * @param filename Filename or NULL for reading in-process data. If no data is
+ *                 linked into the executable a pack appended to the executable
+ *                 itself is opened instead.
  * @return Handle to datapack.
  */
 datapack_t datapack_open(const char* filename);
 
 /**
- * Closes an open pack.
+ * Opens a patch created with `datapacker --delta-from` on top of base. The
+ * returned handle holds the entries of base, replaced, added or removed as
+ * recorded by the patch. Unchanged entries are read from base and changed
+ * entries are either read from the patch or rebuilt from a binary delta
+ * against the entry in base.
+ *
+ * base must stay open until the returned handle is closed. Opening a patch
+ * using datapack_open lists the changes only and delta entries cannot be
+ * unpacked.
+ *
+ * @return Handle to datapack or NULL on errors and errno is set to indicate the error.
+ * @error EINVAL if filename is not a patch or base is not the pack it was created from.
+ */
+datapack_t datapack_open_patch(const char* filename, datapack_t base);
+
+/**
+ * Opens a pack which is reloaded when the file is replaced, either in place
+ * or by renaming a new file over it. A background thread watches the file
+ * using inotify, opens the new version and swaps it in once its index is
+ * built. Calls using the returned handle never block on a reload and use the
+ * version current at the time of the call. A version which fails to open is
+ * ignored and the previous version stays in use.
+ *
+ * Streams from unpack_open and mappings from unpack_mmap keep the version
+ * they read from open until closed. Entries returned by unpack_find or passed
+ * to datapack_glob callbacks stay valid until the handle is closed, so each
+ * version entries were handed out from is kept in memory until then. Look
+ * entries up in a datapack_snapshot instead to release old versions earlier.
+ *
+ * @return Handle to datapack or NULL on errors and errno is set to indicate the error.
+ */
+datapack_t datapack_open_watch(const char* filename);
+
+/**
+ * Reload a handle from datapack_open_watch right away, e.g. on file systems
+ * without inotify support. Nothing is done if the file is unchanged.
+ *
+ * @return 0 if successful, EINVAL if handle is not reloadable or the error
+ *         from opening the new version.
+ */
+int datapack_reload(datapack_t handle);
+
+/**
+ * Get a reference to the current version of a pack. The returned handle and
+ * its entries stay valid until it is closed using datapack_close, even if
+ * handle is reloaded or closed meanwhile. For handles which are not
+ * reloadable a new reference to handle itself is returned.
+ */
+datapack_t datapack_snapshot(datapack_t handle);
+
+/**
+ * Closes an open pack. The pack is freed once snapshots, streams and
+ * mappings using it are closed as well.
  */
 void datapack_close(datapack_t handle);
 
+/**
+ * Set the maximum number of threads used to decompress a single segmented
+ * entry. 0 uses one thread per online CPU (default) and 1 disables threading.
+ */
+void datapack_set_threads(unsigned int threads);
+
+/**
+ * Functions used for memory allocated by the library, ctx is passed to each.
+ * They follow malloc(3), realloc(3) and free(3) (free is never passed NULL).
+ */
+struct datapack_allocator {
+	void* (*alloc)(void* ctx, size_t size);
+	void* (*realloc)(void* ctx, void* ptr, size_t size);
+	void (*free)(void* ctx, void* ptr);
+	void* ctx;
+};
+
+/**
+ * Set the allocator used for memory allocated by the library, or NULL to
+ * use malloc(3) (default). The allocator is copied. Data returned by unpack,
+ * unpack_filename and unpack_many is allocated using it too and must be
+ * freed using the same allocator instead of free(3).
+ *
+ * Without a handle this sets the global allocator, used for everything not
+ * belonging to a handle (including zlib state, per-thread caches and data of
+ * in-process entries) and copied into handles opened afterwards. Memory is
+ * always freed using the allocator it was allocated with, so the global
+ * allocator may be replaced at any time while no other call is in progress.
+ *
+ * With a handle this sets the allocator of data unpacked from its entries
+ * afterwards, of temporary buffers and of cached blocks. The index and other
+ * state of the handle are freed using the allocator they were allocated
+ * with. Must not be called while other threads use the handle.
+ */
+void datapack_set_allocator(datapack_t handle, const struct datapack_allocator* allocator);
+
+typedef enum {
+	DATAPACK_VERIFY_NONE,      /* never verify checksums */
+	DATAPACK_VERIFY_LAZY,      /* verify each entry or block the first time it is read (default) */
+	DATAPACK_VERIFY_OPEN,      /* verify everything when the pack is opened */
+} datapack_verify_t;
+
+/**
+ * Set how checksums of packs opened after this call are verified. Only data
+ * read from pack files is verified. A mismatch makes unpack fail with
+ * EBADMSG, or datapack_open when using DATAPACK_VERIFY_OPEN. Streams from
+ * unpack_open verify lazily as well and fail the read reaching the end of
+ * the data.
+ */
+void datapack_set_verify(datapack_verify_t mode);
+
+typedef enum {
+	DATAPACK_INDEX_FULL,       /* every entry and filename is kept in memory (default) */
+	DATAPACK_INDEX_COMPACT,    /* filenames are front-coded, entries are created on first lookup */
+} datapack_index_t;
+
+/**
+ * Set how the index of packs opened after this call is kept in memory. The
+ * compact index stores filenames sorted and front-coded in groups of 16 with
+ * the first name of each group searched first, and a small fixed-size record
+ * per entry. The struct datapack_entry of an entry is allocated the first time
+ * it is returned (by unpack_find, datapack_glob or datapack_readdir) and stays
+ * valid until the pack is closed. Only the compact part is locked by
+ * datapack_lock_index. Packs with filenames of PATH_MAX or more bytes keep the
+ * full index.
+ */
+void datapack_set_index(datapack_index_t mode);
+
+/**
+ * Record an access trace to filename: one line per entry read through unpack,
+ * unpack_filename or unpack_open with the milliseconds since tracing started
+ * and the filename separated by a tab. The trace can be passed to
+ * `datapacker --layout-profile` to lay out entries in first-use order.
+ *
+ * Tracing is also enabled if the DATAPACK_TRACE environment variable is set.
+ *
+ * @param filename File to write or NULL to stop tracing.
+ * @return 0 on success or an errno value.
+ */
+int datapack_trace(const char* filename);
+
 /**
  * Unpack a file using file entry directly.
- * Allocated memory should be freed using free(3).
+ * Allocated memory should be freed with the allocator of the handle (free(3)
+ * by default, see datapack_set_allocator).
  */
 int unpack(const struct datapack_entry* src, char** dst);
 
+/**
+ * Unpack several entries at once, e.g. when loading many files on startup.
+ * Entries read from file have their compressed data read by a batch of
+ * concurrent reads (using io_uring on Linux if available) and each entry is
+ * decompressed as soon as its read completes, so cold reads are not waited
+ * for one at a time. Other entries are unpacked as by unpack.
+ *
+ * Allocated memory should be freed with the allocator of the handle (free(3)
+ * by default, see datapack_set_allocator).
+ * @param dst Set to the data of each entry, all NULL on failure.
+ * @return 0 on success or the error of a failing entry.
+ */
+int unpack_many(const struct datapack_entry* const* src, char** dst, size_t num);
+
 /**
  * Unpack a file using path.
- * Allocated memory should be freed using free(3).
+ * Allocated memory should be freed with the allocator of the handle (free(3)
+ * by default, see datapack_set_allocator).
  */
 int unpack_filename(datapack_t handle, const char* filename, char** dst);
 
+/**
+ * Enable a decompressed-data cache shared between processes, stored as files
+ * in dir (preferably on tmpfs, e.g. a directory below /dev/shm). NULL disables
+ * it (default). As cached data is trusted, dir must not be writable by other
+ * users. Cache files which are not regular files owned by the effective user,
+ * or which are writable by group or others, are never used.
+ *
+ * Files are named by the identity of the pack file (device, inode, size and
+ * modification time) and the location of the entry's data, so a modified pack
+ * never matches stale data and processes using either index mode share files.
+ * Files are never removed by the library.
+ *
+ * @return 0 on success or an errno value.
+ */
+int datapack_set_shared_cache(const char* dir);
+
+/**
+ * Get read-only decompressed data of an entry. With a shared cache the first
+ * process decompresses the entry into the cache and every process maps the
+ * same pages, otherwise (or for in-process data) a private copy is mapped.
+ * Data is null-terminated just like unpack.
+ *
+ * The mapping must be released using unpack_shared_release.
+ * @param size Set to size of data.
+ * @return 0 on success.
+ */
+int unpack_shared(const struct datapack_entry* src, const char** dst, size_t* size);
+
+/**
+ * Release data returned by unpack_shared.
+ */
+void unpack_shared_release(const char* data, size_t size);
+
+/**
+ * Get a read-only mapping of the decompressed data of an entry without
+ * decompressing it up front. Address space for the whole entry is reserved
+ * and each page is filled the first time it is touched, so untouched parts
+ * cost neither memory nor time. Segmented entries are decoded one segment at
+ * a time, stored entries one page at a time and other entries as a whole on
+ * first touch. Entries in solid blocks and deltas are decompressed up front
+ * into a private copy. Data is null-terminated just like unpack.
+ *
+ * Faults are served by userfaultfd(2) if available, otherwise by a SIGSEGV
+ * handler passing foreign faults on to the previous handler. Untouched data
+ * must not be passed to system calls directly (they fail with EFAULT unless
+ * userfaultfd handles kernel faults).
+ *
+ * Checksums are verified for the whole entry on first touch (following
+ * datapack_set_verify). Data which cannot be read, verified or decoded reads
+ * as zeroes and the error is reported by unpack_mmap_error. With the SIGSEGV
+ * handler the touching thread additionally receives SIGBUS, like for a
+ * truncated file mapping.
+ *
+ * Serving a fault only locks the mapping (other mappings are filled in
+ * parallel) and never allocates memory, the decoder state is set up by this
+ * call. Mapped data must still not be touched from signal handlers, as the
+ * handler may interrupt unpack_mmap, unpack_munmap or a fault on the same
+ * mapping in the interrupted thread and wait for itself.
+ *
+ * The mapping must be released using unpack_munmap.
+ * @param size Set to size of data.
+ * @return 0 on success.
+ */
+int unpack_mmap(const struct datapack_entry* src, const char** dst, size_t* size);
+
+/**
+ * Release data returned by unpack_mmap.
+ */
+void unpack_munmap(const char* data, size_t size);
+
+/**
+ * Get the first error filling pages of a mapping from unpack_mmap, e.g.
+ * EBADMSG on checksum mismatch or corrupt data and EIO on read errors.
+ * @return 0 if all touched data was filled in correctly.
+ */
+int unpack_mmap_error(const char* data);
+
+/**
+ * Callback receiving data from unpack_stream.
+ * @return 0 to continue or non-zero to stop.
+ */
+typedef int (*datapack_sink_t)(const char* data, size_t size, void* ctx);
+
+/**
+ * Decompress an entry into chunks of chunk bytes (16K if 0) passed to sink,
+ * without buffering the whole entry or going through stdio. Every chunk but
+ * the last is full. The data passed to sink is only valid during the call.
+ * Stored entries in memory are passed on without copying.
+ *
+ * Data read from file is verified while streaming, so a checksum mismatch is
+ * only reported after all data has been passed to sink.
+ *
+ * @return 0 on success, the value returned by sink if it stopped the stream
+ *         or an errno value.
+ */
+int unpack_stream(const struct datapack_entry* src, datapack_sink_t sink, void* ctx, size_t chunk);
+
+/**
+ * File descriptor of the file holding the compressed data of an entry (or of
+ * its solid block) at the offset of the entry or block, e.g. to send stored
+ * entries using sendfile(2). The descriptor belongs to the pack.
+ *
+ * @return File descriptor or -1 if data is not read from a file.
+ */
+int datapack_entry_fd(const struct datapack_entry* src);
+
 /**
  * Find a file using path
  */
 struct datapack_entry* unpack_find(datapack_t handle, const char* filename);
 
+/**
+ * Callback for datapack_glob. Return non-zero to stop iteration.
+ */
+typedef int (*datapack_glob_callback)(const struct datapack_entry* entry, void* data);
+
+/**
+ * Visit all entries matching a fnmatch(3) pattern in sorted filename order.
+ *
+ * Wildcards also match '/', e.g. "*.glsl" matches "shaders/blur.glsl". A
+ * pattern without wildcards matches only the entry with that exact name, a
+ * prefix is matched using a trailing wildcard. The literal part of the pattern
+ * before the first wildcard is looked up in the sorted index so a prefix query
+ * only touches matching entries.
+ *
+ * @param pattern Pattern to match or NULL for all entries.
+ * @param callback Called for each match, may be NULL to only count.
+ * @return Number of matching entries visited.
+ */
+size_t datapack_glob(datapack_t handle, const char* pattern, datapack_glob_callback callback, void* data);
+
+typedef enum {
+	DATAPACK_ADVISE_NORMAL,    /* no special treatment */
+	DATAPACK_ADVISE_WILLNEED,  /* data will be read soon, start reading it in the background */
+	DATAPACK_ADVISE_DONTNEED,  /* data will not be read again soon, release its pages */
+	DATAPACK_ADVISE_SEQUENTIAL,/* data will be read sequentially, use aggressive readahead */
+} datapack_advice_t;
+
+/**
+ * Advise the kernel about the expected use of entries matching pattern (same
+ * matching as datapack_glob, NULL for the whole pack). The byte ranges of the
+ * matching entries (or their solid blocks) are merged and passed to
+ * posix_fadvise(2) for pack files or madvise(2) for in-process data.
+ *
+ * @return 0 on success or an errno value.
+ */
+int datapack_advise(datapack_t handle, const char* pattern, datapack_advice_t advice);
+
+/**
+ * Lock (or unlock) the index of an opened pack in memory using mlock(2) so
+ * lookups never page fault. The index is unlocked when the pack is closed.
+ *
+ * @return 0 on success or an errno value, EINVAL for in-process data.
+ */
+int datapack_lock_index(datapack_t handle, int lock);
+
+typedef struct datapack_dir* datapack_dir_t;
+
+struct datapack_dirent {
+	const char* name;          /* name relative to directory (null-terminated) */
+	int is_dir;                /* non-zero if name is a subdirectory */
+	const struct datapack_entry* entry; /* file entry (NULL for directories) */
+};
+
+/**
+ * Open a virtual directory for listing its immediate children.
+ *
+ * @param path Directory path (with or without trailing slash), NULL or empty
+ *             string for the root.
+ * @return Directory handle or NULL on errors and errno is set to indicate the error.
+ * @error ENOENT if no entries exists below path.
+ */
+datapack_dir_t datapack_opendir(datapack_t handle, const char* path);
+
+/**
+ * Read next directory entry. Files and subdirectories are returned in sorted
+ * order and each subdirectory is only returned once.
+ *
+ * The returned pointer is valid until the next call using the same dir.
+ * @return Next entry or NULL when there are no more entries.
+ */
+const struct datapack_dirent* datapack_readdir(datapack_dir_t dir);
+
+/**
+ * Close directory handle.
+ */
+void datapack_closedir(datapack_dir_t dir);
+
 /**
  * Open packed file as stream.
  *
@@ -4,6 +4,7 @@
 
 #include "datapack.h"
 #include "pak.h"
+#include "crc32c.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,6 +12,9 @@
 #include <zlib.h>
 #include <errno.h>
 #include <ctype.h>
+#include <fnmatch.h>
+#include <time.h>
+#include <pthread.h>
 
 #ifdef HAVE_SYS_STAT_H
 #include <sys/stat.h>
@@ -40,14 +44,32 @@
 #include <endian.h>
 #endif
 
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
+#include <fcntl.h>
+
 enum type_t {
 	C_SOURCE,
 	BINARY,
 };
 
 #define CHUNK 16384
+#define SOLID_DEFAULT (256*1024)
+#define OUTPUT_BUFFER (256*1024)
+#define SAMPLE (64*1024)
+#define SAMPLE_MIN 4096
+#define DELTA_WINDOW 16
+#define DELTA_PRIME 0x01000193u
+#define EXTRACT_STREAM (4*1024*1024)
+#define EXTRACT_MAX_THREADS 64
+#define ANALYZE_SEGMENT (8*1024*1024) /* recommend segmenting entries larger than this */
 static unsigned char  in[CHUNK];
 static unsigned char out[CHUNK];
+static unsigned char sample[SAMPLE];
+static unsigned char sample_out[SAMPLE + SAMPLE / 8 + 64]; /* must fit compressBound(SAMPLE) */
+static unsigned char scratch[SAMPLE];
 static const char* program_name = NULL;
 static const char* prefix = "";
 static FILE* verbose = NULL;
@@ -58,17 +80,37 @@ static int log_level = 1;
 static const char* struct_attrib = "";
 static const char* data_attrib   = "__attribute__((section (\"datapack\")))";
 static enum type_t type = C_SOURCE;
-
-static const char* shortopts = "r:f:o:d:e:p:s:t:vqhbi";
+static size_t solid_size = 0; /* 0 if solid mode is disabled */
+static size_t segment_size = 0; /* 0 if segmenting is disabled */
+static size_t volume_size = 0; /* 0 if data is not split into volumes */
+static const char* volume_base = NULL; /* volumes are named after the output */
+static size_t num_volumes = 0;
+static int default_level = Z_DEFAULT_COMPRESSION;
+static unsigned int min_saving = 10; /* store entries saving less than this many percent */
+static const char* report_name = NULL; /* write a JSON build report (--report) */
+
+static const char* shortopts = "r:f:T:o:d:e:p:s:t:S::g:V:l:m:L:D:A:x:R:a:vqhbi";
 static struct option longopts[] = {
 	{"from-file", required_argument, 0, 'f'},
 	{"from-dir",  required_argument, 0, 'r'},
+	{"from-tar",  required_argument, 0, 'T'},
 	{"output",    required_argument, 0, 'o'},
 	{"deps",      required_argument, 0, 'd'},
 	{"header",    required_argument, 0, 'e'},
 	{"prefix",    required_argument, 0, 'p'},
 	{"srcdir",    required_argument, 0, 's'},
 	{"type",      required_argument, 0, 't'},
+	{"solid",     optional_argument, 0, 'S'},
+	{"segment-size", required_argument, 0, 'g'},
+	{"volume-size", required_argument, 0, 'V'},
+	{"level",     required_argument, 0, 'l'},
+	{"min-saving",required_argument, 0, 'm'},
+	{"layout-profile", required_argument, 0, 'L'},
+	{"delta-from", required_argument, 0, 'D'},
+	{"append-to", required_argument, 0, 'A'},
+	{"extract",   required_argument, 0, 'x'},
+	{"report",    required_argument, 0, 'R'},
+	{"analyze",   required_argument, 0, 'a'},
 	{"verbose",   no_argument, 0, 'v'},
 	{"quiet",     no_argument, 0, 'q'},
 	{"help",      no_argument, 0, 'h'},
@@ -79,6 +121,8 @@ static void show_usage(){
 	printf("%s-"VERSION"\n"
 	       "(C) 2012 David Sveningsson <ext@sidvind.com>\n"
 	       "Usage: %s [OPTIONS..] DATANAME:FILENAME[:TARGET]..\n"
+	       "   or: %s --extract=PAK [-o DIR] [PATTERN]..\n"
+	       "   or: %s --analyze=PAK [-o FILE] [PATTERN]..\n"
 	       "where: DATANAME is the variable name,\n"
 	       "       FILENAME is the source filename,\n"
 	       "       TARGET is the filename as it appears in binary (default is basename)\n"
@@ -86,8 +130,34 @@ static void show_usage(){
 	       "Options:\n"
 	       "  -f, --from-file=FILE    Read list from file (same format, one entry per line).\n"
 	       "  -r, --from-dir=DIR      Use everything in directory.\n"
-	       "  -o, --output=FILE       Write output to file instead of stdout.\n"
+	       "  -T, --from-tar=FILE     Add the files of a tar archive (- for stdin), read\n"
+	       "                          while packing and added after all other files.\n"
+	       "  -o, --output=FILE       Write output to file instead of stdout (- for stdout).\n"
 	       "  -t, --type=(c|bin)      Output format.\n"
+	       "  -S, --solid[=SIZE]      Compress consecutive files smaller than SIZE into\n"
+	       "                          shared blocks of SIZE bytes, a new block is started\n"
+	       "                          when the compression level changes. [default: 256K]\n"
+	       "  -g, --segment-size=SIZE Split files larger than SIZE into independently\n"
+	       "                          compressed segments which are decompressed in parallel.\n"
+	       "  -V, --volume-size=SIZE  Write data into volume files OUTPUT.1, OUTPUT.2, ..\n"
+	       "                          of at most SIZE bytes, OUTPUT only holds the index.\n"
+	       "  -l, --level=LEVEL       Compression level 0-9 (0 stores data uncompressed).\n"
+	       "  -m, --min-saving=PCT    Store entries uncompressed unless compression saves\n"
+	       "                          at least PCT percent, 0 to disable. [default: 10]\n"
+	       "  -L, --layout-profile=FILE\n"
+	       "                          Order entries by first use in an access trace\n"
+	       "                          recorded with DATAPACK_TRACE.\n"
+	       "  -D, --delta-from=FILE   Write a patch against the binary blob FILE holding\n"
+	       "                          only changed entries, as binary deltas when smaller.\n"
+	       "  -A, --append-to=FILE    Append a binary blob to FILE (e.g. an executable),\n"
+	       "                          replacing a blob appended earlier.\n"
+	       "  -x, --extract=PAK       Extract entries of PAK matching any PATTERN (all by\n"
+	       "                          default) into the directory given by -o.\n"
+	       "  -R, --report=FILE       Write a JSON report with the size, compression time\n"
+	       "                          and estimated decode time of each entry to FILE.\n"
+	       "  -a, --analyze=PAK       Report entries of PAK matching any PATTERN as JSON,\n"
+	       "                          with measured decode time, duplicate content and\n"
+	       "                          recommended compression.\n"
 	       "  -d, --deps=FILE         Write optional Makefile dependency list.\n"
 	       "  -e, --header=FILE       Write optional header-file.\n"
 	       "  -p, --prefix=STRING     Prefix all targets with STRING.\n"
@@ -96,7 +166,11 @@ static void show_usage(){
 	       "  -i, --ignore            Ignore missing files.\n"
 	       "  -v, --verbose           Enable verbose output.\n"
 	       "  -q, --quiet             Quiet mode, only returning error code.\n"
-	       "  -h, --help              This text.\n", program_name, program_name);
+	       "  -h, --help              This text.\n"
+	       "\n"
+	       "Lists given with -f may contain rules overriding the compression of entries\n"
+	       "whose target matches PATTERN (last matching rule wins):\n"
+	       "  %%compress PATTERN (0-9|store)\n", program_name, program_name, program_name, program_name);
 }
 
 struct entry {
@@ -105,12 +179,89 @@ struct entry {
 	char* src;
 	size_t in;
 	size_t out;
+	long offset;        /* offset to data (binary) */
+	size_t block;       /* solid block index or DATAPACK_NO_BLOCK */
+	size_t boffset;     /* offset within solid block */
+	unsigned int flags; /* DATAPACK_* entry flags */
+	size_t ssize;       /* uncompressed segment size */
+	size_t num_segments;
+	uint32_t* segments; /* compressed size of each segment */
+	uint32_t crc;       /* CRC32C of compressed data (binary) */
+	unsigned int volume; /* volume file holding data (binary) */
+	size_t order;       /* position in output when using a layout profile */
+	int omit;           /* unchanged from base pack and left out of the patch */
+	int tar;            /* data is read from the tar stream (src is the member name) */
+	size_t tar_size;    /* size of the tar member */
+	double compress_ms; /* time spent reading and compressing the entry */
+	double decode_ms;   /* estimated inflate time (--report) */
 	struct entry * lnk; /* Pointer to a entry that this is a lnk to, or NULL */
 };
 
+struct block {
+	long offset;
+	size_t csize;
+	size_t usize;
+	uint32_t crc;
+	unsigned int volume;
+};
+
+/**
+ * Compression rule from `%compress PATTERN LEVEL`.
+ */
+struct rule {
+	char* pattern;
+	int level;          /* 0 to store uncompressed */
+};
+
+/**
+ * Input file being packed. The beginning of the file is read up front to
+ * decide how the entry is compressed.
+ */
+struct source {
+	FILE* fp;
+	size_t size;        /* size of file */
+	size_t sampled;     /* bytes read into sample */
+	int complete;       /* set if sample holds the entire file */
+	int level;          /* compression level, 0 to store uncompressed */
+	int incompressible; /* set if level was lowered to 0 by sampling */
+	size_t clen;        /* compressed size of sample (sample_out is valid if non-zero) */
+	double decode_ms;   /* inflate time of sample (only if incompressible) */
+	unsigned char* data; /* entire data if already read into memory (NULL if read from fp) */
+	size_t pos;         /* bytes of data passed on by source_read */
+};
+
 static size_t num_entries = 0;
 static size_t max_entries = 0;
 static struct entry* entries = NULL;
+static size_t* variables = NULL;   /* hash set of variable names (entry index + 1, 0 if empty) */
+static size_t max_variables = 0;
+
+static size_t num_blocks = 0;
+static struct block* blocks = NULL;
+static z_stream solid;        /* stream of the currently open solid block */
+static int solid_open = 0;
+static int solid_level = 0;    /* compression level of the currently open solid block */
+static long output_offset = 0; /* bytes written to binary output (output may not be seekable) */
+static uint32_t output_crc = 0; /* CRC32C of binary output since last reset */
+static datapack_t base = NULL;  /* pack a patch is created against (--delta-from) */
+static uint32_t base_crc = 0;   /* checksum identifying the base pack */
+
+/* tar stream entries are read from while packing (--from-tar) */
+static FILE* tar_fp = NULL;
+static const char* tar_name = NULL;
+static int tar_error = 0;
+
+static size_t num_rules = 0;
+static struct rule* rules = NULL;
+
+/* statistics */
+static size_t stored_entries = 0;
+static size_t stored_bytes = 0;
+static double decode_saved_ms = 0.0; /* estimated inflate time avoided by storing */
+static size_t delta_entries = 0;
+static size_t delta_bytes = 0;    /* size of entries written as deltas */
+static size_t unchanged_entries = 0;
+static size_t deleted_entries = 0;
 
 static char* strip(char* str){
 	char* end = str + strlen(str) - 1; /* pointer to last char */
@@ -122,13 +273,133 @@ static char* strip(char* str){
 	return str;
 }
 
-static int add_entry(char* str){
+static int add_rule(char* str){
+	char* saveptr;
+	const char* directive = strtok_r(str + 1, " \t", &saveptr);
+	const char* pattern = strtok_r(NULL, " \t", &saveptr);
+	const char* setting = strtok_r(NULL, " \t", &saveptr);
+
+	if ( !directive || strcmp(directive, "compress") != 0 || !pattern || !setting ){
+		fprintf(normal, "%s: invalid rule `%s'.\n", program_name, str);
+		return 0;
+	}
+
+	int level;
+	if ( strcmp(setting, "store") == 0 ){
+		level = 0;
+	} else if ( strlen(setting) == 1 && isdigit(setting[0]) ){
+		level = setting[0] - '0';
+	} else {
+		fprintf(normal, "%s: invalid compression `%s' for `%s'.\n", program_name, setting, pattern);
+		return 0;
+	}
+
+	rules = realloc(rules, sizeof(struct rule) * (num_rules + 1));
+	rules[num_rules].pattern = strdup(pattern);
+	rules[num_rules].level = level;
+	num_rules++;
+
+	return 1;
+}
+
+/**
+ * FNV-1a hash of variable name.
+ */
+static size_t hash_variable(const char* str){
+	size_t hash = 14695981039346656037ULL;
+	for ( ; *str; str++ ){
+		hash = (hash ^ (unsigned char)*str) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+/**
+ * Find slot for variable name in the hash set, either holding the entry
+ * with that name or the empty slot where it would be inserted.
+ */
+static size_t* variable_slot(const char* vname){
+	const size_t mask = max_variables - 1;
+	size_t i = hash_variable(vname) & mask;
+	while ( variables[i] && strcmp(entries[variables[i]-1].variable, vname) != 0 ){
+		i = (i + 1) & mask;
+	}
+	return &variables[i];
+}
+
+/**
+ * Keep hash set at most half full.
+ */
+static void variable_reserve(size_t n){
+	if ( n * 2 <= max_variables ){
+		return;
+	}
+
+	free(variables);
+	max_variables = max_variables > 0 ? max_variables * 2 : 1024;
+	variables = calloc(max_variables, sizeof(size_t));
+	for ( size_t i = 0; i < num_entries; i++ ){
+		*variable_slot(entries[i].variable) = i + 1;
+	}
+}
+
+/**
+ * Add an entry after validating the variable name.
+ * @return Entry or NULL if the name is invalid or already used.
+ */
+static struct entry* store_entry(const char* vname, const char* sname, const char* dname){
 	if ( num_entries+1 == max_entries ){
-		max_entries += 256;
+		max_entries *= 2;
 		entries = realloc(entries, sizeof(struct entry)*max_entries);
 		memset(entries+num_entries, 0, sizeof(struct entry)*(max_entries-num_entries));
 	}
 
+	/* sanity check */
+	if ( strlen(vname) >= 64 ){
+		fprintf(normal, "%s: variable name `%s' too long (max: 63, current: %zd)\n", program_name, vname, strlen(vname));
+		return NULL;
+	}
+	for ( unsigned int i = 0; i < strlen(vname); i++ ){
+		if ( !(isalnum(vname[i]) || vname[i] == '_') ){
+			fprintf(normal, "%s: variable name `%s' contains illegal characters.\n", program_name, vname);
+			return NULL;
+		}
+	}
+
+	/* locate duplicates */
+	variable_reserve(num_entries + 1);
+	size_t* slot = variable_slot(vname);
+	if ( *slot ){
+		fprintf(normal, "%s: duplicate variable name `%s'.\n", program_name, vname);
+		return NULL;
+	}
+	*slot = num_entries + 1;
+
+	/* store */
+	struct entry* e = &entries[num_entries];
+	sprintf(e->variable, "%.63s", vname);
+	e->dst = strdup(dname);
+	e->src = strdup(sname);
+	e->in  = 0;
+	e->out = 0;
+	e->offset = 0;
+	e->block = DATAPACK_NO_BLOCK;
+	e->boffset = 0;
+	e->flags = 0;
+	e->ssize = 0;
+	e->volume = 0;
+	e->num_segments = 0;
+	e->segments = NULL;
+	e->tar = 0;
+	e->tar_size = 0;
+	e->compress_ms = 0.0;
+	e->decode_ms = 0.0;
+	e->lnk = NULL;
+	num_entries++;
+
+	return e;
+}
+
+static int add_entry(char* str){
 	/* strip leading and trailing whitespace (including newline) */
 	str = strip(str);
 
@@ -137,6 +408,11 @@ static int add_entry(char* str){
 		return 1;
 	}
 
+	/* compression rules */
+	if ( str[0] == '%' ){
+		return add_rule(str);
+	}
+
 	char* vname = str;
 
 	/* locate filename */
@@ -160,38 +436,7 @@ static int add_entry(char* str){
 		dname = delim+1;
 	}
 
-	/* sanity check */
-	if ( strlen(vname) >= 64 ){
-		fprintf(normal, "%s: variable name `%s' too long (max: 63, current: %zd)\n", program_name, vname, strlen(vname));
-		return 0;
-	}
-	for ( unsigned int i = 0; i < strlen(vname); i++ ){
-		if ( !(isalnum(vname[i]) || vname[i] == '_') ){
-			fprintf(normal, "%s: variable name `%s' contains illegal characters.\n", program_name, vname);
-			return 0;
-		}
-	}
-
-	/* locate duplicates */
-	for ( unsigned int i = 0; i < num_entries; i++ ){
-		const struct entry* e = &entries[i];
-		if ( strcmp(e->variable, vname) == 0 ){
-			fprintf(normal, "%s: duplicate variable name `%s'.\n", program_name, vname);
-			return 0;
-		}
-	}
-
-	/* store */
-	struct entry* e = &entries[num_entries];
-	sprintf(e->variable, "%.63s", vname);
-	e->dst = strdup(dname);
-	e->src = strdup(sname);
-	e->in  = 0;
-	e->out = 0;
-	e->lnk = NULL;
-	num_entries++;
-
-	return 1;
+	return store_entry(vname, sname, dname) != NULL;
 }
 
 static struct entry * find_entry(const char * path) {
@@ -205,7 +450,36 @@ static struct entry * find_entry(const char * path) {
 	return NULL;
 }
 
-int parse_dir(const char* internal_path, const char* base_path) {
+#define SCAN_MAX_THREADS 16
+
+/**
+ * Shared state of the directory scanner. Workers take pending directories
+ * from the queue, push subdirectories back and collect files.
+ */
+struct scan {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	const char* base_path;
+	size_t num_dirs, max_dirs;
+	char** dirs;                   /* pending directories (internal paths) */
+	size_t busy;                   /* workers currently scanning a directory */
+	size_t num_files, max_files;
+	char** files;                  /* files found (internal paths) */
+	int error;
+};
+
+static void scan_push(char*** list, size_t* num, size_t* max, char* item){
+	if ( *num == *max ){
+		*max = *max > 0 ? *max * 2 : 64;
+		*list = realloc(*list, sizeof(char*) * *max);
+	}
+	(*list)[(*num)++] = item;
+}
+
+/**
+ * Read a single directory, returning subdirectories and files in the lists.
+ */
+static int scan_dir(const char* base_path, const char* internal_path, char*** dirs, size_t* num_dirs, size_t* max_dirs, char*** files, size_t* num_files, size_t* max_files){
 	char* path = NULL;
 	if(asprintf(&path, "%s/%s", base_path, internal_path) == -1) {
 		fprintf(verbose, "%s: asprintf returned -1\n", program_name);
@@ -213,13 +487,12 @@ int parse_dir(const char* internal_path, const char* base_path) {
 	}
 
 	DIR* dir = opendir(path);
-	free(path);
 	if ( !dir ){
-		fprintf(verbose, "%s: failed to read directory `%s': %s.\n", program_name, optarg, strerror(errno));
+		fprintf(verbose, "%s: failed to read directory `%s': %s.\n", program_name, path, strerror(errno));
+		free(path);
 		return 1;
 	}
 
-	char* line = NULL;
 	struct dirent* entry = NULL;
 	while( ( entry = readdir(dir)) != NULL) {
 		if(entry->d_name[0] == '.') continue; //Ignore hidden files and .., .
@@ -227,47 +500,407 @@ int parse_dir(const char* internal_path, const char* base_path) {
 		char* internal = NULL;
 		if(asprintf(&internal, "%s/%s", internal_path, entry->d_name) == -1) {
 			fprintf(verbose, "%s: asprintf returned -1\n", program_name);
+			closedir(dir);
+			free(path);
 			return 1;
 		}
 
-		char* var_name = strdup(internal);
-
-		for ( unsigned int i=0; i<strlen(var_name); ++i ) {
-			if(!isalnum(var_name[i]) && var_name[i] != '_') {
-				var_name[i] = '_';
+		/* not all filesystems report the type */
+		unsigned char type = entry->d_type;
+		if ( type == DT_UNKNOWN ){
+			struct stat st;
+			char* full = NULL;
+			if ( asprintf(&full, "%s/%s", path, entry->d_name) != -1 && lstat(full, &st) == 0 ){
+				type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
 			}
+			free(full);
 		}
 
-		switch(entry->d_type) {
+		switch(type) {
 			case DT_LNK:
 			case DT_REG:
-				{
-					if(asprintf(&line, "%s:%s:%s", var_name, internal, internal) == -1) {
-						fprintf(verbose, "%s: asprintf returned -1\n", program_name);
-						return 1;
-					}
-					add_entry(line);
-					free(line);
-				}
+				scan_push(files, num_files, max_files, internal);
 				break;
 			case DT_DIR:
-				{
-					if(parse_dir(internal, base_path)) {
-						free(internal);
-						free(var_name);
-						return 1;
-					}
-				}
+				scan_push(dirs, num_dirs, max_dirs, internal);
+				break;
+			default:
+				free(internal);
+				break;
+		}
+	}
+
+	closedir(dir);
+	free(path);
+	return 0;
+}
+
+static void* scan_worker(void* ptr){
+	struct scan* scan = (struct scan*)ptr;
+	size_t num_dirs = 0, max_dirs = 0, num_files = 0, max_files = 0;
+	char** dirs = NULL;
+	char** files = NULL;
+
+	pthread_mutex_lock(&scan->lock);
+	for (;;){
+		while ( scan->num_dirs == 0 && scan->busy > 0 && !scan->error ){
+			pthread_cond_wait(&scan->cond, &scan->lock);
+		}
+		if ( scan->num_dirs == 0 || scan->error ){
 			break;
 		}
+
+		char* internal = scan->dirs[--scan->num_dirs];
+		scan->busy++;
+		pthread_mutex_unlock(&scan->lock);
+
+		const int ret = scan_dir(scan->base_path, internal, &dirs, &num_dirs, &max_dirs, &files, &num_files, &max_files);
 		free(internal);
+
+		pthread_mutex_lock(&scan->lock);
+		scan->busy--;
+		scan->error |= ret;
+		for ( size_t i = 0; i < num_dirs; i++ ){
+			scan_push(&scan->dirs, &scan->num_dirs, &scan->max_dirs, dirs[i]);
+		}
+		for ( size_t i = 0; i < num_files; i++ ){
+			scan_push(&scan->files, &scan->num_files, &scan->max_files, files[i]);
+		}
+		num_dirs = 0;
+		num_files = 0;
+		pthread_cond_broadcast(&scan->cond);
+	}
+	pthread_cond_broadcast(&scan->cond);
+	pthread_mutex_unlock(&scan->lock);
+
+	free(dirs);
+	free(files);
+	return NULL;
+}
+
+static int compare_path(const void* a, const void* b){
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/**
+ * Add all files below a directory. Directories are read by several threads
+ * and the files are added in sorted order so output does not depend on the
+ * order the filesystem returns entries.
+ */
+int parse_dir(const char* internal_path, const char* base_path) {
+	struct scan scan;
+	memset(&scan, 0, sizeof(scan));
+	pthread_mutex_init(&scan.lock, NULL);
+	pthread_cond_init(&scan.cond, NULL);
+	scan.base_path = base_path;
+	scan_push(&scan.dirs, &scan.num_dirs, &scan.max_dirs, strdup(internal_path));
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	const size_t num_threads = cpus < 1 ? 1 : cpus > SCAN_MAX_THREADS ? SCAN_MAX_THREADS : (size_t)cpus;
+	pthread_t thread[SCAN_MAX_THREADS];
+	size_t started = 0;
+	for ( ; started + 1 < num_threads; started++ ){
+		if ( pthread_create(&thread[started], NULL, scan_worker, &scan) != 0 ) break;
+	}
+	scan_worker(&scan);
+	for ( size_t i = 0; i < started; i++ ){
+		pthread_join(thread[i], NULL);
+	}
+	pthread_cond_destroy(&scan.cond);
+	pthread_mutex_destroy(&scan.lock);
+
+	qsort(scan.files, scan.num_files, sizeof(char*), compare_path);
+
+	for ( size_t i = 0; i < scan.num_files; i++ ){
+		char* internal = scan.files[i];
+		char* var_name = strdup(internal);
+		for ( unsigned int j=0; j<strlen(var_name); ++j ) {
+			if(!isalnum(var_name[j]) && var_name[j] != '_') {
+				var_name[j] = '_';
+			}
+		}
+
+		char* line = NULL;
+		if ( !scan.error && asprintf(&line, "%s:%s:%s", var_name, internal, internal) != -1 ){
+			add_entry(line);
+			free(line);
+		}
 		free(var_name);
+		free(internal);
 	}
+	for ( size_t i = 0; i < scan.num_dirs; i++ ){
+		free(scan.dirs[i]);
+	}
+	free(scan.dirs);
+	free(scan.files);
 
-	closedir(dir);
+	return scan.error;
+}
+
+#define TAR_BLOCK 512
+
+/**
+ * Member of the tar stream being read. The data is padded to a multiple of
+ * TAR_BLOCK bytes.
+ */
+struct tar_member {
+	size_t left;        /* bytes of data not yet read */
+	size_t padding;
+};
+
+/**
+ * Discard bytes from the tar stream (which may not be seekable).
+ */
+static int tar_skip(size_t bytes){
+	while ( bytes > 0 ){
+		const size_t n = bytes < CHUNK ? bytes : CHUNK;
+		if ( fread(in, 1, n, tar_fp) != n ){
+			return 1;
+		}
+		bytes -= n;
+	}
 	return 0;
 }
 
+static ssize_t tar_read(void* cookie, char* buf, size_t size){
+	struct tar_member* member = (struct tar_member*)cookie;
+	if ( size > member->left ){
+		size = member->left;
+	}
+	const size_t bytes = fread(buf, 1, size, tar_fp);
+	member->left -= bytes;
+	if ( bytes < size ){
+		const int err = ferror(tar_fp) ? errno : EIO;
+		fprintf(stderr, "%s: failed to read `%s': %s\n", program_name, tar_name,
+		        ferror(tar_fp) ? strerror(err) : "unexpected end of archive");
+		errno = err;
+		return -1;
+	}
+	return (ssize_t)bytes;
+}
+
+static int tar_close(void* cookie){
+	struct tar_member* member = (struct tar_member*)cookie;
+	const int ret = tar_skip(member->left + member->padding);
+	free(member);
+	return ret ? -1 : 0;
+}
+
+/**
+ * Open the data of the current tar member as a stream limited to its size.
+ * Closing it skips to the next header.
+ */
+static FILE* tar_open(const struct entry* e){
+	struct tar_member* member = (struct tar_member*)malloc(sizeof(struct tar_member));
+	if ( !member ){
+		return NULL;
+	}
+	member->left = e->tar_size;
+	member->padding = (TAR_BLOCK - e->tar_size % TAR_BLOCK) % TAR_BLOCK;
+
+	cookie_io_functions_t io = {tar_read, NULL, NULL, tar_close};
+	FILE* fp = fopencookie(member, "r", io);
+	if ( !fp ){
+		free(member);
+	}
+	return fp;
+}
+
+/**
+ * Parse a numeric tar header field, either octal or base-256 (GNU) when the
+ * high bit of the first byte is set.
+ */
+static size_t tar_number(const char* field, size_t len){
+	size_t value = 0;
+	if ( (unsigned char)field[0] & 0x80 ){
+		for ( size_t i = 1; i < len; i++ ){
+			value = (value << 8) | (unsigned char)field[i];
+		}
+		return value;
+	}
+	for ( size_t i = 0; i < len && field[i] >= '0' && field[i] <= '7'; i++ ){
+		value = value * 8 + (size_t)(field[i] - '0');
+	}
+	return value;
+}
+
+/**
+ * Read the data of a member holding a filename (GNU long name) or pax
+ * extended attributes into a buffer.
+ */
+static char* tar_slurp(size_t size){
+	char* data = (char*)malloc(size + 1);
+	if ( !data || fread(data, 1, size, tar_fp) != size || tar_skip((TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK) != 0 ){
+		free(data);
+		return NULL;
+	}
+	data[size] = 0;
+	return data;
+}
+
+/**
+ * Take path and size from pax extended attributes ("LEN KEY=VALUE\n" records).
+ */
+static void tar_pax(const char* data, size_t size, char** path, size_t* file_size, int* have_size){
+	const char* end = data + size;
+	while ( data < end ){
+		char* next;
+		const size_t len = strtoul(data, &next, 10);
+		if ( len == 0 || len > (size_t)(end - data) || *next != ' ' ){
+			return;
+		}
+		const char* key = next + 1;
+		const char* value = strchr(key, '=');
+		const char* last = data + len - 1; /* trailing newline */
+		if ( value && value < last ){
+			value++;
+			if ( strncmp(key, "path=", 5) == 0 ){
+				free(*path);
+				*path = strndup(value, (size_t)(last - value));
+			} else if ( strncmp(key, "size=", 5) == 0 ){
+				*file_size = strtoull(value, NULL, 10);
+				*have_size = 1;
+			}
+		}
+		data += len;
+	}
+}
+
+/**
+ * Read headers up to the next regular file in the tar stream and add it as an
+ * entry, named as in the archive (without leading `./' or `/').
+ * @return 1 if an entry was added, 0 at the end of the archive and -1 on errors.
+ */
+static int tar_next(void){
+	char* path = NULL;             /* from a preceding GNU long name or pax header */
+	size_t pax_size = 0;
+	int have_size = 0;
+
+	for (;;){
+		unsigned char header[TAR_BLOCK];
+		if ( fread(header, 1, TAR_BLOCK, tar_fp) != TAR_BLOCK ){
+			fprintf(stderr, "%s: failed to read `%s': %s\n", program_name, tar_name,
+			        ferror(tar_fp) ? strerror(errno) : "unexpected end of archive");
+			free(path);
+			return -1;
+		}
+
+		/* archive ends with zero blocks, checksum counts the checksum field as spaces
+		 * (some implementations sum signed bytes) */
+		unsigned int sum = 0;
+		int signed_sum = 0;
+		for ( size_t i = 0; i < TAR_BLOCK; i++ ){
+			const unsigned char byte = i >= 148 && i < 156 ? ' ' : header[i];
+			sum += byte;
+			signed_sum += (signed char)byte;
+		}
+		if ( sum == 8 * ' ' ){
+			free(path);
+			return 0;
+		}
+		const size_t checksum = tar_number((const char*)header + 148, 8);
+		if ( checksum != sum && checksum != (size_t)(unsigned int)signed_sum ){
+			fprintf(stderr, "%s: `%s' is not a tar archive or is corrupt\n", program_name, tar_name);
+			free(path);
+			return -1;
+		}
+
+		const char type = (char)header[156];
+		size_t size = tar_number((const char*)header + 124, 12);
+
+		/* metadata for the following member */
+		if ( type == 'L' || type == 'x' ){
+			char* data = tar_slurp(size);
+			if ( !data ){
+				fprintf(stderr, "%s: failed to read `%s': %s\n", program_name, tar_name, "unexpected end of archive");
+				free(path);
+				return -1;
+			}
+			if ( type == 'L' ){
+				free(path);
+				path = data;
+				continue;
+			}
+			tar_pax(data, size, &path, &pax_size, &have_size);
+			free(data);
+			continue;
+		}
+		if ( have_size ){
+			size = pax_size;
+		}
+
+		/* ustar splits long names into prefix and name */
+		if ( !path ){
+			const char* prefix = (const char*)header + 345;
+			const int plen = memcmp(header + 257, "ustar", 5) == 0 ? (int)strnlen(prefix, 155) : 0;
+			if ( asprintf(&path, "%.*s%s%.*s", plen, prefix, plen > 0 ? "/" : "", (int)strnlen((const char*)header, 100), (const char*)header) == -1 ){
+				return -1;
+			}
+		}
+
+		/* only regular files become entries */
+		const char* name = path + strspn(path, "/");
+		while ( strncmp(name, "./", 2) == 0 ){
+			name += 2 + strspn(name + 2, "/");
+		}
+		if ( (type != '0' && type != '\0' && type != '7') || *name == 0 ){
+			if ( type != '5' && type != 'g' ){
+				fprintf(verbose, "%s: skipping `%s' in `%s' (not a regular file)\n", program_name, name, tar_name);
+			}
+			free(path);
+			path = NULL;
+			have_size = 0;
+			if ( tar_skip(size + (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK) != 0 ){
+				fprintf(stderr, "%s: failed to read `%s': %s\n", program_name, tar_name, "unexpected end of archive");
+				return -1;
+			}
+			continue;
+		}
+
+		/* variable names are derived from the name like for --from-dir, names
+		 * too long for a variable are cut and made unique by the entry number */
+		char vname[64];
+		snprintf(vname, sizeof(vname), "%s", name);
+		if ( strlen(name) >= sizeof(vname) ){
+			snprintf(vname + 40, sizeof(vname) - 40, "_%zu", num_entries);
+		}
+		for ( char* c = vname; *c; c++ ){
+			if ( !isalnum(*c) && *c != '_' ){
+				*c = '_';
+			}
+		}
+		char* dname = NULL;
+		struct entry* e = NULL;
+		if ( asprintf(&dname, "%s%s", prefix, name) != -1 ){
+			e = store_entry(vname, name, dname);
+		}
+		free(dname);
+		free(path);
+		if ( !e ){
+			return -1;
+		}
+		e->tar = 1;
+		e->tar_size = size;
+		return 1;
+	}
+}
+
+/**
+ * Entry at position i. Once the entries given up front are exhausted the next
+ * member of the tar stream is added, so the stream is read while packing.
+ * @return Entry or NULL after the last entry (check tar_error).
+ */
+static struct entry* entry_at(size_t i){
+	if ( i == num_entries && tar_fp && !tar_error ){
+		const int ret = tar_next();
+		if ( ret <= 0 ){
+			tar_error = ret < 0;
+			tar_fp = NULL;
+		}
+	}
+	return i < num_entries ? &entries[i] : NULL;
+}
+
 static void write_prelude(FILE* dst){
 	fprintf(dst, "#include \"datapack.h\"\n\n");
 }
@@ -308,234 +941,1802 @@ static size_t write_bytes_source(FILE* dst, const unsigned char* src, size_t byt
 }
 
 static size_t write_bytes_binary(FILE* dst, const unsigned char* src, size_t bytes){
-	return fwrite(src, 1, bytes, dst);
+	const size_t written = fwrite(src, 1, bytes, dst);
+	output_offset += (long)written;
+	output_crc = datapack_crc32c(output_crc, src, written);
+	return written;
 }
 
-static int write_compressed(FILE* src, FILE* dst, struct entry* e, size_t* csize_ptr, size_t* usize_ptr, size_t(*write_bytes)(FILE*, const unsigned char*, size_t)){
-	z_stream strm;
-	int flush;
-
-	strm.zalloc = Z_NULL;
-	strm.zfree = Z_NULL;
-	strm.opaque = Z_NULL;
+/**
+ * Run deflate with given flush mode until all pending output is written.
+ * @return Number of bytes written.
+ */
+static size_t deflate_drain(z_stream* strm, FILE* dst, int flush, size_t(*write_bytes)(FILE*, const unsigned char*, size_t)){
+	size_t bytes = 0;
+	do {
+		strm->avail_out = CHUNK;
+		strm->next_out = out;
+		deflate(strm, flush);
 
-	int ret = deflateInit(&strm, Z_DEFAULT_COMPRESSION);
+		unsigned int have = CHUNK - strm->avail_out;
+		bytes += write_bytes(dst, out, have);
+	} while (strm->avail_out == 0);
+	return bytes;
+}
+
+static double elapsed_ms(const struct timespec* begin){
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (double)(end.tv_sec - begin->tv_sec) * 1e3 + (double)(end.tv_nsec - begin->tv_nsec) / 1e6;
+}
+
+/**
+ * Get compression level for entry using the last matching rule.
+ */
+static int entry_level(const struct entry* e){
+	int level = default_level;
+	for ( size_t i = 0; i < num_rules; i++ ){
+		if ( fnmatch(rules[i].pattern, e->dst, 0) == 0 ){
+			level = rules[i].level;
+		}
+	}
+	return level;
+}
+
+/**
+ * Open entry source and decide how it is compressed. Data which does not
+ * compress well is stored as-is since inflating it only costs time at runtime.
+ */
+static int source_open(struct source* src, struct entry* e){
+	src->fp = e->tar ? tar_open(e) : fopen(e->src, "r");
+	if ( !src->fp ){
+		if ( missing_fatal ){
+			fprintf(stderr, "%s: failed to read `%s'.\n", program_name, e->src);
+			return 1;
+		}
+
+		fprintf(normal, "%s: failed to read `%s', ignored.\n", program_name, e->src);
+		return 1;
+	}
+
+	src->sampled = fread(sample, 1, SAMPLE, src->fp);
+	if ( ferror(src->fp) ){
+		fclose(src->fp);
+		return 1;
+	}
+	src->complete = src->sampled < SAMPLE;
+	src->level = entry_level(e);
+	src->incompressible = 0;
+	src->clen = 0;
+	src->decode_ms = 0.0;
+	src->data = NULL;
+	src->pos = 0;
+
+	struct stat st;
+	if ( e->tar ){
+		src->size = e->tar_size;
+	} else {
+		src->size = src->complete ? src->sampled : (fstat(fileno(src->fp), &st) == 0 ? (size_t)st.st_size : 0);
+	}
+
+	if ( src->level == 0 || min_saving == 0 || src->sampled == 0 ){
+		return 0;
+	}
+
+	/* tiny files destined for a solid block compress well together even if
+	 * they do not by themselves */
+	if ( solid_size > 0 && src->size < solid_size && src->sampled < SAMPLE_MIN ){
+		return 0;
+	}
+
+	/* trial compression of sample */
+	uLongf clen = sizeof(sample_out);
+	if ( compress2(sample_out, &clen, sample, src->sampled, src->level) != Z_OK ){
+		return 0;
+	}
+	src->clen = clen;
+	if ( clen * 100 <= src->sampled * (100 - min_saving) ){
+		return 0;
+	}
+
+	/* measure what inflating it would have cost */
+	struct timespec begin;
+	uLongf ulen = sizeof(scratch);
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	uncompress(scratch, &ulen, sample_out, clen);
+	src->decode_ms = elapsed_ms(&begin);
+	src->level = 0;
+	src->incompressible = 1;
+
+	return 0;
+}
+
+static void source_close(struct source* src){
+	free(src->data);
+	fclose(src->fp);
+}
+
+/**
+ * Estimate inflate time of entry by timing inflate of the compressed sample,
+ * scaled to the size of the entry. Stored entries cost nothing to decode.
+ */
+static double estimate_decode(const struct source* src){
+	if ( src->level == 0 || src->sampled == 0 ){
+		return 0.0;
+	}
+
+	uLongf clen = src->clen;
+	if ( clen == 0 ){
+		clen = sizeof(sample_out);
+		if ( compress2(sample_out, &clen, sample, src->sampled, src->level) != Z_OK ){
+			return 0.0;
+		}
+	}
+
+	struct timespec begin;
+	uLongf ulen = sizeof(scratch);
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	uncompress(scratch, &ulen, sample_out, clen);
+	return elapsed_ms(&begin) * (double)src->size / (double)src->sampled;
+}
+
+/**
+ * Read next chunk of source data, beginning with the sample.
+ * @return Number of bytes read, 0 on end-of-file.
+ */
+static size_t source_read(struct source* src, const unsigned char** ptr, int* first){
+	if ( *first ){
+		*first = 0;
+		*ptr = sample;
+		return src->sampled;
+	}
+	if ( src->complete ){
+		return 0;
+	}
+	if ( src->data ){
+		const size_t bytes = src->size - src->pos < CHUNK ? src->size - src->pos : CHUNK;
+		*ptr = src->data + src->pos;
+		src->pos += bytes;
+		return bytes;
+	}
+
+	*ptr = in;
+	return fread(in, 1, CHUNK, src->fp);
+}
+
+static int write_compressed(struct source* src, FILE* dst, struct entry* e, size_t(*write_bytes)(FILE*, const unsigned char*, size_t)){
+	const unsigned char* ptr;
+	int first = 1;
+	size_t bytes;
+
+	e->in = 0;
+	e->out = 0;
+
+	/* store data uncompressed */
+	if ( src->level == 0 ){
+		while ( (bytes=source_read(src, &ptr, &first)) > 0 ){
+			e->out += bytes;
+			e->in += write_bytes(dst, ptr, bytes);
+		}
+		if ( ferror(src->fp) ){
+			return 1;
+		}
+
+		e->flags |= DATAPACK_STORED;
+		stored_entries++;
+		stored_bytes += e->out;
+		if ( src->incompressible ){
+			decode_saved_ms += src->decode_ms * (double)e->out / (double)src->sampled;
+			fprintf(verbose, "  stored uncompressed (compression saves less than %u%%)\n", min_saving);
+		}
+		return 0;
+	}
+
+	/* entire file was already compressed by sampling */
+	if ( src->complete && src->clen > 0 ){
+		e->out = src->sampled;
+		e->in = write_bytes(dst, sample_out, src->clen);
+		return 0;
+	}
+
+	z_stream strm;
+	strm.zalloc = Z_NULL;
+	strm.zfree = Z_NULL;
+	strm.opaque = Z_NULL;
+
+	int ret = deflateInit(&strm, src->level);
 	if (ret != Z_OK){
-		fclose(src);
 		return 1;
 	}
 
-	size_t usize = 0;
-	size_t csize = 0;
+	int flush;
 	do {
-		strm.avail_in = (unsigned int) fread(in, 1, CHUNK, src);
-		usize += strm.avail_in;
-		if (ferror(src)) {
+		strm.avail_in = (unsigned int) source_read(src, &ptr, &first);
+		strm.next_in = (Bytef*)ptr;
+		e->out += strm.avail_in;
+		if (ferror(src->fp)) {
 			deflateEnd(&strm);
 			return 1;
 		}
-		flush = feof(src) ? Z_FINISH : Z_NO_FLUSH;
-		strm.next_in = in;
+		flush = strm.avail_in == 0 ? Z_FINISH : Z_NO_FLUSH;
+		e->in += deflate_drain(&strm, dst, flush, write_bytes);
+	} while (flush != Z_FINISH);
+	deflateEnd(&strm);
+
+	return 0;
+}
+
+/**
+ * Tell if entry should be split into segments.
+ */
+static int is_segmented(const struct source* src){
+	return segment_size > 0 && src->level != 0 && src->size > segment_size;
+}
 
-		do {
-			strm.avail_out = CHUNK;
-			strm.next_out = out;
-			deflate(&strm, flush);
+static void push_segment(struct entry* e, size_t csize){
+	e->segments = realloc(e->segments, sizeof(uint32_t) * (e->num_segments + 1));
+	e->segments[e->num_segments++] = (uint32_t)csize;
+	e->in += csize;
+}
 
-			unsigned int have = CHUNK - strm.avail_out;
-			csize += write_bytes(dst, out, have);
-		} while (strm.avail_out == 0);
-	} while (flush != Z_FINISH);
+/**
+ * Compress entry as a series of independent streams of segment_size
+ * uncompressed bytes each.
+ */
+static int write_segmented(struct source* src, FILE* dst, struct entry* e, size_t(*write_bytes)(FILE*, const unsigned char*, size_t)){
+	const unsigned char* ptr;
+	int first = 1;
+	size_t bytes;
+
+	z_stream strm;
+	strm.zalloc = Z_NULL;
+	strm.zfree = Z_NULL;
+	strm.opaque = Z_NULL;
+	if ( deflateInit(&strm, src->level) != Z_OK ){
+		return 1;
+	}
+
+	e->in = 0;
+	e->out = 0;
+	e->ssize = segment_size;
+	e->flags |= DATAPACK_SEGMENTED;
+
+	size_t used = 0;  /* uncompressed bytes in current segment */
+	size_t csize = 0; /* compressed bytes in current segment */
+	while ( (bytes=source_read(src, &ptr, &first)) > 0 ){
+		while ( bytes > 0 ){
+			const size_t n = bytes < segment_size - used ? bytes : segment_size - used;
+			strm.next_in = (Bytef*)ptr;
+			strm.avail_in = (unsigned int)n;
+			csize += deflate_drain(&strm, dst, Z_NO_FLUSH, write_bytes);
+			ptr += n;
+			bytes -= n;
+			used += n;
+			e->out += n;
+
+			if ( used == segment_size ){
+				csize += deflate_drain(&strm, dst, Z_FINISH, write_bytes);
+				push_segment(e, csize);
+				deflateReset(&strm);
+				used = 0;
+				csize = 0;
+			}
+		}
+	}
+	if ( ferror(src->fp) ){
+		deflateEnd(&strm);
+		return 1;
+	}
+	if ( used > 0 ){
+		csize += deflate_drain(&strm, dst, Z_FINISH, write_bytes);
+		push_segment(e, csize);
+	}
 	deflateEnd(&strm);
 
-	*csize_ptr = csize;
-	*usize_ptr = usize;
-	return 0;
-}
+	return 0;
+}
+
+/**
+ * Tell if entry should be stored in a solid block.
+ */
+static int is_solid(const struct source* src){
+	return solid_size > 0 && src->level != 0 && src->size < solid_size;
+}
+
+/**
+ * Open a new solid block compressed using level, blocks only hold entries
+ * using the same level.
+ */
+static int solid_begin(long offset, int level){
+	solid.zalloc = Z_NULL;
+	solid.zfree = Z_NULL;
+	solid.opaque = Z_NULL;
+	if ( deflateInit(&solid, level) != Z_OK ){
+		return 1;
+	}
+	solid_level = level;
+
+	blocks = realloc(blocks, sizeof(struct block) * (num_blocks + 1));
+	blocks[num_blocks].offset = offset;
+	blocks[num_blocks].csize = 0;
+	blocks[num_blocks].usize = 0;
+	blocks[num_blocks].crc = 0;
+	blocks[num_blocks].volume = (unsigned int)num_volumes;
+	num_blocks++;
+	output_crc = 0;
+	solid_open = 1;
+
+	return 0;
+}
+
+static void solid_end(FILE* dst, size_t(*write_bytes)(FILE*, const unsigned char*, size_t)){
+	struct block* b = &blocks[num_blocks-1];
+
+	solid.avail_in = 0;
+	solid.next_in = in;
+	b->csize += deflate_drain(&solid, dst, Z_FINISH, write_bytes);
+	b->crc = output_crc;
+	deflateEnd(&solid);
+	solid_open = 0;
+}
+
+/**
+ * Append entry to the currently open solid block.
+ */
+static int write_solid(struct source* src, FILE* dst, struct entry* e, size_t(*write_bytes)(FILE*, const unsigned char*, size_t)){
+	struct block* b = &blocks[num_blocks-1];
+	const unsigned char* ptr;
+	int first = 1;
+
+	e->block = num_blocks - 1;
+	e->boffset = b->usize;
+	e->in = 0;
+	e->out = 0;
+	while ( (solid.avail_in=(unsigned int)source_read(src, &ptr, &first)) > 0 ){
+		solid.next_in = (Bytef*)ptr;
+		e->out += solid.avail_in;
+		b->csize += deflate_drain(&solid, dst, Z_NO_FLUSH, write_bytes);
+	}
+	if ( ferror(src->fp) ){
+		return 1;
+	}
+	b->usize += e->out;
+
+	return 0;
+}
+
+static int write_regular(struct source* src, FILE* dst, struct entry* e){
+	fprintf(dst, "static const char %s_buf[] %s = \"", e->variable, data_attrib);
+	if ( is_segmented(src) ){
+		if ( write_segmented(src, dst, e, write_bytes_source) != 0 ){
+			return 1;
+		}
+	} else if ( write_compressed(src, dst, e, write_bytes_source) != 0 ){
+		return 1;
+	}
+	fprintf(dst, "\";\n");
+
+	if ( e->segments ){
+		fprintf(dst, "static const uint32_t %s_segments[] = {", e->variable);
+		for ( size_t i = 0; i < e->num_segments; i++ ){
+			fprintf(dst, "%s%u", i > 0 ? ", " : "", e->segments[i]);
+		}
+		fprintf(dst, "};\n");
+	}
+
+	return 0;
+}
+
+static int write_data(FILE* dst){
+	int files = 0;
+
+	for ( size_t i = 0; ; i++ ){
+		struct entry* e = entry_at(i);
+		if ( !e ) break;
+		fprintf(verbose, "Processing %s from `%s' to `%s'\n", e->variable, e->src, e->dst);
+
+		struct stat st;
+		st.st_mode = S_IFREG;
+		if ( !e->tar ){
+			lstat(e->src, &st);
+		}
+
+		int ret;
+		struct source src;
+		struct timespec begin;
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		if ( S_ISLNK(st.st_mode) ) {
+			ret = write_symlink(dst, e);
+		} else if ( (ret=source_open(&src, e)) == 0 ){
+			if ( is_solid(&src) ){
+				if ( solid_open && solid_level != src.level ){
+					solid_end(dst, write_bytes_source);
+					fprintf(dst, "\";\n");
+				}
+				if ( !solid_open ){
+					if ( solid_begin(0, src.level) != 0 ) return -1;
+					fprintf(dst, "static const char datapack_block%zd_buf[] %s = \"", num_blocks-1, data_attrib);
+				}
+				ret = write_solid(&src, dst, e, write_bytes_source);
+				if ( blocks[num_blocks-1].usize >= solid_size ){
+					solid_end(dst, write_bytes_source);
+					fprintf(dst, "\";\n");
+				}
+			} else {
+				if ( solid_open ){
+					solid_end(dst, write_bytes_source);
+					fprintf(dst, "\";\n");
+				}
+				ret = write_regular(&src, dst, e);
+			}
+			source_close(&src);
+			e->compress_ms = elapsed_ms(&begin);
+			if ( report_name ){
+				e->decode_ms = estimate_decode(&src);
+			}
+			if ( ret == 0 ){
+				files++;
+			}
+		}
+
+		if ( ret != 0 ){
+			free(e->dst);
+			e->dst = NULL; /* mark as invalid */
+			if ( missing_fatal ){
+				return -1;
+			}
+		}
+	}
+
+	if ( tar_error ){
+		return -1;
+	}
+
+	if ( solid_open ){
+		solid_end(dst, write_bytes_source);
+		fprintf(dst, "\";\n");
+	}
+
+	fprintf(dst, "\n");
+	return files;
+}
+
+static void write_entries(FILE* dst){
+	for ( size_t i = 0; i < num_blocks; i++ ){
+		fprintf(dst, "static const struct datapack_block datapack_block%zd = {datapack_block%zd_buf, 0, %zd, %zd};\n",
+		        i, i, blocks[i].csize, blocks[i].usize);
+	}
+	for ( struct entry* e = &entries[0]; e->src; e++ ){
+		if ( !e->dst ) continue;
+		struct entry * real = e;
+		if(e->lnk != NULL) real = e->lnk;
+		if ( real->block != DATAPACK_NO_BLOCK ){
+			fprintf(dst, "struct datapack_entry %s %s = {0, \"%s\", NULL, 0, 0, %zd, &datapack_block%zd, %zd, 0x%x};\n",
+			        e->variable, struct_attrib, e->dst, real->out, real->block, real->boffset, real->flags);
+			continue;
+		}
+		if ( real->segments ){
+			fprintf(dst, "struct datapack_entry %s %s = {0, \"%s\", %s_buf, 0, %zd, %zd, NULL, 0, 0x%x, %zd, %s_segments};\n",
+			        e->variable, struct_attrib, e->dst, real->variable, real->in, real->out, real->flags, real->ssize, real->variable);
+			continue;
+		}
+		fprintf(dst, "struct datapack_entry %s %s = {0, \"%s\", %s_buf, 0, %zd, %zd, NULL, 0, 0x%x};\n",
+		        e->variable, struct_attrib, e->dst, real->variable, real->in, real->out, real->flags);
+	};
+	fprintf(dst, "\n");
+}
+
+static void write_dependencies(const char* filename, const char* output){
+	if ( !filename ) return;
+
+	fprintf(verbose, "%s: writing Makefile dependencies to `%s'\n", program_name, filename);
+	FILE* fp = fopen(filename, "w");
+	if ( !fp ){
+		fprintf(normal, "%s: failed to write Makefile dependencies to `%s': %s\n", program_name, filename, strerror(errno));
+	} else {
+		fprintf(fp, "%s: \\\n", output);
+		if ( tar_name && strcmp(tar_name, "-") != 0 ){
+			fprintf(fp, "\t%s \\\n", tar_name);
+		}
+		for ( struct entry* e = &entries[0]; e->src; e++ ){
+			if ( !e->dst || e->tar ) continue;
+			fprintf(fp, "\t%s %s\n", e->src, (e+1)->src ? "\\" : "");
+		}
+		fprintf(fp, "\n");
+		fclose(fp);
+	}
+}
+
+static void write_header(const char* filename){
+	if ( !filename ) return;
+
+	fprintf(verbose, "%s: writing file header to `%s'\n", program_name, filename);
+	FILE* fp = fopen(filename, "w");
+	if ( !fp ){
+		fprintf(normal, "%s: failed to write header to `%s': %s\n", program_name, filename, strerror(errno));
+	} else {
+		fprintf(fp, "#ifndef DATAPACKER_FILES_H\n#define DATAPACKER_FILES_H\n\n#include \"datapack.h\"\n\n#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n");
+		for ( struct entry* e = &entries[0]; e->src; e++ ){
+			if ( !e->dst ) continue;
+			fprintf(fp, "extern struct datapack_entry %s;\n", e->variable);
+		}
+		fprintf(fp, "\n#ifdef __cplusplus\n}\n#endif\n\n#endif /* DATAPACKER_FILES_H */\n");
+		fclose(fp);
+	}
+}
+
+static void write_table(FILE* dst){
+	fprintf(dst, "struct datapack_entry* filetable[] = {\n");
+	for ( struct entry* e = &entries[0]; e->src; e++ ){
+		if ( e->dst ){
+			fprintf(dst, "\t&%s,\n", e->variable);
+		}
+	}
+	fprintf(dst, "\tNULL\n};\n\n");
+}
+
+static int write_source(FILE* dst, const char* output, const char* deps, const char* header){
+	int files = 0;
+
+	write_prelude(dst);
+	if ( (files=write_data(dst)) < 0 ){
+		if ( strcmp(output, "-") != 0 ){
+			unlink(output);
+		}
+		return 1;
+	}
+	write_entries(dst);
+	write_dependencies(deps, output);
+	write_header(header);
+	write_table(dst);
+
+	fprintf(verbose, "%d datafile(s) processed.\n", files);
+	return 0;
+}
+
+/**
+ * Growing buffer of delta instructions.
+ */
+struct delta {
+	unsigned char* data;
+	size_t size;
+	size_t max;
+};
+
+static unsigned char* delta_reserve(struct delta* d, size_t bytes){
+	if ( d->size + bytes > d->max ){
+		d->max = (d->size + bytes) * 2;
+		d->data = realloc(d->data, d->max);
+	}
+	unsigned char* ptr = d->data + d->size;
+	d->size += bytes;
+	return ptr;
+}
+
+static void delta_copy(struct delta* d, size_t offset, size_t len){
+	const uint32_t args[2] = {htobe32((uint32_t)offset), htobe32((uint32_t)len)};
+	unsigned char* ptr = delta_reserve(d, 1 + sizeof(args));
+	ptr[0] = DATAPACK_DELTA_COPY;
+	memcpy(ptr + 1, args, sizeof(args));
+}
+
+static void delta_add(struct delta* d, const unsigned char* data, size_t len){
+	if ( len == 0 ) return;
+	const uint32_t arg = htobe32((uint32_t)len);
+	unsigned char* ptr = delta_reserve(d, 1 + sizeof(arg) + len);
+	ptr[0] = DATAPACK_DELTA_ADD;
+	memcpy(ptr + 1, &arg, sizeof(arg));
+	memcpy(ptr + 1 + sizeof(arg), data, len);
+}
+
+static uint32_t delta_hash(const unsigned char* data){
+	uint32_t h = 0;
+	for ( unsigned int i = 0; i < DELTA_WINDOW; i++ ){
+		h = h * DELTA_PRIME + data[i];
+	}
+	return h;
+}
+
+/**
+ * Encode data as instructions copying runs from old and adding the rest
+ * literally. Old data is indexed by a hash of each DELTA_WINDOW bytes at
+ * window-aligned offsets and the new data is scanned with a rolling hash so
+ * runs are found at any offset. Matches are extended in both directions.
+ */
+static void delta_encode(struct delta* d, const unsigned char* old, size_t osize, const unsigned char* data, size_t size){
+	unsigned int bits = 10;
+	while ( bits < 30 && ((size_t)1 << bits) < osize / DELTA_WINDOW * 2 ){
+		bits++;
+	}
+	uint32_t* table = calloc((size_t)1 << bits, sizeof(uint32_t)); /* offset + 1, 0 if empty */
+	for ( size_t i = 0; i + DELTA_WINDOW <= osize; i += DELTA_WINDOW ){
+		table[(delta_hash(old + i) * 2654435761u) >> (32 - bits)] = (uint32_t)(i + 1);
+	}
+
+	/* DELTA_PRIME^DELTA_WINDOW for removing the byte leaving the window */
+	uint32_t power = 1;
+	for ( unsigned int i = 0; i < DELTA_WINDOW; i++ ){
+		power *= DELTA_PRIME;
+	}
+
+	size_t pos = 0;
+	size_t literal = 0; /* start of bytes not yet encoded */
+	uint32_t h = size >= DELTA_WINDOW ? delta_hash(data) : 0;
+	while ( pos + DELTA_WINDOW <= size ){
+		const uint32_t slot = table[(h * 2654435761u) >> (32 - bits)];
+		size_t offset = slot - 1;
+		if ( slot && memcmp(old + offset, data + pos, DELTA_WINDOW) == 0 ){
+			while ( pos > literal && offset > 0 && old[offset - 1] == data[pos - 1] ){
+				pos--;
+				offset--;
+			}
+			size_t len = 0;
+			while ( pos + len < size && offset + len < osize && old[offset + len] == data[pos + len] ){
+				len++;
+			}
+
+			delta_add(d, data + literal, pos - literal);
+			delta_copy(d, offset, len);
+			pos += len;
+			literal = pos;
+			if ( pos + DELTA_WINDOW <= size ){
+				h = delta_hash(data + pos);
+			}
+			continue;
+		}
+
+		if ( pos + DELTA_WINDOW < size ){
+			h = h * DELTA_PRIME + data[pos + DELTA_WINDOW] - data[pos] * power;
+		}
+		pos++;
+	}
+	delta_add(d, data + literal, size - literal);
+
+	free(table);
+}
+
+/**
+ * Read the remaining source data (including the sample) into memory.
+ */
+static unsigned char* source_slurp(struct source* src, size_t* size){
+	const unsigned char* ptr;
+	int first = 1;
+	size_t bytes;
+	size_t max = src->size + 1;
+	unsigned char* data = malloc(max);
+
+	*size = 0;
+	while ( (bytes=source_read(src, &ptr, &first)) > 0 ){
+		if ( *size + bytes > max ){
+			max = (*size + bytes) * 2;
+			data = realloc(data, max);
+		}
+		memcpy(data + *size, ptr, bytes);
+		*size += bytes;
+	}
+	if ( ferror(src->fp) ){
+		free(data);
+		return NULL;
+	}
+
+	return data;
+}
+
+/**
+ * Compare entry with the same entry in the base pack. Unchanged entries are
+ * left out and changed entries are written as a delta if it is smaller than
+ * the compressed entry.
+ * @return 0 if the entry is handled, -1 if it must be written as usual or 1
+ *         on errors.
+ */
+static int write_delta(struct source* src, FILE* dst, struct entry* e){
+	const struct datapack_entry* old = unpack_find(base, e->dst);
+	if ( !old ){
+		return -1;
+	}
+
+	size_t size;
+	char* olddata;
+	unsigned char* data = source_slurp(src, &size);
+	if ( !data ){
+		return 1;
+	}
+	int ret = unpack(old, &olddata);
+	if ( ret != 0 ){
+		fprintf(stderr, "%s: failed to read `%s' from base pack: %s\n", program_name, e->dst, ret > 0 ? strerror(ret) : zError(ret));
+		free(data);
+		return 1;
+	}
+
+	if ( size == old->usize && memcmp(data, olddata, size) == 0 ){
+		fprintf(verbose, "  unchanged\n");
+		e->omit = 1;
+		e->out = size;
+		unchanged_entries++;
+		free(olddata);
+		free(data);
+		return 0;
+	}
+
+	/* delta is prefixed by its uncompressed size */
+	struct delta d = {NULL, 0, 0};
+	delta_encode(&d, (const unsigned char*)olddata, old->usize, data, size);
+	uLongf clen = compressBound(d.size);
+	unsigned char* buf = malloc(sizeof(uint32_t) + clen);
+	const uint32_t dsize = htobe32((uint32_t)d.size);
+	memcpy(buf, &dsize, sizeof(uint32_t));
+	ret = compress2(buf + sizeof(uint32_t), &clen, d.data, d.size, default_level);
+	free(d.data);
+	free(olddata);
+
+	/* compare with what writing the entry would cost */
+	size_t full = size;
+	if ( ret == Z_OK && src->level != 0 ){
+		uLongf flen = compressBound(size);
+		unsigned char* tmp = malloc(flen);
+		if ( compress2(tmp, &flen, data, size, src->level) == Z_OK ){
+			full = flen;
+		}
+		free(tmp);
+	}
+
+	/* written as usual from the data already read, as tar members cannot be
+	 * read again */
+	if ( ret != Z_OK || sizeof(uint32_t) + clen >= full ){
+		free(buf);
+		src->data = data;
+		src->size = size;
+		src->pos = src->sampled;
+		return -1;
+	}
+	free(data);
+
+	if ( solid_open ){
+		solid_end(dst, write_bytes_binary);
+	}
+	e->offset = output_offset;
+	output_crc = 0;
+	e->in = write_bytes_binary(dst, buf, sizeof(uint32_t) + clen);
+	e->out = size;
+	e->flags |= DATAPACK_DELTA;
+	fprintf(verbose, "  delta of %zd bytes against base\n", e->in);
+	delta_entries++;
+	delta_bytes += e->in;
+	free(buf);
+
+	return 0;
+}
+
+/**
+ * Names of base pack entries removed from the patch.
+ */
+struct removed {
+	size_t num;
+	const char** name;
+	struct entry** sorted; /* entries sorted by dst */
+};
+
+static int compare_dst(const void* a, const void* b){
+	const struct entry* const* x = (const struct entry* const*)a;
+	const struct entry* const* y = (const struct entry* const*)b;
+	return strcmp((*x)->dst, (*y)->dst);
+}
+
+static int collect_removed(const struct datapack_entry* entry, void* data){
+	struct removed* r = (struct removed*)data;
+	struct entry key = { .dst = (char*)entry->filename };
+	struct entry* ptr = &key;
+	if ( !bsearch(&ptr, r->sorted, num_entries, sizeof(struct entry*), compare_dst) ){
+		r->name = realloc(r->name, sizeof(const char*) * (r->num + 1));
+		r->name[r->num++] = entry->filename;
+	}
+	return 0;
+}
+
+/**
+ * CRC32C of the directory and footer of a version 2 pack, recorded in patches
+ * to identify the base pack.
+ */
+static int base_checksum(const char* filename, uint32_t* crc){
+	FILE* fp = fopen(filename, "r");
+	if ( !fp ){
+		return 1;
+	}
+
+	struct datapack_pak_footer footer;
+	if ( fseek(fp, -(long)sizeof(struct datapack_pak_footer), SEEK_END) != 0 ||
+	     fread(&footer, sizeof(struct datapack_pak_footer), 1, fp) != 1 ||
+	     footer.dp_version != 2 || fseek(fp, (long)be64toh(footer.dp_offset), SEEK_SET) != 0 ){
+		fclose(fp);
+		return 1;
+	}
+
+	size_t bytes;
+	*crc = 0;
+	while ( (bytes=fread(in, 1, CHUNK, fp)) > 0 ){
+		*crc = datapack_crc32c(*crc, in, bytes);
+	}
+	const int ret = ferror(fp);
+	fclose(fp);
+	return ret;
+}
+
+/**
+ * Open file for appending a binary blob, removing a blob appended earlier.
+ * @return File positioned at the end or NULL on errors.
+ */
+static FILE* open_append(const char* filename){
+	static unsigned char datapack_magic[] = DATAPACK_MAGIC;
+	FILE* fp = fopen(filename, "r+");
+	if ( !fp ){
+		return NULL;
+	}
+
+	struct datapack_pak_footer footer;
+	long size = fseek(fp, 0, SEEK_END) == 0 ? ftell(fp) : -1;
+	if ( size >= (long)sizeof(footer) &&
+	     fseek(fp, -(long)sizeof(footer), SEEK_END) == 0 && fread(&footer, sizeof(footer), 1, fp) == 1 &&
+	     footer.dp_version == 2 && memcmp(footer.dp_magic, datapack_magic, sizeof(datapack_magic)) == 0 ){
+		const long start = (long)be64toh(footer.dp_start);
+		if ( start >= 0 && start < size ){
+			size = start;
+		}
+	}
+	if ( size < 0 || ftruncate(fileno(fp), size) != 0 || fseek(fp, size, SEEK_SET) != 0 ){
+		fclose(fp);
+		return NULL;
+	}
+
+	output_offset = size;
+	return fp;
+}
+
+/**
+ * Upper bound of the compressed size of size bytes, including segmenting.
+ */
+static size_t volume_bound(size_t size){
+	const size_t parts = segment_size > 0 ? size / segment_size + 1 : 1;
+	return (size_t)compressBound((uLong)size) + 16 * parts;
+}
+
+static int volume_close(FILE* fp){
+	if ( fflush(fp) != 0 || ferror(fp) ){
+		fprintf(stderr, "%s: failed to write volume: %s\n", program_name, strerror(errno));
+		fclose(fp);
+		return 1;
+	}
+	fclose(fp);
+	return 0;
+}
+
+/**
+ * Start a new volume if writing bound more bytes would grow the current one
+ * past --volume-size. Each volume takes at least one entry or block so it
+ * only exceeds the size when a single entry or block does.
+ * @param out Current volume, replaced when a new volume is started.
+ * @return Non-zero on errors.
+ */
+static int volume_reserve(FILE** out, size_t bound){
+	static unsigned char datapack_magic[] = DATAPACK_MAGIC;
+	static const long empty = (long)(sizeof(datapack_magic) + sizeof(struct datapack_pak_header_v2));
+	if ( num_volumes > 0 && (output_offset == empty || (size_t)output_offset + bound <= volume_size) ){
+		return 0;
+	}
+	if ( num_volumes > 0 && volume_close(*out) != 0 ){
+		return 1;
+	}
+
+	char* filename;
+	if ( asprintf(&filename, "%s.%zu", volume_base, num_volumes + 1) == -1 ){
+		return 1;
+	}
+	*out = fopen(filename, "w");
+	if ( !*out ){
+		fprintf(stderr, "%s: failed to open `%s' for writing: %s\n", program_name, filename, strerror(errno));
+		free(filename);
+		return 1;
+	}
+	fprintf(verbose, "Writing volume `%s'\n", filename);
+	free(filename);
+	setvbuf(*out, NULL, _IOFBF, OUTPUT_BUFFER);
+	num_volumes++;
+
+	/* volumes start like a pack so they are recognized, but have no directory */
+	struct datapack_pak_header_v2 header = {
+		.dp_version = 2,
+		.dp_flags = DATAPACK_PAK_VOLUMES,
+	};
+	output_offset = 0;
+	write_bytes_binary(*out, datapack_magic, sizeof(datapack_magic));
+	write_bytes_binary(*out, (const unsigned char*)&header, sizeof(struct datapack_pak_header_v2));
+
+	return 0;
+}
+
+/**
+ * Write the volume of each record followed by the volume filenames (relative
+ * to the index).
+ */
+static void write_volume_table(FILE* dst, size_t num_removed){
+	for ( size_t i = 0; i < num_blocks; i++ ){
+		const uint32_t volume = htobe32(blocks[i].volume);
+		write_bytes_binary(dst, (const unsigned char*)&volume, sizeof(uint32_t));
+	}
+	for ( struct entry* e = &entries[0]; e->src; e++ ){
+		if ( e->omit ) continue;
+		const uint32_t volume = htobe32(e->volume);
+		write_bytes_binary(dst, (const unsigned char*)&volume, sizeof(uint32_t));
+	}
+	for ( size_t i = 0; i < num_removed; i++ ){
+		const uint32_t volume = 0;
+		write_bytes_binary(dst, (const unsigned char*)&volume, sizeof(uint32_t));
+	}
+
+	const uint32_t count = htobe32((uint32_t)num_volumes);
+	write_bytes_binary(dst, (const unsigned char*)&count, sizeof(uint32_t));
+	const char* separator = strrchr(volume_base, '/');
+	const char* name = separator ? separator + 1 : volume_base;
+	for ( size_t i = 1; i <= num_volumes; i++ ){
+		char filename[PATH_MAX];
+		const int len = snprintf(filename, sizeof(filename), "%s.%zu", name, i);
+		const uint32_t size = htobe32((uint32_t)len);
+		write_bytes_binary(dst, (const unsigned char*)&size, sizeof(uint32_t));
+		write_bytes_binary(dst, (const unsigned char*)filename, (size_t)len);
+	}
+}
+
+static int write_binary(FILE* dst){
+	static unsigned char datapack_magic[] = DATAPACK_MAGIC;
+
+	/* write magic (output_offset is non-zero when appending to a file) */
+	const long start = output_offset;
+	write_bytes_binary(dst, datapack_magic, sizeof(datapack_magic));
+
+	/* write header */
+	struct datapack_pak_header_v2 header = {
+		.dp_version = 2,
+		.dp_flags = (base ? DATAPACK_PAK_PATCH : 0) | (volume_size > 0 ? DATAPACK_PAK_VOLUMES : 0),
+		.dp_base_crc = htobe32(base_crc),
+	};
+	write_bytes_binary(dst, (const unsigned char*)&header, sizeof(struct datapack_pak_header_v2));
+
+	/* write data (into volume files when splitting) */
+	FILE* out = dst;
+	const long index_offset = output_offset;
+	for ( size_t i = 0; ; i++ ){
+		struct entry* e = entry_at(i);
+		if ( !e ) break;
+		fprintf(verbose, "Processing `%s' to `%s'\n", e->src, e->dst);
+
+		struct source src;
+		struct timespec begin;
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		if ( source_open(&src, e) != 0 ){
+			return 1;
+		}
+
+		int ret = -1;
+		if ( base && (ret=write_delta(&src, out, e)) >= 0 ){
+			e->crc = output_crc;
+		} else if ( is_solid(&src) ){
+			if ( solid_open && solid_level != src.level ){
+				solid_end(out, write_bytes_binary);
+			}
+			if ( !solid_open && volume_size > 0 && volume_reserve(&out, volume_bound(2 * solid_size)) != 0 ){
+				source_close(&src);
+				return 1;
+			}
+			if ( !solid_open && solid_begin(output_offset, src.level) != 0 ){
+				source_close(&src);
+				return 1;
+			}
+			ret = write_solid(&src, out, e, write_bytes_binary);
+			if ( blocks[num_blocks-1].usize >= solid_size ){
+				solid_end(out, write_bytes_binary);
+			}
+		} else {
+			if ( solid_open ){
+				solid_end(out, write_bytes_binary);
+			}
+			if ( volume_size > 0 && volume_reserve(&out, volume_bound(src.size)) != 0 ){
+				source_close(&src);
+				return 1;
+			}
+			e->offset = output_offset;
+			e->volume = (unsigned int)num_volumes;
+			output_crc = 0;
+			if ( is_segmented(&src) ){
+				ret = write_segmented(&src, out, e, write_bytes_binary);
+			} else {
+				ret = write_compressed(&src, out, e, write_bytes_binary);
+			}
+			e->crc = output_crc;
+		}
+		e->flags |= DATAPACK_CHECKSUM;
+		source_close(&src);
+		e->compress_ms = elapsed_ms(&begin);
+		if ( report_name ){
+			e->decode_ms = estimate_decode(&src);
+		}
+
+		if ( ret != 0 ){
+			return 1;
+		}
+	}
+	if ( tar_error ){
+		return 1;
+	}
+	if ( solid_open ){
+		solid_end(out, write_bytes_binary);
+	}
+	if ( out != dst ){
+		if ( volume_close(out) != 0 ){
+			return 1;
+		}
+		output_offset = index_offset;
+	}
+
+	/* entries of the base pack missing from the patch are removed */
+	struct removed removed = {0, NULL, NULL};
+	if ( base ){
+		removed.sorted = malloc(sizeof(struct entry*) * (num_entries + 1));
+		for ( size_t i = 0; i < num_entries; i++ ){
+			removed.sorted[i] = &entries[i];
+		}
+		qsort(removed.sorted, num_entries, sizeof(struct entry*), compare_dst);
+		datapack_glob(base, NULL, collect_removed, &removed);
+		free(removed.sorted);
+		deleted_entries = removed.num;
+	}
+
+	/* write directory */
+	const long directory = output_offset;
+	for ( size_t i = 0; i < num_blocks; i++ ){
+		struct datapack_pakfile_block p = {
+			.offset = htobe64((uint64_t)blocks[i].offset),
+			.csize = htobe32((uint32_t)blocks[i].csize),
+			.usize = htobe32((uint32_t)blocks[i].usize),
+			.crc = htobe32(blocks[i].crc),
+		};
+		write_bytes_binary(dst, (const unsigned char*)&p, sizeof(struct datapack_pakfile_block));
+	}
+	size_t written = 0;
+	for ( struct entry* e = &entries[0]; e->src; e++ ){
+		if ( e->omit ) continue;
+		const int solid = e->block != DATAPACK_NO_BLOCK;
+		struct datapack_pakfile_entry_v2 p = {
+			.offset = htobe64(solid ? (uint64_t)e->boffset : (uint64_t)e->offset),
+			.csize = htobe32((uint32_t)e->in),
+			.usize = htobe32((uint32_t)e->out),
+			.block = htobe32((uint32_t)e->block),
+			.flags = htobe32(e->flags),
+			.ssize = htobe32((uint32_t)e->ssize),
+			.crc = htobe32(e->crc),
+			.fsize = htobe32((uint32_t)strlen(e->dst)),
+		};
+		write_bytes_binary(dst, (const unsigned char*)&p, sizeof(struct datapack_pakfile_entry_v2));
+		write_bytes_binary(dst, (const unsigned char*)e->dst, strlen(e->dst));
+		for ( size_t i = 0; i < e->num_segments; i++ ){
+			const uint32_t csize = htobe32(e->segments[i]);
+			write_bytes_binary(dst, (const unsigned char*)&csize, sizeof(uint32_t));
+		}
+		written++;
+	}
+	for ( size_t i = 0; i < removed.num; i++ ){
+		struct datapack_pakfile_entry_v2 p = {
+			.block = htobe32(DATAPACK_NO_BLOCK),
+			.flags = htobe32(DATAPACK_DELETED),
+			.fsize = htobe32((uint32_t)strlen(removed.name[i])),
+		};
+		write_bytes_binary(dst, (const unsigned char*)&p, sizeof(struct datapack_pakfile_entry_v2));
+		write_bytes_binary(dst, (const unsigned char*)removed.name[i], strlen(removed.name[i]));
+		written++;
+	}
+	free(removed.name);
+	if ( volume_size > 0 ){
+		write_volume_table(dst, removed.num);
+	}
+
+	/* write footer */
+	struct datapack_pak_footer footer = {
+		.dp_start = htobe64((uint64_t)start),
+		.dp_offset = htobe64((uint64_t)directory),
+		.dp_num_blocks = htobe32((uint32_t)num_blocks),
+		.dp_num_entries = htobe32((uint32_t)written),
+		.dp_version = 2,
+	};
+	memcpy(footer.dp_magic, datapack_magic, sizeof(datapack_magic));
+	write_bytes_binary(dst, (const unsigned char*)&footer, sizeof(struct datapack_pak_footer));
+
+	if ( fflush(dst) != 0 ){
+		fprintf(stderr, "%s: failed to write output: %s\n", program_name, strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
+
+static int compare_order(const void* a, const void* b){
+	const struct entry* x = (const struct entry*)a;
+	const struct entry* y = (const struct entry*)b;
+	return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/**
+ * Reorder entries by first use in an access trace so entries read together
+ * are stored next to each other. Entries not present in the trace keep their
+ * relative order after all traced entries.
+ */
+static int apply_layout_profile(const char* filename){
+	FILE* fp = fopen(filename, "r");
+	if ( !fp ){
+		fprintf(stderr, "%s: failed to read layout profile `%s': %s.\n", program_name, filename, strerror(errno));
+		return 1;
+	}
+
+	/* lookup table sorted by target name */
+	struct entry** sorted = malloc(sizeof(struct entry*) * (num_entries + 1));
+	for ( size_t i = 0; i < num_entries; i++ ){
+		entries[i].order = SIZE_MAX;
+		sorted[i] = &entries[i];
+	}
+	qsort(sorted, num_entries, sizeof(struct entry*), compare_dst);
+
+	size_t used = 0;
+	char* line = NULL;
+	size_t bytes = 0;
+	while ( getline(&line, &bytes, fp) != -1 ){
+		/* TIME<tab>FILENAME */
+		char* name = strchr(line, '\t');
+		if ( !name ) continue;
+		name = strip(name + 1);
+
+		struct entry key;
+		struct entry* pkey = &key;
+		key.dst = name;
+		struct entry** found = bsearch(&pkey, sorted, num_entries, sizeof(struct entry*), compare_dst);
+		if ( found && (*found)->order == SIZE_MAX ){
+			(*found)->order = used++;
+		}
+	}
+	free(line);
+	free(sorted);
+	fclose(fp);
+
+	for ( size_t i = 0; i < num_entries; i++ ){
+		if ( entries[i].order == SIZE_MAX ){
+			entries[i].order = used + i;
+		}
+	}
+	qsort(entries, num_entries, sizeof(struct entry), compare_order);
+
+	fprintf(verbose, "%s: %zd of %zd entries ordered by layout profile `%s'\n", program_name, used, num_entries, filename);
+	return 0;
+}
+
+struct extract {
+	datapack_t pak;
+	const char* dir;
+	char** patterns;                       /* entries to extract (all if none) */
+	int num_patterns;
+	const struct datapack_entry** entry;
+	size_t num_entries;
+	size_t max_entries;
+	size_t next;                           /* next entry to extract */
+	size_t bytes;                          /* bytes extracted */
+	int error;
+};
+
+static int extract_collect(const struct datapack_entry* entry, void* data){
+	struct extract* x = (struct extract*)data;
+
+	/* removed entries in patches only record the removal */
+	if ( entry->flags & DATAPACK_DELETED ){
+		return 0;
+	}
+
+	int match = x->num_patterns == 0;
+	for ( int i = 0; i < x->num_patterns && !match; i++ ){
+		match = fnmatch(x->patterns[i], entry->filename, 0) == 0;
+	}
+	if ( !match ){
+		return 0;
+	}
+
+	if ( x->num_entries == x->max_entries ){
+		const size_t max = x->max_entries ? x->max_entries * 2 : 256;
+		const struct datapack_entry** tmp = realloc(x->entry, sizeof(struct datapack_entry*) * max);
+		if ( !tmp ){
+			x->error = 1;
+			return 1;
+		}
+		x->entry = tmp;
+		x->max_entries = max;
+	}
+	x->entry[x->num_entries++] = entry;
+	return 0;
+}
+
+static int compare_offset(const void* a, const void* b){
+	const struct datapack_entry* x = *(const struct datapack_entry* const*)a;
+	const struct datapack_entry* y = *(const struct datapack_entry* const*)b;
+	if ( x->volume != y->volume ){
+		return x->volume < y->volume ? -1 : 1;
+	}
+	return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+/**
+ * Reject filenames which would be written outside of the output directory.
+ * Leading slashes (as added by --from-dir) are relative to the directory.
+ */
+static int extract_safe(const char* filename){
+	if ( filename[strspn(filename, "/")] == 0 ){
+		return 0;
+	}
+	for ( const char* p = filename; p; p = strchr(p, '/'), p = p ? p + 1 : NULL ){
+		if ( strncmp(p, "..", 2) == 0 && (p[2] == '/' || p[2] == 0) ){
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Create all parent directories of path.
+ */
+static int extract_mkdirs(char* path){
+	for ( char* p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/') ){
+		*p = 0;
+		const int ret = mkdir(path, 0777) == 0 || errno == EEXIST ? 0 : errno;
+		*p = '/';
+		if ( ret != 0 ){
+			return ret;
+		}
+	}
+	return 0;
+}
+
+static int extract_write(int fd, const char* data, size_t size){
+	while ( size > 0 ){
+		const ssize_t bytes = write(fd, data, size);
+		if ( bytes < 0 ){
+			if ( errno == EINTR ) continue;
+			return errno;
+		}
+		data += bytes;
+		size -= (size_t)bytes;
+	}
+	return 0;
+}
+
+/**
+ * Copy stored data from the pack without passing it through userspace. Falls
+ * back to sendfile and then to plain reads when the kernel or filesystem does
+ * not support copy_file_range between the files.
+ */
+static int extract_copy(int src, long offset, int dst, size_t size){
+	char buf[CHUNK];
+	off_t pos = offset;
+	int method = 0;
+	while ( size > 0 ){
+		ssize_t bytes = -1;
+		errno = ENOSYS;
+		switch ( method ){
+#ifdef HAVE_COPY_FILE_RANGE
+		case 0: bytes = copy_file_range(src, &pos, dst, NULL, size, 0); break;
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+		case 1: bytes = sendfile(dst, src, &pos, size); break;
+#endif
+		case 2:
+			bytes = pread(src, buf, size < CHUNK ? size : CHUNK, pos);
+			if ( bytes > 0 ){
+				const int ret = extract_write(dst, buf, (size_t)bytes);
+				if ( ret != 0 ) return ret;
+				pos += bytes;
+			}
+			break;
+		}
+
+		if ( bytes == 0 ){
+			return EIO; /* pack is truncated */
+		} else if ( bytes > 0 ){
+			size -= (size_t)bytes;
+		} else if ( errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP ){
+			if ( ++method > 2 ) return errno;
+		} else if ( errno != EINTR ){
+			return errno;
+		}
+	}
+	return 0;
+}
+
+static int extract_entry(struct extract* x, const struct datapack_entry* entry, int fd){
+	/* stored entries are copied as-is from the pack (or volume) file */
+	const int from = datapack_entry_fd(entry);
+	if ( (entry->flags & DATAPACK_STORED) && !entry->block && !(entry->flags & DATAPACK_DELTA) && from != -1 ){
+		return extract_copy(from, entry->offset, fd, entry->usize);
+	}
+
+	/* large entries are decoded in chunks to bound memory */
+	if ( entry->usize > EXTRACT_STREAM ){
+		FILE* src = unpack_open(x->pak, entry->filename, "r");
+		if ( !src ){
+			return errno;
+		}
+		int ret = 0;
+		char buf[CHUNK];
+		size_t bytes;
+		while ( ret == 0 && (bytes=fread(buf, 1, sizeof(buf), src)) > 0 ){
+			ret = extract_write(fd, buf, bytes);
+		}
+		if ( ret == 0 && ferror(src) ){
+			ret = errno ? errno : EIO;
+		}
+		fclose(src);
+		return ret;
+	}
+
+	char* data;
+	int ret = unpack(entry, &data);
+	if ( ret != 0 ){
+		return ret == Z_MEM_ERROR ? ENOMEM : ret > 0 ? ret : EIO;
+	}
+	ret = extract_write(fd, data, entry->usize);
+	free(data);
+	return ret;
+}
+
+static void* extract_worker(void* ptr){
+	struct extract* x = (struct extract*)ptr;
+	size_t i;
+	while ( (i=__atomic_fetch_add(&x->next, 1, __ATOMIC_RELAXED)) < x->num_entries ){
+		const struct datapack_entry* entry = x->entry[i];
+		if ( !extract_safe(entry->filename) ){
+			fprintf(normal, "%s: refusing to extract `%s' outside of `%s'.\n", program_name, entry->filename, x->dir);
+			__atomic_store_n(&x->error, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		char* path = NULL;
+		if ( asprintf(&path, "%s/%s", x->dir, entry->filename + strspn(entry->filename, "/")) == -1 ){
+			__atomic_store_n(&x->error, 1, __ATOMIC_RELAXED);
+			continue;
+		}
 
-static int write_regular(FILE* dst, struct entry* e){
-	FILE* src = fopen(e->src, "r");
-	if ( !src ){
-		if ( missing_fatal ){
-			fprintf(stderr, "%s: failed to read `%s'.\n", program_name, e->src);
-			return 1;
+		int ret = extract_mkdirs(path);
+		const int fd = ret == 0 ? open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666) : -1;
+		if ( ret == 0 && fd == -1 ){
+			ret = errno;
+		}
+		if ( ret == 0 ){
+			ret = extract_entry(x, entry, fd);
+		}
+		if ( fd != -1 && close(fd) != 0 && ret == 0 ){
+			ret = errno;
 		}
 
-		fprintf(normal, "%s: failed to read `%s', ignored.\n", program_name, e->src);
-		return 1;
+		if ( ret != 0 ){
+			fprintf(normal, "%s: failed to extract `%s': %s\n", program_name, entry->filename, strerror(ret));
+			__atomic_store_n(&x->error, 1, __ATOMIC_RELAXED);
+		} else {
+			fprintf(verbose, "%s\n", path);
+			__atomic_add_fetch(&x->bytes, entry->usize, __ATOMIC_RELAXED);
+		}
+		free(path);
 	}
+	return NULL;
+}
 
-	fprintf(dst, "static const char %s_buf[] %s = \"", e->variable, data_attrib);
-	if ( write_compressed(src, dst, e, &e->in, &e->out, write_bytes_source) != 0 ){
+/**
+ * Extract entries of a pack matching any of patterns into dir. Entries are
+ * extracted in file order by one thread per CPU.
+ */
+static int extract_pack(const char* filename, const char* dir, char** patterns, int num_patterns){
+	struct extract x;
+	memset(&x, 0, sizeof(x));
+	x.pak = datapack_open(filename);
+	if ( !x.pak ){
+		fprintf(stderr, "%s: failed to open `%s': %s\n", program_name, filename, strerror(errno));
 		return 1;
 	}
-	fprintf(dst, "\";\n");
+	x.dir = dir;
+	x.patterns = patterns;
+	x.num_patterns = num_patterns;
+	datapack_glob(x.pak, NULL, extract_collect, &x);
+	if ( x.error ){
+		fprintf(stderr, "%s: %s\n", program_name, strerror(ENOMEM));
+		free(x.entry);
+		datapack_close(x.pak);
+		return 1;
+	}
+	qsort(x.entry, x.num_entries, sizeof(struct datapack_entry*), compare_offset);
+
+	/* entries are extracted in parallel instead of segments within entries */
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	const size_t wanted = cpus < 1 ? 1 : cpus > EXTRACT_MAX_THREADS ? EXTRACT_MAX_THREADS : (size_t)cpus;
+	const size_t num_threads = wanted < x.num_entries ? wanted : x.num_entries > 0 ? x.num_entries : 1;
+	if ( num_threads > 1 ){
+		datapack_set_threads(1);
+	}
+	pthread_t thread[EXTRACT_MAX_THREADS];
+	size_t started = 0;
+	for ( ; started + 1 < num_threads; started++ ){
+		if ( pthread_create(&thread[started], NULL, extract_worker, &x) != 0 ) break;
+	}
+	extract_worker(&x);
+	for ( size_t i = 0; i < started; i++ ){
+		pthread_join(thread[i], NULL);
+	}
 
-	fclose(src);
-	return 0;
+	fprintf(verbose, "%s: extracted %zd entries (%zd bytes) using %zd threads.\n",
+	        program_name, x.num_entries, x.bytes, started + 1);
+
+	free(x.entry);
+	datapack_close(x.pak);
+	return x.error;
 }
 
-static int write_data(FILE* dst){
-	int files = 0;
+/**
+ * Entry of a build report or pack analysis.
+ */
+struct report {
+	const char* name;
+	size_t size;            /* uncompressed size */
+	size_t csize;           /* compressed size (share of the block for solid entries) */
+	const char* method;
+	double compress_ms;     /* negative if unknown */
+	double decode_ms;
+	const char* duplicate;  /* entry with identical content or NULL */
+	const char* advice;     /* recommended compression or NULL */
+};
 
-	for ( struct entry* e = &entries[0]; e->src; e++ ){
-		fprintf(verbose, "Processing %s from `%s' to `%s'\n", e->variable, e->src, e->dst);
+struct report_totals {
+	size_t entries;
+	size_t size;
+	size_t csize;
+	double compress_ms;
+	double decode_ms;
+	double decode_saved_ms; /* estimated inflate time avoided by storing entries */
+	int analysis;           /* set if duplicates were searched for */
+	size_t duplicates;
+	size_t duplicate_bytes;
+};
 
-		struct stat st;
-		lstat(e->src, &st);
+static const char* report_method(unsigned int flags, int solid){
+	if ( flags & DATAPACK_DELTA ) return "delta";
+	if ( solid ) return "solid";
+	if ( flags & DATAPACK_STORED ) return "stored";
+	if ( flags & DATAPACK_SEGMENTED ) return "segmented";
+	return "deflate";
+}
 
-		int ret;
-		if ( S_ISLNK(st.st_mode) ) {
-			ret = write_symlink(dst, e);
-		} else {
-			ret = write_regular(dst, e);
-			if ( ret == 0 ){
-				files++;
-			}
-		}
+/**
+ * Compressed size attributed to an entry of size bytes in a solid block.
+ */
+static size_t block_share(size_t csize, size_t usize, size_t size){
+	return usize > 0 ? csize * size / usize : 0;
+}
 
-		if ( ret != 0 ){
-			free(e->dst);
-			e->dst = NULL; /* mark as invalid */
-			if ( missing_fatal ){
-				return -1;
-			}
+static void json_string(FILE* fp, const char* str){
+	fputc('"', fp);
+	for ( const unsigned char* c = (const unsigned char*)str; *c; c++ ){
+		if ( *c == '"' || *c == '\\' ){
+			fprintf(fp, "\\%c", *c);
+		} else if ( *c < 0x20 ){
+			fprintf(fp, "\\u%04x", *c);
+		} else {
+			fputc(*c, fp);
 		}
 	}
-
-	fprintf(dst, "\n");
-	return files;
+	fputc('"', fp);
 }
 
-static void write_entries(FILE* dst){
-	for ( struct entry* e = &entries[0]; e->src; e++ ){
-		if ( !e->dst ) continue;
-		struct entry * real = e;
-		if(e->lnk != NULL) real = e->lnk;
-		fprintf(dst, "struct datapack_entry %s %s = {0, \"%s\", %s_buf, 0, %zd, %zd};\n",
-		        e->variable, struct_attrib, e->dst, real->variable, real->in, real->out);
-	};
-	fprintf(dst, "\n");
+static void report_begin(FILE* fp, const char* key, const char* name){
+	fprintf(fp, "{\n\t\"%s\": ", key);
+	json_string(fp, name);
+	fprintf(fp, ",\n\t\"entries\": [");
 }
 
-static void write_dependencies(const char* filename, const char* output){
-	if ( !filename ) return;
+static void report_entry(FILE* fp, struct report_totals* t, const struct report* r){
+	fprintf(fp, "%s\n\t\t{\"name\": ", t->entries > 0 ? "," : "");
+	json_string(fp, r->name);
+	fprintf(fp, ", \"size\": %zd, \"compressed\": %zd, \"ratio\": %.3f, \"method\": \"%s\"",
+	        r->size, r->csize, r->size > 0 ? (double)r->csize / (double)r->size : 0.0, r->method);
+	if ( r->compress_ms >= 0.0 ){
+		fprintf(fp, ", \"compress_ms\": %.3f", r->compress_ms);
+		t->compress_ms += r->compress_ms;
+	}
+	fprintf(fp, ", \"decode_ms\": %.3f", r->decode_ms);
+	if ( r->duplicate ){
+		fprintf(fp, ", \"duplicate_of\": ");
+		json_string(fp, r->duplicate);
+		t->duplicates++;
+		t->duplicate_bytes += r->size;
+	}
+	if ( r->advice ){
+		fprintf(fp, ", \"advice\": ");
+		json_string(fp, r->advice);
+	}
+	fprintf(fp, "}");
 
-	fprintf(verbose, "%s: writing Makefile dependencies to `%s'\n", program_name, filename);
-	FILE* fp = fopen(filename, "w");
-	if ( !fp ){
-		fprintf(normal, "%s: failed to write Makefile dependencies to `%s': %s\n", program_name, filename, strerror(errno));
+	t->entries++;
+	t->size += r->size;
+	t->csize += r->csize;
+	t->decode_ms += r->decode_ms;
+}
+
+static void report_end(FILE* fp, const struct report_totals* t){
+	fprintf(fp, "\n\t],\n\t\"totals\": {\"entries\": %zd, \"size\": %zd, \"compressed\": %zd, \"ratio\": %.3f",
+	        t->entries, t->size, t->csize, t->size > 0 ? (double)t->csize / (double)t->size : 0.0);
+	if ( t->analysis ){
+		fprintf(fp, ", \"decode_ms\": %.3f, \"duplicates\": %zd, \"duplicate_bytes\": %zd}\n}\n",
+		        t->decode_ms, t->duplicates, t->duplicate_bytes);
 	} else {
-		fprintf(fp, "%s: \\\n", output);
-		for ( struct entry* e = &entries[0]; e->src; e++ ){
-			if ( !e->dst ) continue;
-			fprintf(fp, "\t%s %s\n", e->src, (e+1)->src ? "\\" : "");
-		}
-		fprintf(fp, "\n");
-		fclose(fp);
+		fprintf(fp, ", \"compress_ms\": %.3f, \"decode_ms\": %.3f, \"decode_saved_ms\": %.3f}\n}\n",
+		        t->compress_ms, t->decode_ms, t->decode_saved_ms);
 	}
 }
 
-static void write_header(const char* filename){
-	if ( !filename ) return;
-
-	fprintf(verbose, "%s: writing file header to `%s'\n", program_name, filename);
+/**
+ * Write JSON report of the packed entries (--report). Decode times are
+ * estimates from the sample of each entry, solid entries do not include
+ * inflating the beginning of their block.
+ */
+static int write_report(const char* filename, const char* output){
 	FILE* fp = fopen(filename, "w");
 	if ( !fp ){
-		fprintf(normal, "%s: failed to write header to `%s': %s\n", program_name, filename, strerror(errno));
-	} else {
-		fprintf(fp, "#ifndef DATAPACKER_FILES_H\n#define DATAPACKER_FILES_H\n\n#include \"datapack.h\"\n\n#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n");
-		for ( struct entry* e = &entries[0]; e->src; e++ ){
-			if ( !e->dst ) continue;
-			fprintf(fp, "extern struct datapack_entry %s;\n", e->variable);
-		}
-		fprintf(fp, "\n#ifdef __cplusplus\n}\n#endif\n\n#endif /* DATAPACKER_FILES_H */\n");
-		fclose(fp);
+		fprintf(stderr, "%s: failed to write report to `%s': %s\n", program_name, filename, strerror(errno));
+		return 1;
 	}
-}
 
-static void write_table(FILE* dst){
-	fprintf(dst, "struct datapack_entry* filetable[] = {\n");
+	struct report_totals t;
+	memset(&t, 0, sizeof(t));
+	t.decode_saved_ms = decode_saved_ms;
+	report_begin(fp, "output", output);
 	for ( struct entry* e = &entries[0]; e->src; e++ ){
-		if ( e->dst ){
-			fprintf(dst, "\t&%s,\n", e->variable);
-		}
-		free(e->dst);
-		free(e->src);
-		e->dst = NULL;
-		e->src = NULL;
+		if ( !e->dst ) continue;
+		const struct entry* real = e->lnk ? e->lnk : e;
+		const int solid = real->block != DATAPACK_NO_BLOCK;
+		struct report r = {
+			.name = e->dst,
+			.size = real->out,
+			.csize = solid ? block_share(blocks[real->block].csize, blocks[real->block].usize, real->out) : real->in,
+			.method = e->omit ? "unchanged" : report_method(real->flags, solid),
+			.compress_ms = e->compress_ms,
+			.decode_ms = e->omit ? 0.0 : real->decode_ms,
+		};
+		report_entry(fp, &t, &r);
 	}
-	fprintf(dst, "\tNULL\n};\n\n");
+	report_end(fp, &t);
+
+	if ( fclose(fp) != 0 ){
+		fprintf(stderr, "%s: failed to write report to `%s': %s\n", program_name, filename, strerror(errno));
+		return 1;
+	}
+	return 0;
 }
 
-static int write_source(FILE* dst, const char* output, const char* deps, const char* header){
-	int files = 0;
+/**
+ * Entry of a pack being analyzed.
+ */
+struct analysis {
+	const struct datapack_entry* entry;
+	uint32_t crc;           /* CRC32C of decompressed data */
+	double decode_ms;       /* measured unpack time */
+	const char* duplicate;
+	char advice[64];
+};
 
-	write_prelude(dst);
-	if ( (files=write_data(dst)) < 0 ){
-		unlink(output);
+static int compare_content(const void* a, const void* b){
+	const struct analysis* x = *(const struct analysis* const*)a;
+	const struct analysis* y = *(const struct analysis* const*)b;
+	if ( x->entry->usize != y->entry->usize ){
+		return x->entry->usize < y->entry->usize ? -1 : 1;
+	}
+	if ( x->crc != y->crc ){
+		return x->crc < y->crc ? -1 : 1;
+	}
+	return strcmp(x->entry->filename, y->entry->filename);
+}
+
+/**
+ * Compare data of entries whose sizes and checksums match.
+ */
+static int same_content(const struct datapack_entry* a, const struct datapack_entry* b){
+	if ( a->usize == 0 ){
 		return 1;
 	}
-	write_entries(dst);
-	write_dependencies(deps, output);
-	write_header(header);
-	write_table(dst);
 
-	fprintf(verbose, "%d datafile(s) processed.\n", files);
-	return 0;
+	char* x;
+	char* y;
+	if ( unpack(a, &x) != 0 ){
+		return 0;
+	}
+	if ( unpack(b, &y) != 0 ){
+		free(x);
+		return 0;
+	}
+	const int same = memcmp(x, y, a->usize) == 0;
+	free(x);
+	free(y);
+	return same;
 }
 
-static int write_binary(FILE* dst){
-	static unsigned char datapack_magic[] = DATAPACK_MAGIC;
+/**
+ * Recommend how an entry should be compressed, using the same thresholds as
+ * when packing.
+ */
+static void analyze_advice(struct analysis* a, const char* data){
+	const struct datapack_entry* entry = a->entry;
+	const size_t size = entry->usize;
 
-	/* write magic */
-	fwrite(datapack_magic, sizeof(datapack_magic), 1, dst);
+	if ( entry->flags & DATAPACK_DELTA ){
+		snprintf(a->advice, sizeof(a->advice), "keep");
+		return;
+	}
 
-	/* write header */
-	struct datapack_pak_header header = {
-		.dp_version = 1,
-		.dp_offset = htobe16(sizeof(datapack_magic) + sizeof(struct datapack_pak_header)),
-		.dp_num_entries = htobe16(num_entries),
-	};
-	fwrite(&header, sizeof(struct datapack_pak_header), 1, dst);
+	/* stored entries are sampled like the packer does */
+	if ( entry->flags & DATAPACK_STORED ){
+		const size_t sampled = size < SAMPLE ? size : SAMPLE;
+		uLongf clen = sizeof(sample_out);
+		if ( sampled > 0 && compress2(sample_out, &clen, (const Bytef*)data, sampled, default_level) == Z_OK
+		     && clen * 100 <= sampled * (100 - min_saving) ){
+			snprintf(a->advice, sizeof(a->advice), "compress: saves %zd%%", 100 - clen * 100 / sampled);
+			return;
+		}
+		snprintf(a->advice, sizeof(a->advice), "keep");
+		return;
+	}
 
-	/* write file table */
-	for ( struct entry* e = &entries[0]; e->src; e++ ){
-		/* skip header (filled later */
-		const long header = ftell(dst);
-		const size_t header_size = sizeof(struct datapack_pakfile_entry) + strlen(e->dst);
-		fseek(dst, (long)header_size, SEEK_CUR);
+	const size_t csize = entry->block ? block_share(entry->block->csize, entry->block->usize, size) : entry->csize;
+	if ( csize * 100 > size * (100 - min_saving) ){
+		snprintf(a->advice, sizeof(a->advice), "store: saves %zd%%", csize < size ? 100 - csize * 100 / size : 0);
+	} else if ( !entry->block && size < SAMPLE_MIN ){
+		snprintf(a->advice, sizeof(a->advice), "solid: small entry");
+	} else if ( !entry->block && !(entry->flags & DATAPACK_SEGMENTED) && size > ANALYZE_SEGMENT ){
+		snprintf(a->advice, sizeof(a->advice), "segment: large entry");
+	} else {
+		snprintf(a->advice, sizeof(a->advice), "keep");
+	}
+}
 
-		/* write data */
-		FILE* src = fopen(e->src, "r");
-		if ( !src ){
-			if ( missing_fatal ){
-				fprintf(stderr, "%s: failed to read `%s'.\n", program_name, e->src);
-				return 1;
+/**
+ * Write JSON analysis of the entries of a pack matching any of patterns
+ * (--analyze). Each entry is unpacked to measure decode time, find entries
+ * with identical content and recommend how it should be compressed.
+ */
+static int analyze_pack(const char* filename, const char* output, char** patterns, int num_patterns){
+	struct extract x;
+	memset(&x, 0, sizeof(x));
+	x.pak = datapack_open(filename);
+	if ( !x.pak ){
+		fprintf(stderr, "%s: failed to open `%s': %s\n", program_name, filename, strerror(errno));
+		return 1;
+	}
+	x.patterns = patterns;
+	x.num_patterns = num_patterns;
+	datapack_glob(x.pak, NULL, extract_collect, &x);
+
+	struct analysis* a = calloc(x.num_entries + 1, sizeof(struct analysis));
+	struct analysis** sorted = malloc(sizeof(struct analysis*) * (x.num_entries + 1));
+	if ( x.error || !a || !sorted ){
+		fprintf(stderr, "%s: %s\n", program_name, strerror(ENOMEM));
+		free(sorted);
+		free(a);
+		free(x.entry);
+		datapack_close(x.pak);
+		return 1;
+	}
+
+	int ret = 0;
+	for ( size_t i = 0; i < x.num_entries; i++ ){
+		char* data;
+		struct timespec begin;
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		const int err = unpack(x.entry[i], &data);
+		a[i].decode_ms = elapsed_ms(&begin);
+		if ( err != 0 ){
+			fprintf(stderr, "%s: failed to read `%s' from `%s': %s\n", program_name, x.entry[i]->filename, filename,
+			        err > 0 ? strerror(err) : zError(err));
+			ret = 1;
+			break;
+		}
+
+		a[i].entry = x.entry[i];
+		a[i].crc = datapack_crc32c(0, data, x.entry[i]->usize);
+		analyze_advice(&a[i], data);
+		sorted[i] = &a[i];
+		free(data);
+	}
+
+	/* entries with identical content are adjacent, the first by name is kept */
+	if ( ret == 0 && x.num_entries > 0 ){
+		qsort(sorted, x.num_entries, sizeof(struct analysis*), compare_content);
+		size_t first = 0;
+		for ( size_t i = 1; i < x.num_entries; i++ ){
+			if ( sorted[i]->entry->usize != sorted[first]->entry->usize || sorted[i]->crc != sorted[first]->crc ){
+				first = i;
+				continue;
+			}
+			if ( same_content(sorted[first]->entry, sorted[i]->entry) ){
+				sorted[i]->duplicate = sorted[first]->entry->filename;
+				snprintf(sorted[i]->advice, sizeof(sorted[i]->advice), "remove: duplicate");
 			}
+		}
+	}
 
-			fprintf(normal, "%s: failed to read `%s', ignored.\n", program_name, e->src);
-			return 1;
+	FILE* fp = NULL;
+	if ( ret == 0 ){
+		fp = strcmp(output, "-") != 0 ? fopen(output, "w") : stdout;
+		if ( !fp ){
+			fprintf(stderr, "%s: failed to open `%s' for writing: %s\n", program_name, output, strerror(errno));
+			ret = 1;
 		}
-		if ( write_compressed(src, dst, e, &e->in, &e->out, write_bytes_binary) != 0 ){
-			return 1;
+	}
+	if ( fp ){
+		struct report_totals t;
+		memset(&t, 0, sizeof(t));
+		t.analysis = 1;
+		report_begin(fp, "pack", filename);
+		for ( size_t i = 0; i < x.num_entries; i++ ){
+			const struct datapack_entry* entry = a[i].entry;
+			struct report r = {
+				.name = entry->filename,
+				.size = entry->usize,
+				.csize = entry->block ? block_share(entry->block->csize, entry->block->usize, entry->usize) : entry->csize,
+				.method = report_method(entry->flags, entry->block != NULL),
+				.compress_ms = -1.0,
+				.decode_ms = a[i].decode_ms,
+				.duplicate = a[i].duplicate,
+				.advice = a[i].advice,
+			};
+			report_entry(fp, &t, &r);
 		}
-		fclose(src);
+		report_end(fp, &t);
+		if ( fclose(fp) != 0 ){
+			fprintf(stderr, "%s: failed to write `%s': %s\n", program_name, output, strerror(errno));
+			ret = 1;
+		}
+	}
 
-		/* write header */
-		struct datapack_pakfile_entry p = {
-			.csize = htobe32((unsigned int)e->in),
-			.usize = htobe32((unsigned int)e->out),
-			.fsize = htobe32((unsigned int)strlen(e->dst)),
-		};
-		long cur = ftell(dst);
-		fseek(dst, header, SEEK_SET);
-		fwrite(&p, sizeof(struct datapack_pakfile_entry), 1, dst);
-		fwrite(e->dst, strlen(e->dst), 1, dst);
-		fseek(dst, cur, SEEK_SET);
+	free(sorted);
+	free(a);
+	free(x.entry);
+	datapack_close(x.pak);
+	return ret;
+}
+
+/**
+ * Parse size with optional K, M or G suffix.
+ * @return Size in bytes or 0 if str is invalid.
+ */
+static size_t parse_size(const char* str){
+	char* end;
+	unsigned long long value = strtoull(str, &end, 10);
+	switch ( toupper(*end) ){
+	case 'G': value *= 1024;
+	case 'M': value *= 1024;
+	case 'K': value *= 1024; end++;
 	}
+	if ( *end != 0 && strcmp(end, "B") != 0 && strcmp(end, "iB") != 0 ){
+		return 0;
+	}
+	return (size_t)value;
+}
 
-	return 0;
+static void write_summary(void){
+	if ( base ){
+		fprintf(verbose, "patch: %zd entries unchanged, %zd removed, %zd written as deltas (%zd bytes).\n",
+		        unchanged_entries, deleted_entries, delta_entries, delta_bytes);
+	}
+	if ( num_volumes > 0 ){
+		fprintf(verbose, "data written into %zd volumes.\n", num_volumes);
+	}
+	if ( stored_entries == 0 ) return;
+	fprintf(verbose, "%zd entries (%zd bytes) stored uncompressed, saving an estimated %.2f ms of inflate time per full read.\n",
+	        stored_entries, stored_bytes, decode_saved_ms);
 }
 
 static void reopen_output(){
@@ -569,10 +2770,15 @@ int main(int argc, char* argv[]){
 		program_name = argv[0];
 	}
 
-	const char* output = "/dev/stdout";
+	const char* output = "-";
 	const char* deps = NULL;
 	const char* header = NULL;
 	const char* srcdir = ".";
+	const char* profile = NULL;
+	const char* delta_from = NULL;
+	const char* append = NULL;
+	const char* extract = NULL;
+	const char* analyze = NULL;
 
 	/* initial output */
 	verbose = fopen("/dev/null",   "w");
@@ -623,6 +2829,10 @@ int main(int argc, char* argv[]){
 		file_given = 1;
 		break;
 
+		case 'T': /* --from-tar */
+			tar_name = optarg;
+			break;
+
 		case 'o':
 			output = optarg;
 			break;
@@ -653,6 +2863,70 @@ int main(int argc, char* argv[]){
 			}
 			break;
 
+		case 'S': /* --solid */
+			solid_size = optarg ? parse_size(optarg) : SOLID_DEFAULT;
+			if ( solid_size == 0 ){
+				fprintf(stderr, "%s: invalid solid block size `%s'.\n", program_name, optarg);
+				exit(1);
+			}
+			break;
+
+		case 'g': /* --segment-size */
+			segment_size = parse_size(optarg);
+			if ( segment_size == 0 ){
+				fprintf(stderr, "%s: invalid segment size `%s'.\n", program_name, optarg);
+				exit(1);
+			}
+			break;
+
+		case 'V': /* --volume-size */
+			volume_size = parse_size(optarg);
+			if ( volume_size == 0 ){
+				fprintf(stderr, "%s: invalid volume size `%s'.\n", program_name, optarg);
+				exit(1);
+			}
+			break;
+
+		case 'l': /* --level */
+			if ( strlen(optarg) != 1 || !isdigit(optarg[0]) ){
+				fprintf(stderr, "%s: invalid compression level `%s'.\n", program_name, optarg);
+				exit(1);
+			}
+			default_level = optarg[0] - '0';
+			break;
+
+		case 'm': /* --min-saving */
+			min_saving = (unsigned int)atoi(optarg);
+			if ( min_saving > 100 ){
+				fprintf(stderr, "%s: invalid saving `%s'.\n", program_name, optarg);
+				exit(1);
+			}
+			break;
+
+		case 'L': /* --layout-profile */
+			profile = optarg;
+			break;
+
+		case 'D': /* --delta-from */
+			delta_from = optarg;
+			break;
+
+		case 'A': /* --append-to */
+			append = optarg;
+			break;
+
+		case 'x': /* --extract */
+			extract = optarg;
+			break;
+
+		case 'R': /* --report */
+			report_name = optarg;
+			break;
+
+		case 'a': /* --analyze */
+			analyze = optarg;
+			break;
+
 		case 'v':
 			log_level = 2;
 			reopen_output();
@@ -677,18 +2951,64 @@ int main(int argc, char* argv[]){
 		}
 	}
 
+	/* extracting uses the remaining arguments as patterns and -o as directory */
+	if ( extract ){
+		return extract_pack(extract, strcmp(output, "-") != 0 ? strip_slash((char*)output) : ".", &argv[optind], argc - optind);
+	}
+
+	/* analyzing uses the remaining arguments as patterns and writes to -o */
+	if ( analyze ){
+		return analyze_pack(analyze, output, &argv[optind], argc - optind);
+	}
+
+	/* appending writes a binary blob to the given file instead of the output */
+	if ( append ){
+		if ( strcmp(output, "-") != 0 ){
+			fprintf(stderr, "%s: --append-to cannot be combined with --output\n", program_name);
+			return 1;
+		}
+		output = append;
+		type = BINARY;
+	}
+
 	/* bail out if trying to write Makefile dependencies when no filename is given */
-	if ( deps && strcmp(output, "/dev/stdout") == 0 ){
+	if ( deps && strcmp(output, "-") == 0 ){
 		fprintf(stderr, "%s: cannot write Makefile dependencies when writing output to stdout, must set filename with -o\n", program_name);
 		return 1;
 	}
 
-	FILE* dst = fopen(output, "w");
+	/* volumes are written next to the output and are referenced by name */
+	if ( volume_size > 0 ){
+		if ( type != BINARY || append || delta_from || strcmp(output, "-") == 0 ){
+			fprintf(stderr, "%s: --volume-size requires --type=bin and --output and cannot be combined with --append-to or --delta-from\n", program_name);
+			return 1;
+		}
+		volume_base = output;
+	}
+
+	/* open the pack a patch is created against */
+	if ( delta_from ){
+		if ( type != BINARY ){
+			fprintf(stderr, "%s: --delta-from requires --type=bin\n", program_name);
+			return 1;
+		}
+		base = datapack_open(delta_from);
+		if ( !base || base_checksum(delta_from, &base_crc) != 0 ){
+			fprintf(stderr, "%s: failed to read base pack `%s': %s\n", program_name, delta_from,
+			        base ? "not a version 2 binary blob" : strerror(errno));
+			return 1;
+		}
+	}
+
+	FILE* dst = append ? open_append(output) : strcmp(output, "-") != 0 ? fopen(output, "w") : stdout;
 	if ( !dst ){
 		fprintf(stderr, "%s: failed to open `%s' for writing: %s\n", program_name, output, strerror(errno));
 		return 1;
 	}
 
+	/* output is written strictly sequentially so use large writes */
+	setvbuf(dst, NULL, _IOFBF, OUTPUT_BUFFER);
+
 	/* read entries from arguments */
 	for ( int i = optind; i < argc; i++ ){
 		char* line = argv[i];
@@ -699,7 +3019,7 @@ int main(int argc, char* argv[]){
 
 	/* bail out if there is no files to pack. If '-f' was given but it was empty
 	 * it is probably what the user want so let it generate an empty pack. */
-	if ( num_entries == 0 && file_given == 0 ){
+	if ( num_entries == 0 && file_given == 0 && !tar_name ){
 		fprintf(stderr, "%s: no files given.\n", program_name);
 		fprintf(normal, "usage: %s DATANAME:FILENAME..\n", program_name);
 		return 1;
@@ -727,6 +3047,21 @@ int main(int argc, char* argv[]){
 		free(tmp);
 	}
 
+	if ( profile && apply_layout_profile(profile) != 0 ){
+		return 1;
+	}
+
+	/* members of the tar archive are added as it is read while packing */
+	FILE* tar = NULL;
+	if ( tar_name ){
+		tar = strcmp(tar_name, "-") != 0 ? fopen(tar_name, "r") : stdin;
+		if ( !tar ){
+			fprintf(stderr, "%s: failed to read `%s': %s\n", program_name, tar_name, strerror(errno));
+			return 1;
+		}
+		tar_fp = tar;
+	}
+
 	int ret = 0;
 
 	switch ( type ){
@@ -739,10 +3074,34 @@ int main(int argc, char* argv[]){
 		break;
 	}
 
+	if ( ret == 0 && report_name ){
+		ret = write_report(report_name, output);
+	}
+	if ( ret == 0 ){
+		write_summary();
+	}
+
 	fclose(dst);
+	if ( tar ){
+		fclose(tar);
+	}
+	if ( base ){
+		datapack_close(base);
+	}
 	fclose(verbose);
 	fclose(normal);
+	for ( size_t i = 0; i < num_rules; i++ ){
+		free(rules[i].pattern);
+	}
+	free(rules);
+	for ( struct entry* e = &entries[0]; e->src; e++ ){
+		free(e->dst);
+		free(e->src);
+		free(e->segments);
+	}
 	free(entries);
+	free(variables);
+	free(blocks);
 	entries = NULL;
 	return ret;
 }
@@ -2,9 +2,10 @@
 #define DATAPACK_PAK_H
 
 #define DATAPACK_MAGIC {'D', 'A', 'T', 'A', 'P', 'A', 'C', 'K'}
+#define DATAPACK_NO_BLOCK 0xFFFFFFFF
 
 /**
- * File entry for binary formats.
+ * File entry for binary formats (version 1).
  */
 struct datapack_pakfile_entry {
 	uint32_t csize;            /* compressed size */
@@ -14,7 +15,7 @@ struct datapack_pakfile_entry {
 } __attribute__((packed));
 
 /**
- * File header for binary formats.
+ * File header for binary formats (version 1).
  */
 struct datapack_pak_header {
 	uint8_t dp_version;        /* pak-version */
@@ -22,4 +23,84 @@ struct datapack_pak_header {
 	uint16_t dp_num_entries;   /* number of entries */
 } __attribute__((packed));
 
+/**
+ * File header for binary formats (version 2).
+ *
+ * Data follows directly after the header and the directory is placed after
+ * the data, located by the footer at the very end of the file. This allows
+ * the pak to be written sequentially without seeking. The directory consists
+ * of dp_num_blocks block records followed by dp_num_entries file entries.
+ *
+ * A pak may be appended to another file such as an executable, all offsets
+ * are then relative to the beginning of that file.
+ */
+struct datapack_pak_header_v2 {
+	uint8_t dp_version;        /* pak-version */
+	uint8_t dp_flags;          /* DATAPACK_PAK_* flags */
+	uint32_t dp_base_crc;      /* CRC32C of the directory and footer of the base pack (patches only) */
+} __attribute__((packed));
+
+#define DATAPACK_PAK_PATCH 0x1     /* pak is a patch against a base pack */
+#define DATAPACK_PAK_VOLUMES 0x2   /* data is split across volume files */
+
+/**
+ * Volume table for binary formats (version 2). A pak with DATAPACK_PAK_VOLUMES
+ * set holds no data itself, only the directory. Each volume file starts with
+ * the magic and a header with DATAPACK_PAK_VOLUMES set followed by data, all
+ * offsets of blocks and entries are within their volume.
+ *
+ * The volume table follows the file entries in the directory: the volume of
+ * each block and each file entry (uint32_t, 0 for records without data), the
+ * number of volume files (uint32_t) and the filename of volume 1, 2, etc
+ * (uint32_t length followed by the name) relative to the directory of the pak.
+ */
+
+/**
+ * Delta instructions for binary formats (version 2). The data of a
+ * DATAPACK_DELTA entry is the size of the instructions (uint32_t) followed by
+ * the zlib-compressed instructions. Applied in order they must produce
+ * exactly usize bytes.
+ */
+#define DATAPACK_DELTA_COPY 'C'    /* uint32_t offset, uint32_t length: copy from the base entry */
+#define DATAPACK_DELTA_ADD 'A'     /* uint32_t length, data: copy literal bytes */
+
+/**
+ * File footer for binary formats (version 2).
+ */
+struct datapack_pak_footer {
+	uint64_t dp_start;         /* offset to magic (non-zero if appended to another file) */
+	uint64_t dp_offset;        /* offset to directory */
+	uint32_t dp_num_blocks;    /* number of solid blocks */
+	uint32_t dp_num_entries;   /* number of entries */
+	uint8_t dp_version;        /* pak-version */
+	uint8_t dp_magic[8];       /* DATAPACK_MAGIC */
+} __attribute__((packed));
+
+/**
+ * Solid block for binary formats (version 2). A block is a single compressed
+ * stream holding the data of several consecutive entries.
+ */
+struct datapack_pakfile_block {
+	uint64_t offset;           /* offset to compressed data */
+	uint32_t csize;            /* compressed size */
+	uint32_t usize;            /* uncompressed size */
+	uint32_t crc;              /* CRC32C of compressed data */
+} __attribute__((packed));
+
+/**
+ * File entry for binary formats (version 2). Segmented entries are followed
+ * by the compressed size of each segment (uint32_t) after the filename.
+ */
+struct datapack_pakfile_entry_v2 {
+	uint64_t offset;           /* offset to compressed data or offset within block */
+	uint32_t csize;            /* compressed size (0 for entries stored in a block) */
+	uint32_t usize;            /* uncompressed size */
+	uint32_t block;            /* block index or DATAPACK_NO_BLOCK */
+	uint32_t flags;            /* DATAPACK_* entry flags */
+	uint32_t ssize;            /* uncompressed segment size (0 if not segmented) */
+	uint32_t crc;              /* CRC32C of compressed data (if DATAPACK_CHECKSUM is set) */
+	uint32_t fsize;            /* length of filename */
+	char filename[0];          /* filename */
+} __attribute__((packed));
+
 #endif /* DATAPACK_PAK_H */
@@ -6,6 +6,13 @@
 #include <cstdlib>
 #include <cstring>
 #include <cerrno>
+#include <csignal>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "data1.h"
 
 #include <cppunit/CompilerOutputter.h>
@@ -13,11 +20,172 @@
 #include <cppunit/ui/text/TestRunner.h>
 #include <cppunit/extensions/HelperMacros.h>
 
+static void copy_file(const char* src, const char* dst){
+	FILE* in = fopen(src, "rb");
+	FILE* out = fopen(dst, "wb");
+	CPPUNIT_ASSERT(in && out);
+	int c;
+	while ( (c=fgetc(in)) != EOF ){
+		fputc(c, out);
+	}
+	fclose(in);
+	fclose(out);
+}
+
+static void ignore_signal(int sig){
+	(void)sig;
+}
+
+static std::string read_file(const char* filename){
+	std::string data;
+	FILE* fp = fopen(filename, "rb");
+	if ( !fp ){
+		CPPUNIT_FAIL(std::string("failed to read ") + filename + ": " + strerror(errno));
+	}
+	char buf[4096];
+	size_t bytes;
+	while ( (bytes=fread(buf, 1, sizeof(buf), fp)) > 0 ){
+		data.append(buf, bytes);
+	}
+	fclose(fp);
+	return data;
+}
+
+struct stream_sink {
+	std::string data;
+	size_t chunks;
+	size_t stop;     /* stop after this many chunks (0 to read everything) */
+	size_t short_chunks;
+	size_t chunk;
+};
+
+static int stream_append(const char* data, size_t size, void* ctx){
+	struct stream_sink* sink = (struct stream_sink*)ctx;
+	if ( size != sink->chunk ){
+		sink->short_chunks++;
+	}
+	sink->data.append(data, size);
+	return ++sink->chunks == sink->stop ? -1 : 0;
+}
+
+static int collect_entries(const struct datapack_entry* entry, void* data){
+	static_cast<std::vector<const struct datapack_entry*>*>(data)->push_back(entry);
+	return 0;
+}
+
+static int collect_names(const struct datapack_entry* entry, void* data){
+	static_cast<std::vector<std::string>*>(data)->push_back(entry->filename);
+	return 0;
+}
+
+/* allocator counting allocations in ctx */
+struct alloc_count {
+	size_t allocs;
+	size_t live;
+};
+
+static void* count_alloc(void* ctx, size_t size){
+	struct alloc_count* count = (struct alloc_count*)ctx;
+	count->allocs++;
+	count->live++;
+	return malloc(size);
+}
+
+static void* count_realloc(void* ctx, void* ptr, size_t size){
+	struct alloc_count* count = (struct alloc_count*)ctx;
+	count->allocs++;
+	if ( !ptr ) count->live++;
+	return realloc(ptr, size);
+}
+
+static void count_free(void* ctx, void* ptr){
+	struct alloc_count* count = (struct alloc_count*)ctx;
+	count->live--;
+	free(ptr);
+}
+
+/* unpack in a new thread and reset the global allocator before the thread
+ * (and its per-thread context) goes away */
+static void* unpack_reset(void* ptr){
+	char* data;
+	if ( unpack_filename((datapack_t)ptr, "data1.txt", &data) == 0 ){
+		free(data);
+	}
+	datapack_set_allocator(NULL, NULL);
+	return NULL;
+}
+
+/* unpack a solid entry in a new thread which stays alive until told to exit */
+struct unpack_wait {
+	datapack_t handle;
+	struct alloc_count* count;
+	int ready[2];
+	int done[2];
+};
+
+static void* unpack_wait(void* ptr){
+	struct unpack_wait* w = (struct unpack_wait*)ptr;
+	char* data;
+	char c = 0;
+	if ( unpack(unpack_find(w->handle, "data1.txt"), &data) == 0 ){
+		count_free(w->count, data);
+		c = 1;
+	}
+	if ( write(w->ready[1], &c, 1) == 1 ){
+		c = (char)read(w->done[0], &c, 1);
+	}
+	return NULL;
+}
+
+struct find_loop {
+	datapack_t handle;
+	int stop;
+	unsigned long lookups;
+	unsigned long failures;
+};
+
+static void* find_loop(void* ptr){
+	struct find_loop* f = (struct find_loop*)ptr;
+	while ( !__atomic_load_n(&f->stop, __ATOMIC_ACQUIRE) ){
+		const struct datapack_entry* entry = unpack_find(f->handle, "data2.txt");
+		char* data;
+		if ( !entry || unpack(entry, &data) != 0 ){
+			f->failures++;
+		} else {
+			f->failures += strcmp(data, "test data\n") != 0;
+			free(data);
+		}
+		f->lookups++;
+	}
+	return NULL;
+}
+
 class Test: public CppUnit::TestFixture {
   CPPUNIT_TEST_SUITE(Test);
   CPPUNIT_TEST( test_unpack_inline );
   CPPUNIT_TEST( test_unpack_filename );
   CPPUNIT_TEST( test_unpack_pack );
+  CPPUNIT_TEST( test_unpack_solid );
+  CPPUNIT_TEST( test_unpack_stored );
+  CPPUNIT_TEST( test_unpack_segmented );
+  CPPUNIT_TEST( test_verify );
+  CPPUNIT_TEST( test_trace );
+  CPPUNIT_TEST( test_advise );
+  CPPUNIT_TEST( test_shared );
+  CPPUNIT_TEST( test_stream );
+  CPPUNIT_TEST( test_many );
+  CPPUNIT_TEST( test_allocator );
+  CPPUNIT_TEST( test_patch );
+  CPPUNIT_TEST( test_mmap );
+  CPPUNIT_TEST( test_appended );
+  CPPUNIT_TEST( test_volumes );
+  CPPUNIT_TEST( test_tar );
+  CPPUNIT_TEST( test_reload );
+  CPPUNIT_TEST( test_extract );
+  CPPUNIT_TEST( test_report );
+  CPPUNIT_TEST( test_glob );
+  CPPUNIT_TEST( test_compact );
+  CPPUNIT_TEST( test_readdir );
   CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -63,6 +231,843 @@ public:
 
 	  datapack_close(handle);
   }
+
+  void test_unpack_solid(){
+	  datapack_t handle = datapack_open("tests/solid.pak");
+	  if ( !handle ){
+		  CPPUNIT_FAIL(std::string("unpack_open(..) failed: ") + strerror(errno));
+	  }
+
+	  const struct datapack_entry* a = unpack_find(handle, "data1.txt");
+	  const struct datapack_entry* b = unpack_find(handle, "data2.txt");
+	  CPPUNIT_ASSERT(a && b);
+	  CPPUNIT_ASSERT(a->block != NULL);
+	  CPPUNIT_ASSERT(a->block == b->block);
+
+	  char* tmp;
+	  int ret = unpack_filename(handle, "data1.txt", &tmp);
+	  if ( ret != 0 ){
+		  CPPUNIT_FAIL(std::string("unpack_filename(..) failed: ") + strerror(ret));
+	  }
+	  CPPUNIT_ASSERT_EQUAL(std::string(tmp), std::string("test data\n"));
+	  free(tmp);
+
+	  char buf[64] = {0,};
+	  FILE* fp = unpack_open(handle, "data2.txt", "r");
+	  CPPUNIT_ASSERT(fp != NULL);
+	  CPPUNIT_ASSERT_EQUAL((size_t)10, fread(buf, 1, sizeof(buf), fp));
+	  CPPUNIT_ASSERT_EQUAL(std::string(buf), std::string("test data\n"));
+	  fclose(fp);
+
+	  datapack_close(handle);
+  }
+
+  void test_unpack_stored(){
+	  datapack_t handle = datapack_open("tests/data2.pak");
+	  if ( !handle ){
+		  CPPUNIT_FAIL(std::string("unpack_open(..) failed: ") + strerror(errno));
+	  }
+
+	  /* tiny file does not compress and should be stored as-is */
+	  const struct datapack_entry* entry = unpack_find(handle, "data3.txt");
+	  CPPUNIT_ASSERT(entry != NULL);
+	  CPPUNIT_ASSERT(entry->flags & DATAPACK_STORED);
+	  CPPUNIT_ASSERT_EQUAL(entry->usize, entry->csize);
+
+	  char buf[64] = {0,};
+	  FILE* fp = unpack_open(handle, "data3.txt", "r");
+	  CPPUNIT_ASSERT(fp != NULL);
+	  CPPUNIT_ASSERT_EQUAL((size_t)10, fread(buf, 1, sizeof(buf), fp));
+	  CPPUNIT_ASSERT_EQUAL(std::string(buf), std::string("test data\n"));
+	  fclose(fp);
+
+	  datapack_close(handle);
+  }
+
+  void test_unpack_segmented(){
+	  datapack_t handle = datapack_open("tests/segmented.pak");
+	  if ( !handle ){
+		  CPPUNIT_FAIL(std::string("unpack_open(..) failed: ") + strerror(errno));
+	  }
+
+	  const struct datapack_entry* entry = unpack_find(handle, "data3.txt");
+	  CPPUNIT_ASSERT(entry != NULL);
+	  CPPUNIT_ASSERT(entry->flags & DATAPACK_SEGMENTED);
+	  CPPUNIT_ASSERT_EQUAL((size_t)4, entry->ssize);
+
+	  char* tmp;
+	  datapack_set_threads(4);
+	  int ret = unpack(entry, &tmp);
+	  datapack_set_threads(0);
+	  if ( ret != 0 ){
+		  CPPUNIT_FAIL(std::string("unpack(..) failed: ") + strerror(ret));
+	  }
+	  CPPUNIT_ASSERT_EQUAL(std::string(tmp), std::string("test data\n"));
+	  free(tmp);
+
+	  char buf[64] = {0,};
+	  FILE* fp = unpack_open(handle, "data3.txt", "r");
+	  CPPUNIT_ASSERT(fp != NULL);
+	  CPPUNIT_ASSERT_EQUAL((size_t)10, fread(buf, 1, sizeof(buf), fp));
+	  CPPUNIT_ASSERT_EQUAL(std::string(buf), std::string("test data\n"));
+	  fclose(fp);
+
+	  datapack_close(handle);
+  }
+
+  void test_verify(){
+	  datapack_t handle = datapack_open("tests/data2.pak");
+	  if ( !handle ){
+		  CPPUNIT_FAIL(std::string("unpack_open(..) failed: ") + strerror(errno));
+	  }
+	  const struct datapack_entry* entry = unpack_find(handle, "data3.txt");
+	  CPPUNIT_ASSERT(entry != NULL);
+	  CPPUNIT_ASSERT(entry->flags & DATAPACK_CHECKSUM);
+	  const long offset = entry->offset;
+	  datapack_close(handle);
+
+	  /* copy pack with a single byte of data3.txt flipped */
+	  FILE* src = fopen("tests/data2.pak", "rb");
+	  FILE* dst = fopen("tests/corrupt.pak", "wb");
+	  CPPUNIT_ASSERT(src && dst);
+	  int c;
+	  for ( long i = 0; (c=fgetc(src)) != EOF; i++ ){
+		  fputc(i == offset ? c ^ 0x20 : c, dst);
+	  }
+	  fclose(src);
+	  fclose(dst);
+
+	  char* tmp;
+	  handle = datapack_open("tests/corrupt.pak");
+	  CPPUNIT_ASSERT(handle != NULL);
+	  CPPUNIT_ASSERT_EQUAL(EBADMSG, unpack_filename(handle, "data3.txt", &tmp));
+	  CPPUNIT_ASSERT_EQUAL(EBADMSG, unpack_filename(handle, "data3.txt", &tmp));
+
+	  /* lazily mapped data reads as zeroes and the error is kept (SIGBUS is
+	   * raised as well when faults are caught as SIGSEGV) */
+	  struct sigaction act, old;
+	  memset(&act, 0, sizeof(act));
+	  act.sa_handler = ignore_signal;
+	  sigemptyset(&act.sa_mask);
+	  sigaction(SIGBUS, &act, &old);
+	  const char* data;
+	  size_t size;
+	  CPPUNIT_ASSERT_EQUAL(0, unpack_mmap(unpack_find(handle, "data3.txt"), &data, &size));
+	  CPPUNIT_ASSERT_EQUAL(0, unpack_mmap_error(data));
+	  CPPUNIT_ASSERT_EQUAL('\0', *(volatile const char*)data);
+	  CPPUNIT_ASSERT_EQUAL(EBADMSG, unpack_mmap_error(data));
+	  unpack_munmap(data, size);
+	  sigaction(SIGBUS, &old, NULL);
+	  datapack_close(handle);
+
+	  datapack_set_verify(DATAPACK_VERIFY_OPEN);
+	  handle = datapack_open("tests/corrupt.pak");
+	  const int err = errno;
+	  datapack_set_verify(DATAPACK_VERIFY_LAZY);
+	  CPPUNIT_ASSERT(handle == NULL);
+	  CPPUNIT_ASSERT_EQUAL(EBADMSG, err);
+  }
+
+  void test_trace(){
+	  datapack_t handle = datapack_open(NULL);
+	  if ( !handle ){
+		  CPPUNIT_FAIL(std::string("unpack_open(..) failed: ") + strerror(errno));
+	  }
+
+	  char* tmp;
+	  CPPUNIT_ASSERT_EQUAL(0, datapack_trace("tests/trace.txt"));
+	  CPPUNIT_ASSERT_EQUAL(0, unpack_filename(handle, "data2.txt", &tmp));
+	  free(tmp);
+	  FILE* fp = unpack_open(handle, "data1.txt", "r");
+	  CPPUNIT_ASSERT(fp != NULL);
+	  fclose(fp);
+	  CPPUNIT_ASSERT_EQUAL(0, datapack_trace(NULL));
+	  CPPUNIT_ASSERT_EQUAL(0, unpack_filename(handle, "data2.txt", &tmp)); /* not traced */
+	  free(tmp);
+	  datapack_close(handle);
+
+	  char name[2][64];
+	  long ms;
+	  fp = fopen("tests/trace.txt", "r");
+	  CPPUNIT_ASSERT(fp != NULL);
+	  CPPUNIT_ASSERT_EQUAL(2, fscanf(fp, "%ld\t%63s\n", &ms, name[0]));
+	  CPPUNIT_ASSERT_EQUAL(2, fscanf(fp, "%ld\t%63s\n", &ms, name[1]));
+	  CPPUNIT_ASSERT_EQUAL(EOF, fscanf(fp, "%ld\t%63s\n", &ms, name[1]));
+	  fclose(fp);
+	  CPPUNIT_ASSERT_EQUAL(std::string("data2.txt"), std::string(name[0]));
+	  CPPUNIT_ASSERT_EQUAL(std::string("data1.txt"), std::string(name[1]));
+  }
+
+  void test_advise(){
+	  datapack_t handle = datapack_open("tests/solid.pak");
+	  if ( !handle ){
+		  CPPUNIT_FAIL(std::string("unpack_open(..) failed: ") + strerror(errno));
+	  }
+
+	  CPPUNIT_ASSERT_EQUAL(0, datapack_advise(handle, NULL, DATAPACK_ADVISE_WILLNEED));
+	  CPPUNIT_ASSERT_EQUAL(0, datapack_advise(handle, "data1*", DATAPACK_ADVISE_DONTNEED));
+	  CPPUNIT_ASSERT_EQUAL(0, datapack_advise(handle, "missing", DATAPACK_ADVISE_SEQUENTIAL));
+	  CPPUNIT_ASSERT_EQUAL(EINVAL, datapack_advise(handle, NULL, (datapack_advice_t)42));
+	  CPPUNIT_ASSERT_EQUAL(0, datapack_lock_index(handle, 1));
+
+	  char* tmp;
+	  CPPUNIT_ASSERT_EQUAL(0, unpack_filename(handle, "data1.txt", &tmp));
+	  CPPUNIT_ASSERT_EQUAL(std::string(tmp), std::string("test data\n"));
+	  free(tmp);
+	  datapack_close(handle);
+
+	  handle = datapack_open(NULL);
+	  CPPUNIT_ASSERT(handle != NULL);
+	  CPPUNIT_ASSERT_EQUAL(0, datapack_advise(handle, NULL, DATAPACK_ADVISE_WILLNEED));
+	  CPPUNIT_ASSERT_EQUAL(EINVAL, datapack_lock_index(handle, 1));
+	  datapack_close(handle);
+  }
+
+  void test_shared(){
+	  datapack_t handle = datapack_open("tests/segmented.pak");
+	  if ( !handle ){
+		  CPPUNIT_FAIL(std::string("unpack_open(..) failed: ") + strerror(errno));
+	  }
+	  const struct datapack_entry* entry = unpack_find(handle, "data3.txt");
+	  CPPUNIT_ASSERT(entry != NULL);
+
+	  /* private copy */
+	  const char* data;
+	  size_t size;
+	  CPPUNIT_ASSERT_EQUAL(0, unpack_shared(entry, &data, &size));
+	  CPPUNIT_ASSERT_EQUAL((size_t)10, size);
+	  CPPUNIT_ASSERT_EQUAL(std::string("test data\n"), std::string(data));
+	  unpack_shared_release(data, size);
+
+	  /* first call publishes, second maps the published file */
+	  mkdir("tests/shared", 0755);
+	  CPPUNIT_ASSERT_EQUAL(0, datapack_set_shared_cache("tests/shared"));
+	  for ( int i = 0; i < 2; i++ ){
+		  CPPUNIT_ASSERT_EQUAL(0, unpack_shared(entry, &data, &size));
+		  CPPUNIT_ASSERT_EQUAL((size_t)10, size);
+		  CPPUNIT_ASSERT_EQUAL(std::string("test data\n"), std::string(data));
+		  unpack_shared_release(data, size);
+	  }
+
+	  /* a cache file writable by others is not trusted */
+	  DIR* planted = opendir("tests/shared");
+	  CPPUNIT_ASSERT(planted != NULL);
+	  struct dirent* plant;
+	  while ( (plant=readdir(planted)) ){
+		  if ( plant->d_name[0] == '.' ) continue;
+		  std::string path = std::string("tests/shared/") + plant->d_name;
+		  CPPUNIT_ASSERT_EQUAL(0, chmod(path.c_str(), 0666));
+		  FILE* fp = fopen(path.c_str(), "r+");
+		  CPPUNIT_ASSERT(fp != NULL);
+		  fputs("evil data\n", fp);
+		  fclose(fp);
+	  }
+	  closedir(planted);
+	  CPPUNIT_ASSERT_EQUAL(0, unpack_shared(entry, &data, &size));
+	  CPPUNIT_ASSERT_EQUAL(std::string("test data\n"), std::string(data));
+	  unpack_shared_release(data, size);
+	  datapack_set_shared_cache(NULL);
+	  datapack_close(handle);
+
+	  /* exactly one published file and no leftover temporaries */
+	  int files = 0;
+	  DIR* dir = opendir("tests/shared");
+	  CPPUNIT_ASSERT(dir != NULL);
+	  struct dirent* ent;
+	  while ( (ent=readdir(dir)) ){
+		  if ( ent->d_name[0] == '.' ) continue;
+		  std::string path = std::string("tests/shared/") + ent->d_name;
+		  unlink(path.c_str());
+		  files++;
+	  }
+	  closedir(dir);
+	  rmdir("tests/shared");
+	  CPPUNIT_ASSERT_EQUAL(1, files);
+  }
+
+  void test_stream(){
+	  static const char* pack[] = {"tests/data2.pak", "tests/solid.pak", "tests/segmented.pak", "tests/base.pak"};
+	  static const char* name[] = {"data3.txt", "data2.txt", "data3.txt", "larger.txt"};
+	  for ( unsigned int i = 0; i < 4; i++ ){
+		  datapack_t handle = datapack_open(pack[i]);
+		  CPPUNIT_ASSERT(handle != NULL);
+		  const struct datapack_entry* entry = unpack_find(handle, name[i]);
+		  CPPUNIT_ASSERT(entry != NULL);
+
+		  char* expected;
+		  CPPUNIT_ASSERT_EQUAL(0, unpack(entry, &expected));
+
+		  /* odd chunk size so chunks straddle segments and refills */
+		  struct stream_sink sink = {std::string(), 0, 0, 0, 3};
+		  CPPUNIT_ASSERT_EQUAL(0, unpack_stream(entry, stream_append, &sink, 3));
+		  CPPUNIT_ASSERT_EQUAL(std::string(expected), sink.data);
+		  CPPUNIT_ASSERT(sink.short_chunks <= 1);
+
+		  /* sink stops the stream */
+		  struct stream_sink stop = {std::string(), 0, 2, 0, 3};
+		  CPPUNIT_ASSERT_EQUAL(-1, unpack_stream(entry, stream_append, &stop, 3));
+		  CPPUNIT_ASSERT_EQUAL(std::string(expected, 6), stop.data);
+
+		  free(expected);
+		  datapack_close(handle);
+	  }
+  }
+
+  void test_many(){
+	  /* stored, compressed, solid, segmented and split into volumes */
+	  static const char* pack[] = {"tests/data2.pak", "tests/base.pak", "tests/solid.pak", "tests/segmented.pak", "tests/volumes.pak", "tests/compact.pak"};
+	  for ( unsigned int i = 0; i < 6; i++ ){
+		  datapack_t handle = datapack_open(pack[i]);
+		  CPPUNIT_ASSERT(handle != NULL);
+		  std::vector<const struct datapack_entry*> entries;
+		  datapack_glob(handle, NULL, collect_entries, &entries);
+
+		  std::vector<char*> data(entries.size());
+		  CPPUNIT_ASSERT_EQUAL(0, unpack_many(entries.data(), data.data(), entries.size()));
+		  for ( size_t j = 0; j < entries.size(); j++ ){
+			  char* expected;
+			  CPPUNIT_ASSERT_EQUAL(0, unpack(entries[j], &expected));
+			  CPPUNIT_ASSERT_EQUAL(std::string(expected), std::string(data[j]));
+			  free(expected);
+			  free(data[j]);
+		  }
+
+		  datapack_close(handle);
+	  }
+
+	  /* a failing entry fails the batch */
+	  datapack_t handle = datapack_open("tests/base.pak");
+	  CPPUNIT_ASSERT(handle != NULL);
+	  struct datapack_entry broken = *unpack_find(handle, "larger.txt");
+	  broken.offset = 1 << 30;
+	  const struct datapack_entry* entries[] = {unpack_find(handle, "data1.txt"), &broken};
+	  char* data[2];
+	  CPPUNIT_ASSERT_EQUAL(EIO, unpack_many(entries, data, 2));
+	  CPPUNIT_ASSERT(data[0] == NULL && data[1] == NULL);
+	  datapack_close(handle);
+  }
+
+  void test_allocator(){
+	  struct alloc_count global = {0, 0};
+	  struct alloc_count local = {0, 0};
+	  const struct datapack_allocator a = {count_alloc, count_realloc, count_free, &global};
+	  const struct datapack_allocator b = {count_alloc, count_realloc, count_free, &local};
+
+	  /* handles opened afterwards use the global allocator */
+	  datapack_set_allocator(NULL, &a);
+	  datapack_t handle = datapack_open("tests/solid.pak");
+	  CPPUNIT_ASSERT(handle != NULL);
+	  CPPUNIT_ASSERT(global.allocs > 0);
+
+	  char* data;
+	  CPPUNIT_ASSERT_EQUAL(0, unpack_filename(handle, "data1.txt", &data));
+	  CPPUNIT_ASSERT_EQUAL(std::string("test data\n"), std::string(data));
+	  count_free(&global, data);
+
+	  /* data unpacked from the handle comes from its own allocator */
+	  datapack_set_allocator(handle, &b);
+	  std::vector<const struct datapack_entry*> entries;
+	  datapack_glob(handle, NULL, collect_entries, &entries);
+	  for ( size_t i = 0; i < entries.size(); i++ ){
+		  CPPUNIT_ASSERT_EQUAL(0, unpack(entries[i], &data));
+		  CPPUNIT_ASSERT_EQUAL((size_t)1, local.live);
+		  count_free(&local, data);
+	  }
+	  std::vector<char*> many(entries.size());
+	  CPPUNIT_ASSERT_EQUAL(0, unpack_many(entries.data(), many.data(), entries.size()));
+	  CPPUNIT_ASSERT_EQUAL(entries.size(), local.live);
+	  for ( size_t i = 0; i < many.size(); i++ ){
+		  count_free(&local, many[i]);
+	  }
+	  CPPUNIT_ASSERT(local.allocs > 0);
+
+	  /* the state of the handle goes back to the allocator it came from */
+	  const size_t before = global.live;
+	  datapack_close(handle);
+	  CPPUNIT_ASSERT(global.live < before);
+	  CPPUNIT_ASSERT_EQUAL((size_t)0, local.live);
+	  datapack_set_allocator(NULL, NULL);
+
+	  /* per-thread state is freed using the allocator it came from */
+	  handle = datapack_open("tests/solid.pak");
+	  CPPUNIT_ASSERT(handle != NULL);
+	  global.live = 0;
+	  global.allocs = 0;
+	  datapack_set_allocator(NULL, &a);
+	  pthread_t thread;
+	  CPPUNIT_ASSERT_EQUAL(0, pthread_create(&thread, NULL, unpack_reset, handle));
+	  pthread_join(thread, NULL);
+	  CPPUNIT_ASSERT(global.allocs > 0);
+	  CPPUNIT_ASSERT_EQUAL((size_t)0, global.live);
+	  datapack_close(handle);
+
+	  /* closing a pack releases blocks cached by other threads */
+	  local.live = 0;
+	  struct unpack_wait w;
+	  w.handle = datapack_open("tests/solid.pak");
+	  w.count = &local;
+	  CPPUNIT_ASSERT(w.handle != NULL);
+	  CPPUNIT_ASSERT(pipe(w.ready) == 0 && pipe(w.done) == 0);
+	  datapack_set_allocator(w.handle, &b);
+	  CPPUNIT_ASSERT_EQUAL(0, pthread_create(&thread, NULL, unpack_wait, &w));
+	  char c = 0;
+	  CPPUNIT_ASSERT_EQUAL((ssize_t)1, read(w.ready[0], &c, 1));
+	  CPPUNIT_ASSERT_EQUAL((char)1, c);
+	  CPPUNIT_ASSERT_EQUAL((size_t)1, local.live); /* cached block */
+	  datapack_close(w.handle);
+	  CPPUNIT_ASSERT_EQUAL((size_t)0, local.live);
+	  CPPUNIT_ASSERT_EQUAL((ssize_t)1, write(w.done[1], &c, 1));
+	  pthread_join(thread, NULL);
+	  for ( unsigned int i = 0; i < 2; i++ ){
+		  close(w.ready[i]);
+		  close(w.done[i]);
+	  }
+  }
+
+  void test_patch(){
+	  datapack_t base = datapack_open("tests/base.pak");
+	  if ( !base ){
+		  CPPUNIT_FAIL(std::string("datapack_open(..) failed: ") + strerror(errno));
+	  }
+	  datapack_t handle = datapack_open_patch("tests/patch.pak", base);
+	  if ( !handle ){
+		  CPPUNIT_FAIL(std::string("datapack_open_patch(..) failed: ") + strerror(errno));
+	  }
+
+	  /* unchanged entries are read from base, removed entries are gone */
+	  const struct datapack_entry* entry = unpack_find(handle, "data1.txt");
+	  CPPUNIT_ASSERT(entry != NULL);
+	  CPPUNIT_ASSERT(entry == unpack_find(base, "data1.txt"));
+	  CPPUNIT_ASSERT(unpack_find(handle, "data2.txt") == NULL);
+	  CPPUNIT_ASSERT_EQUAL((size_t)3, datapack_glob(handle, NULL, NULL, NULL));
+
+	  char* tmp;
+	  int ret = unpack_filename(handle, "data4.txt", &tmp);
+	  if ( ret != 0 ){
+		  CPPUNIT_FAIL(std::string("unpack_filename(..) failed: ") + strerror(ret));
+	  }
+	  CPPUNIT_ASSERT_EQUAL(std::string(tmp), std::string("test data\n"));
+	  free(tmp);
+
+	  /* changed entry is rebuilt from a delta against base */
+	  entry = unpack_find(handle, "larger.txt");
+	  CPPUNIT_ASSERT(entry != NULL);
+	  CPPUNIT_ASSERT(entry->flags & DATAPACK_DELTA);
+	  CPPUNIT_ASSERT(entry->csize < 256);
+	  ret = unpack(entry, &tmp);
+	  if ( ret != 0 ){
+		  CPPUNIT_FAIL(std::string("unpack(..) failed: ") + strerror(ret));
+	  }
+	  const std::string data(tmp);
+	  free(tmp);
+	  CPPUNIT_ASSERT_EQUAL(entry->usize, data.size());
+	  CPPUNIT_ASSERT_EQUAL((size_t)0, data.find("Lorem ipsum"));
+	  CPPUNIT_ASSERT(data.find("Patched lacinia") != std::string::npos);
+	  CPPUNIT_ASSERT_EQUAL(data.size() - 8, data.rfind("patched\n"));
+
+	  std::string stream(entry->usize, 0);
+	  FILE* fp = unpack_open(handle, "larger.txt", "r");
+	  CPPUNIT_ASSERT(fp != NULL);
+	  CPPUNIT_ASSERT_EQUAL(entry->usize, fread(&stream[0], 1, entry->usize, fp));
+	  fclose(fp);
+	  CPPUNIT_ASSERT(stream == data);
+	  datapack_close(handle);
+
+	  /* the patch lists removed entries when opened by itself */
+	  handle = datapack_open("tests/patch.pak");
+	  CPPUNIT_ASSERT(handle != NULL);
+	  entry = unpack_find(handle, "data2.txt");
+	  CPPUNIT_ASSERT(entry != NULL);
+	  CPPUNIT_ASSERT(entry->flags & DATAPACK_DELETED);
+	  CPPUNIT_ASSERT(unpack_find(handle, "data1.txt") == NULL);
+	  datapack_close(handle);
+
+	  /* patches only apply to the pack they were created from */
+	  datapack_t other = datapack_open("tests/data2.pak");
+	  CPPUNIT_ASSERT(other != NULL);
+	  errno = 0;
+	  CPPUNIT_ASSERT(datapack_open_patch("tests/patch.pak", other) == NULL);
+	  CPPUNIT_ASSERT_EQUAL(EINVAL, errno);
+	  datapack_close(other);
+	  datapack_close(base);
+  }
+
+  void test_mmap(){
+	  static const char* paks[] = {"tests/segmented.pak", "tests/data2.pak", "tests/solid.pak"};
+	  for ( unsigned int i = 0; i < 3; i++ ){
+		  datapack_t handle = datapack_open(paks[i]);
+		  if ( !handle ){
+			  CPPUNIT_FAIL(std::string("datapack_open(..) failed: ") + strerror(errno));
+		  }
+
+		  /* pages are filled when read */
+		  const struct datapack_entry* entry = unpack_find(handle, i < 2 ? "data3.txt" : "data2.txt");
+		  CPPUNIT_ASSERT(entry != NULL);
+		  const char* data;
+		  size_t size;
+		  int ret = unpack_mmap(entry, &data, &size);
+		  if ( ret != 0 ){
+			  CPPUNIT_FAIL(std::string("unpack_mmap(..) failed: ") + strerror(ret));
+		  }
+		  CPPUNIT_ASSERT_EQUAL((size_t)10, size);
+		  CPPUNIT_ASSERT_EQUAL(std::string(data), std::string("test data\n"));
+		  unpack_munmap(data, size);
+
+		  datapack_close(handle);
+	  }
+
+	  /* compressed data read from file in chunks */
+	  datapack_t handle = datapack_open("tests/base.pak");
+	  CPPUNIT_ASSERT(handle != NULL);
+	  const struct datapack_entry* entry = unpack_find(handle, "larger.txt");
+	  char* expected;
+	  const char* data;
+	  size_t size;
+	  CPPUNIT_ASSERT_EQUAL(0, unpack(entry, &expected));
+	  CPPUNIT_ASSERT_EQUAL(0, unpack_mmap(entry, &data, &size));
+	  CPPUNIT_ASSERT_EQUAL(std::string(expected), std::string(data, size));
+	  unpack_munmap(data, size);
+	  free(expected);
+	  datapack_close(handle);
+  }
+
+  void test_volumes(){
+	  datapack_t handle = datapack_open("tests/volumes.pak");
+	  if ( !handle ){
+		  CPPUNIT_FAIL(std::string("datapack_open(..) failed: ") + strerror(errno));
+	  }
+	  datapack_t base = datapack_open("tests/base.pak");
+	  CPPUNIT_ASSERT(base != NULL);
+
+	  /* each entry is read from its own volume */
+	  static const char* name[] = {"data1.txt", "data2.txt", "larger.txt"};
+	  unsigned int seen = 0;
+	  for ( unsigned int i = 0; i < 3; i++ ){
+		  const struct datapack_entry* entry = unpack_find(handle, name[i]);
+		  CPPUNIT_ASSERT(entry != NULL);
+		  CPPUNIT_ASSERT(entry->volume > 0);
+		  CPPUNIT_ASSERT((seen & (1u << entry->volume)) == 0);
+		  seen |= 1u << entry->volume;
+		  CPPUNIT_ASSERT(datapack_entry_fd(entry) != -1);
+
+		  char* expected;
+		  char* tmp;
+		  CPPUNIT_ASSERT_EQUAL(0, unpack(unpack_find(base, name[i]), &expected));
+		  int ret = unpack(entry, &tmp);
+		  if ( ret != 0 ){
+			  CPPUNIT_FAIL(std::string("unpack(..) failed: ") + strerror(ret));
+		  }
+		  CPPUNIT_ASSERT_EQUAL(std::string(expected), std::string(tmp));
+
+		  struct stream_sink sink = {std::string(), 0, 0, 0, 7};
+		  CPPUNIT_ASSERT_EQUAL(0, unpack_stream(entry, stream_append, &sink, 7));
+		  CPPUNIT_ASSERT_EQUAL(std::string(expected), sink.data);
+		  free(expected);
+		  free(tmp);
+	  }
+
+	  /* checksums of all volumes are verified at open */
+	  datapack_set_verify(DATAPACK_VERIFY_OPEN);
+	  datapack_t verified = datapack_open("tests/volumes.pak");
+	  datapack_set_verify(DATAPACK_VERIFY_LAZY);
+	  CPPUNIT_ASSERT(verified != NULL);
+	  datapack_close(verified);
+
+	  /* volume names pointing outside the directory of the pack are rejected */
+	  std::string data = read_file("tests/volumes.pak");
+	  const size_t pos = data.find("volumes.pak.1");
+	  CPPUNIT_ASSERT(pos != std::string::npos);
+	  data.replace(pos, 3, "../");
+	  FILE* fp = fopen("tests/escape.pak", "wb");
+	  CPPUNIT_ASSERT(fp != NULL);
+	  fwrite(data.data(), 1, data.size(), fp);
+	  fclose(fp);
+	  errno = 0;
+	  CPPUNIT_ASSERT(datapack_open("tests/escape.pak") == NULL);
+	  CPPUNIT_ASSERT_EQUAL(EBADF, errno);
+	  unlink("tests/escape.pak");
+
+	  datapack_close(base);
+	  datapack_close(handle);
+  }
+
+  void test_tar(){
+	  datapack_t handle = datapack_open("tests/tar.pak");
+	  if ( !handle ){
+		  CPPUNIT_FAIL(std::string("datapack_open(..) failed: ") + strerror(errno));
+	  }
+
+	  /* the directory member is skipped, files are named as in the archive */
+	  std::vector<std::string> names;
+	  datapack_glob(handle, NULL, collect_names, &names);
+	  CPPUNIT_ASSERT_EQUAL((size_t)2, names.size());
+	  CPPUNIT_ASSERT_EQUAL(std::string("sample/larger.txt"), names[0]);
+	  CPPUNIT_ASSERT_EQUAL(std::string("tests/data1.txt"), names[1]);
+
+	  char* tmp;
+	  int ret = unpack_filename(handle, "tests/data1.txt", &tmp);
+	  if ( ret != 0 ){
+		  CPPUNIT_FAIL(std::string("unpack_filename(..) failed: ") + strerror(ret));
+	  }
+	  CPPUNIT_ASSERT_EQUAL(std::string("test data\n"), std::string(tmp));
+	  free(tmp);
+
+	  CPPUNIT_ASSERT_EQUAL(0, unpack_filename(handle, "sample/larger.txt", &tmp));
+	  CPPUNIT_ASSERT(read_file(SRCDIR "sample/larger.txt") == tmp);
+	  free(tmp);
+
+	  datapack_close(handle);
+  }
+
+  void test_appended(){
+	  /* file is left as-is with the blob after it */
+	  char buf[11] = {0,};
+	  FILE* fp = fopen("tests/appended.bin", "rb");
+	  CPPUNIT_ASSERT(fp != NULL);
+	  CPPUNIT_ASSERT_EQUAL((size_t)10, fread(buf, 1, 10, fp));
+	  fclose(fp);
+	  CPPUNIT_ASSERT_EQUAL(std::string(buf), std::string("test data\n"));
+
+	  struct stat st, pak;
+	  CPPUNIT_ASSERT_EQUAL(0, stat("tests/appended.bin", &st));
+	  CPPUNIT_ASSERT_EQUAL(0, stat("tests/data2.pak", &pak));
+	  CPPUNIT_ASSERT_EQUAL(pak.st_size + 10, st.st_size);
+
+	  datapack_t handle = datapack_open("tests/appended.bin");
+	  if ( !handle ){
+		  CPPUNIT_FAIL(std::string("datapack_open(..) failed: ") + strerror(errno));
+	  }
+	  CPPUNIT_ASSERT_EQUAL((size_t)1, datapack_glob(handle, NULL, NULL, NULL));
+
+	  char* tmp;
+	  int ret = unpack_filename(handle, "data3.txt", &tmp);
+	  if ( ret != 0 ){
+		  CPPUNIT_FAIL(std::string("unpack_filename(..) failed: ") + strerror(ret));
+	  }
+	  CPPUNIT_ASSERT_EQUAL(std::string(tmp), std::string("test data\n"));
+	  free(tmp);
+
+	  fp = unpack_open(handle, "data3.txt", "r");
+	  CPPUNIT_ASSERT(fp != NULL);
+	  memset(buf, 0, sizeof(buf));
+	  CPPUNIT_ASSERT_EQUAL((size_t)10, fread(buf, 1, sizeof(buf), fp));
+	  fclose(fp);
+	  CPPUNIT_ASSERT_EQUAL(std::string(buf), std::string("test data\n"));
+
+	  datapack_close(handle);
+  }
+
+  void test_reload(){
+	  copy_file("tests/data2.pak", "tests/reload.pak");
+	  datapack_t handle = datapack_open_watch("tests/reload.pak");
+	  if ( !handle ){
+		  CPPUNIT_FAIL(std::string("datapack_open_watch(..) failed: ") + strerror(errno));
+	  }
+	  datapack_t snapshot = datapack_snapshot(handle);
+	  FILE* fp = unpack_open(handle, "data3.txt", "r");
+	  CPPUNIT_ASSERT(snapshot && fp);
+
+	  /* replace the pack by renaming a new file over it */
+	  copy_file("tests/solid.pak", "tests/reload.tmp");
+	  CPPUNIT_ASSERT_EQUAL(0, rename("tests/reload.tmp", "tests/reload.pak"));
+	  for ( int i = 0; i < 500 && !unpack_find(handle, "data1.txt"); i++ ){
+		  usleep(10000);
+	  }
+	  CPPUNIT_ASSERT(unpack_find(handle, "data1.txt") != NULL);
+	  CPPUNIT_ASSERT(unpack_find(handle, "data3.txt") == NULL);
+	  CPPUNIT_ASSERT_EQUAL(0, datapack_reload(handle));
+
+	  /* the old version stays usable until released */
+	  char buf[11] = {0,};
+	  CPPUNIT_ASSERT_EQUAL((size_t)10, fread(buf, 1, 10, fp));
+	  fclose(fp);
+	  CPPUNIT_ASSERT_EQUAL(std::string(buf), std::string("test data\n"));
+
+	  char* tmp;
+	  int ret = unpack_filename(snapshot, "data3.txt", &tmp);
+	  if ( ret != 0 ){
+		  CPPUNIT_FAIL(std::string("unpack_filename(..) failed: ") + strerror(ret));
+	  }
+	  CPPUNIT_ASSERT_EQUAL(std::string(tmp), std::string("test data\n"));
+	  free(tmp);
+	  datapack_close(snapshot);
+
+	  ret = unpack_filename(handle, "data2.txt", &tmp);
+	  if ( ret != 0 ){
+		  CPPUNIT_FAIL(std::string("unpack_filename(..) failed: ") + strerror(ret));
+	  }
+	  CPPUNIT_ASSERT_EQUAL(std::string(tmp), std::string("test data\n"));
+	  free(tmp);
+
+	  /* entries from unpack_find outlive concurrent reloads */
+	  struct find_loop f = {handle, 0, 0, 0};
+	  pthread_t thread;
+	  CPPUNIT_ASSERT_EQUAL(0, pthread_create(&thread, NULL, find_loop, &f));
+	  for ( int i = 0; i < 20; i++ ){
+		  copy_file(i % 2 ? "tests/solid.pak" : "tests/base.pak", "tests/reload.tmp");
+		  CPPUNIT_ASSERT_EQUAL(0, rename("tests/reload.tmp", "tests/reload.pak"));
+		  CPPUNIT_ASSERT_EQUAL(0, datapack_reload(handle));
+	  }
+	  __atomic_store_n(&f.stop, 1, __ATOMIC_RELEASE);
+	  pthread_join(thread, NULL);
+	  CPPUNIT_ASSERT(f.lookups > 0);
+	  CPPUNIT_ASSERT_EQUAL(0UL, f.failures);
+
+	  datapack_close(handle);
+	  unlink("tests/reload.pak");
+  }
+
+  void test_extract(){
+	  CPPUNIT_ASSERT(read_file(SRCDIR "sample/larger.txt") == read_file("tests/extract/larger.txt"));
+	  CPPUNIT_ASSERT_EQUAL(std::string("test data\n"), read_file("tests/extract/data1.txt"));
+	  CPPUNIT_ASSERT_EQUAL(std::string("test data\n"), read_file("tests/extract/data2.txt"));
+	  CPPUNIT_ASSERT_EQUAL(std::string("test data\n"), read_file("tests/extract/stored/data3.txt"));
+  }
+
+  void test_report(){
+	  const std::string report = read_file("tests/report.json");
+	  CPPUNIT_ASSERT(report.find("\"name\": \"data1.txt\", \"size\": 10, \"compressed\": 10, \"ratio\": 1.000, \"method\": \"stored\"") != std::string::npos);
+	  CPPUNIT_ASSERT(report.find("\"name\": \"larger.txt\", \"size\": 2633,") != std::string::npos);
+	  CPPUNIT_ASSERT(report.find("\"totals\": {\"entries\": 3, \"size\": 2653,") != std::string::npos);
+	  CPPUNIT_ASSERT(report.find("\"decode_saved_ms\": ") != std::string::npos);
+
+	  /* data2.txt has the same content as data1.txt */
+	  const std::string analysis = read_file("tests/analyze.json");
+	  CPPUNIT_ASSERT(analysis.find("\"pack\": \"tests/base.pak\"") != std::string::npos);
+	  CPPUNIT_ASSERT(analysis.find("\"duplicate_of\": \"data1.txt\", \"advice\": \"remove: duplicate\"") != std::string::npos);
+	  CPPUNIT_ASSERT(analysis.find("\"name\": \"larger.txt\", \"size\": 2633,") != std::string::npos);
+	  CPPUNIT_ASSERT(analysis.find("\"advice\": \"solid: small entry\"") != std::string::npos);
+	  CPPUNIT_ASSERT(analysis.find("\"duplicates\": 1, \"duplicate_bytes\": 10}") != std::string::npos);
+  }
+
+  void test_glob(){
+	  datapack_t handle = datapack_open(NULL);
+	  if ( !handle ){
+		  CPPUNIT_FAIL(std::string("unpack_open(..) failed: ") + strerror(errno));
+	  }
+
+	  CPPUNIT_ASSERT_EQUAL((size_t)2, datapack_glob(handle, NULL, NULL, NULL));
+	  CPPUNIT_ASSERT_EQUAL((size_t)0, datapack_glob(handle, "data", NULL, NULL));
+	  CPPUNIT_ASSERT_EQUAL((size_t)2, datapack_glob(handle, "data*", NULL, NULL));
+	  CPPUNIT_ASSERT_EQUAL((size_t)0, datapack_glob(handle, "data2.tx", NULL, NULL));
+	  CPPUNIT_ASSERT_EQUAL((size_t)1, datapack_glob(handle, "data2.txt", NULL, NULL));
+	  CPPUNIT_ASSERT_EQUAL((size_t)1, datapack_glob(handle, "*1.txt", NULL, NULL));
+	  CPPUNIT_ASSERT_EQUAL((size_t)0, datapack_glob(handle, "spam", NULL, NULL));
+
+	  datapack_close(handle);
+  }
+
+  void test_compact(){
+	  static const char* pack[] = {"tests/compact.pak", "tests/base.pak", "tests/solid.pak", "tests/segmented.pak", "tests/volumes.pak", "tests/unsorted.pak"};
+	  mkdir("tests/shared", 0755);
+	  CPPUNIT_ASSERT_EQUAL(0, datapack_set_shared_cache("tests/shared"));
+	  for ( unsigned int i = 0; i < 6; i++ ){
+		  datapack_t full = datapack_open(pack[i]);
+		  datapack_set_index(DATAPACK_INDEX_COMPACT);
+		  datapack_t handle = datapack_open(pack[i]);
+		  datapack_set_index(DATAPACK_INDEX_FULL);
+		  if ( !full || !handle ){
+			  CPPUNIT_FAIL(std::string("datapack_open(..) failed: ") + strerror(errno));
+		  }
+
+		  /* same entries in the same order */
+		  std::vector<std::string> expected, names;
+		  datapack_glob(full, NULL, collect_names, &expected);
+		  datapack_glob(handle, NULL, collect_names, &names);
+		  CPPUNIT_ASSERT(expected == names);
+
+		  for ( size_t j = 0; j < expected.size(); j++ ){
+			  const struct datapack_entry* a = unpack_find(full, expected[j].c_str());
+			  const struct datapack_entry* b = unpack_find(handle, expected[j].c_str());
+			  CPPUNIT_ASSERT(b != NULL);
+			  CPPUNIT_ASSERT(b == unpack_find(handle, expected[j].c_str()));
+			  CPPUNIT_ASSERT_EQUAL(a->offset, b->offset);
+			  CPPUNIT_ASSERT_EQUAL(a->csize, b->csize);
+			  CPPUNIT_ASSERT_EQUAL(a->flags, b->flags);
+
+			  char* x;
+			  char* y;
+			  CPPUNIT_ASSERT_EQUAL(0, unpack(a, &x));
+			  CPPUNIT_ASSERT_EQUAL(0, unpack(b, &y));
+			  CPPUNIT_ASSERT_EQUAL(std::string(x, a->usize), std::string(y, b->usize));
+
+			  /* data cached by one index mode is found by the other */
+			  const char* shared[2];
+			  size_t size[2];
+			  CPPUNIT_ASSERT_EQUAL(0, unpack_shared(a, &shared[0], &size[0]));
+			  CPPUNIT_ASSERT_EQUAL(0, unpack_shared(b, &shared[1], &size[1]));
+			  CPPUNIT_ASSERT_EQUAL(std::string(x, a->usize), std::string(shared[1], size[1]));
+			  unpack_shared_release(shared[0], size[0]);
+			  unpack_shared_release(shared[1], size[1]);
+			  free(x);
+			  free(y);
+
+			  /* names between and around existing ones are missing */
+			  CPPUNIT_ASSERT(unpack_find(handle, (expected[j] + "0").c_str()) == NULL);
+			  CPPUNIT_ASSERT(unpack_find(handle, expected[j].substr(0, expected[j].size() - 1).c_str()) == NULL);
+		  }
+		  CPPUNIT_ASSERT(unpack_find(handle, "") == NULL);
+		  CPPUNIT_ASSERT(unpack_find(handle, "~") == NULL);
+
+		  static const char* pattern[] = {"dir1/*", "dir2/file1*", "*.txt", "data", "spam"};
+		  for ( unsigned int j = 0; j < 5; j++ ){
+			  CPPUNIT_ASSERT_EQUAL(datapack_glob(full, pattern[j], NULL, NULL), datapack_glob(handle, pattern[j], NULL, NULL));
+		  }
+
+		  datapack_close(full);
+		  datapack_close(handle);
+	  }
+	  datapack_set_shared_cache(NULL);
+	  DIR* cache = opendir("tests/shared");
+	  CPPUNIT_ASSERT(cache != NULL);
+	  struct dirent* ent;
+	  while ( (ent=readdir(cache)) ){
+		  if ( ent->d_name[0] == '.' ) continue;
+		  unlink((std::string("tests/shared/") + ent->d_name).c_str());
+	  }
+	  closedir(cache);
+	  rmdir("tests/shared");
+
+	  /* directories span several groups */
+	  datapack_set_index(DATAPACK_INDEX_COMPACT);
+	  datapack_t handle = datapack_open("tests/compact.pak");
+	  datapack_set_index(DATAPACK_INDEX_FULL);
+	  CPPUNIT_ASSERT(handle != NULL);
+	  datapack_dir_t dir = datapack_opendir(handle, NULL);
+	  CPPUNIT_ASSERT(dir != NULL);
+	  for ( unsigned int i = 0; i < 3; i++ ){
+		  const struct datapack_dirent* ent = datapack_readdir(dir);
+		  CPPUNIT_ASSERT(ent != NULL);
+		  CPPUNIT_ASSERT_EQUAL(std::string("dir") + char('0' + i), std::string(ent->name));
+		  CPPUNIT_ASSERT(ent->is_dir);
+	  }
+	  CPPUNIT_ASSERT(datapack_readdir(dir) == NULL);
+	  datapack_closedir(dir);
+	  datapack_close(handle);
+  }
+
+  void test_readdir(){
+	  datapack_t handle = datapack_open(NULL);
+	  if ( !handle ){
+		  CPPUNIT_FAIL(std::string("unpack_open(..) failed: ") + strerror(errno));
+	  }
+
+	  datapack_dir_t dir = datapack_opendir(handle, NULL);
+	  CPPUNIT_ASSERT(dir != NULL);
+
+	  const struct datapack_dirent* ent;
+	  ent = datapack_readdir(dir);
+	  CPPUNIT_ASSERT(ent != NULL);
+	  CPPUNIT_ASSERT_EQUAL(std::string("data1.txt"), std::string(ent->name));
+	  ent = datapack_readdir(dir);
+	  CPPUNIT_ASSERT(ent != NULL);
+	  CPPUNIT_ASSERT_EQUAL(std::string("data2.txt"), std::string(ent->name));
+	  CPPUNIT_ASSERT(datapack_readdir(dir) == NULL);
+
+	  datapack_closedir(dir);
+	  CPPUNIT_ASSERT(datapack_opendir(handle, "missing") == NULL);
+	  datapack_close(handle);
+  }
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(Test);
@@ -4,255 +4,4170 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
+#include <limits.h>
 #include <zlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <dlfcn.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <sched.h>
+#ifdef HAVE_LINUX_USERFAULTFD_H
+#include <linux/userfaultfd.h>
+#endif
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+#define HAVE_IO_URING 1
+#endif
 #include "datapack.h"
 #include "pak.h"
+#include "crc32c.h"
 
 #define CHUNK 16384
+#define BLOCK_CACHE_SLOTS 4
+#define INFLATE_POOL_SIZE 8
+#define VERIFY_CHUNK (256*1024)
+#define COMPACT_GROUP 16            /* filenames per front-coded group of a compact index */
+#define BATCH_DEPTH 64              /* reads in flight in unpack_many */
+#define LAZY_ARENA (64*1024)        /* memory handed to zlib by each lazy mapping */
 
 static char* local = NULL;
+static char* shared_dir = NULL;
+static struct datapack_allocator local_owner;      /* allocator of local */
+static struct datapack_allocator shared_dir_owner; /* allocator of shared_dir */
+static unsigned long serial_counter = 0;
+static unsigned int max_threads = 0;
+static datapack_verify_t verify_mode = DATAPACK_VERIFY_LAZY;
+static datapack_index_t index_mode = DATAPACK_INDEX_FULL;
+
+/* memory allocation (see datapack_set_allocator) */
+static void* default_alloc(void* ctx, size_t size);
+static void* default_realloc(void* ctx, void* ptr, size_t size);
+static void default_free(void* ctx, void* ptr);
+static struct datapack_allocator allocator = {default_alloc, default_realloc, default_free, NULL};
+
+/* access trace */
+static FILE* trace_fp = NULL;
+static struct timespec trace_begin;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+
+/* lazy mappings (unpack_mmap) */
+static struct lazy_map* lazy_maps = NULL;
+static pthread_mutex_t lazy_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t lazy_once = PTHREAD_ONCE_INIT;
+static size_t lazy_page = 0;
+static int lazy_uffd = -1;          /* userfaultfd serving faults (-1 if faults are caught as SIGSEGV) */
+static struct sigaction lazy_oldact;
+
+struct datapack {
+	FILE* fp;
+	unsigned long serial;           /* unique id of this open pack (0 for in-process data) */
+	size_t num_entries;
+	size_t num_blocks;
+	void (*cleanup)(datapack_t handle);
+	struct datapack_block* blocks;  /* solid blocks */
+	struct datapack_entry** index;  /* filetable sorted by filename */
+	struct datapack_entry* entries; /* entry storage (NULL for in-process data) */
+	unsigned char* verified;        /* per entry, then per block: set once checksum is verified (NULL if not verifying) */
+	size_t size;                    /* bytes allocated for handle and index (0 for in-process data) */
+	int locked;                     /* set if index is locked in memory */
+	char identity[80];              /* identifies the pack file in the shared cache (empty for in-process data) */
+	long start;                     /* offset to beginning of pack within file */
+	char* map;                      /* file mapped into memory (NULL if data is read using pread) */
+	size_t map_size;
+	datapack_t base;                /* pack delta entries are applied against (NULL if none) */
+	datapack_t patch;               /* patch merged into this handle (NULL if none) */
+	int* volumes;                   /* descriptor of each volume file, volume 0 is fp (NULL if not split) */
+	size_t num_volumes;
+	unsigned long refs;             /* references held by the owner, snapshots, streams and mappings */
+	struct datapack_watch* watch;   /* reloadable handle state (NULL for regular handles) */
+	int pinned;                     /* set once entries were handed out through a watch handle */
+	datapack_t pinned_next;         /* next version kept by the watch handle (see watch_pin) */
+	struct datapack_compact* compact; /* compact index (NULL if index and filetable are used) */
+	struct datapack_allocator owner;  /* allocator of the handle itself and its index */
+	struct datapack_allocator allocator; /* allocator of data unpacked from the handle */
+	struct datapack_entry* filetable[];
+};
+
+/**
+ * Fixed-size record of an entry in a compact index.
+ */
+struct compact_record {
+	uint64_t offset;                /* offset to data, or within the solid block */
+	uint32_t csize;
+	uint32_t usize;
+	uint32_t block;                 /* solid block index or DATAPACK_NO_BLOCK */
+	uint32_t flags;
+	uint32_t ssize;
+	uint32_t crc;
+	uint32_t segments;              /* first segment size in the segment table */
+	uint32_t volume;
+};
+
+/**
+ * Entry materialized from a compact index, with its filename.
+ */
+struct compact_entry {
+	struct datapack_entry entry;
+	size_t index;                   /* position in the index */
+	char filename[];
+};
+
+/**
+ * Compact index: records sorted by filename and the filenames front-coded in
+ * groups of COMPACT_GROUP. The first name of a group is stored in full, the
+ * others as the length shared with the previous name (varint) followed by the
+ * rest of the name. Lookups binary search the first names and decode a single
+ * group.
+ */
+struct datapack_compact {
+	struct compact_record* records;
+	uint32_t* segments;
+	uint32_t* groups;               /* offset of each group in names */
+	const char* names;
+	size_t num_groups;
+	struct compact_entry** slots[]; /* per group, materialized entries (NULL until first used) */
+};
+
+/**
+ * Per-thread cache of decompressed solid blocks. Slots are keyed by both the
+ * pack serial and the block so a slot from a closed pack never matches a
+ * later pack reusing the same memory.
+ */
+struct block_cache_slot {
+	unsigned long serial;
+	const struct datapack_block* block;
+	char* data;
+	unsigned long used;
+	struct datapack_allocator allocator; /* allocator of data */
+};
+
+struct block_cache {
+	pthread_mutex_t lock;           /* taken by the owning thread and by block_cache_purge */
+	unsigned long clock;
+	struct block_cache_slot slot[BLOCK_CACHE_SLOTS];
+};
+
+/**
+ * Per-thread state. Besides the block cache it keeps a pool of initialized
+ * inflate streams which are reset between uses instead of reallocating the
+ * zlib state and window for every call.
+ */
+struct thread_context {
+	struct datapack_allocator owner; /* allocator of the context */
+	struct block_cache cache;
+	size_t num_streams;
+	z_stream* streams[INFLATE_POOL_SIZE];
+#ifdef HAVE_LIBDEFLATE
+	struct libdeflate_decompressor* decompressor;
+#endif
+	struct thread_context* prev;    /* list of all contexts (see block_cache_purge) */
+	struct thread_context* next;
+};
+
+/**
+ * Pooled inflate stream, zlib allocates its state using the allocator the
+ * stream was created with.
+ */
+struct inflate_stream {
+	z_stream strm;                  /* must be first */
+	struct datapack_allocator owner;
+};
+
+static pthread_key_t context_key;
+static pthread_once_t context_once = PTHREAD_ONCE_INIT;
+static struct thread_context* contexts = NULL;
+static pthread_mutex_t context_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Reserved mapping from unpack_mmap whose pages are filled on first touch.
+ */
+struct lazy_map {
+	const struct datapack_entry* src;
+	char* addr;
+	size_t size;                    /* bytes reserved (usize + 1 rounded up to whole pages) */
+	size_t* offsets;                /* offset of each segment within compressed data (segmented entries) */
+	unsigned char* filled;          /* per page: set once filled */
+	pthread_mutex_t lock;           /* held while filling pages */
+	int error;                      /* first error filling pages (see unpack_mmap_error) */
+
+	/* decode state allocated up front, nothing is allocated while serving a fault */
+	z_stream strm;
+	int strm_ready;
+	unsigned char* input;           /* compressed data read from file (CHUNK bytes) */
+	char* output;                   /* decoded segments of a chunk (segmented entries) */
+	char* arena;                    /* zlib state and window */
+	size_t arena_used;
+
+	struct datapack_allocator owner; /* allocator of the mapping and its buffers */
+	struct lazy_map* next;
+};
+
+struct datapack_dir {
+	datapack_t handle;
+	size_t cur;                     /* next index position */
+	size_t end;                     /* end of prefix range */
+	size_t plen;                    /* length of directory prefix */
+	char* prefix;                   /* directory prefix including trailing slash */
+	struct datapack_dirent dirent;
+	struct datapack_allocator owner; /* allocator of dir and prefix */
+};
+
+static void* default_alloc(void* ctx, size_t size){
+	(void)ctx;
+	return malloc(size);
+}
+
+static void* default_realloc(void* ctx, void* ptr, size_t size){
+	(void)ctx;
+	return realloc(ptr, size);
+}
+
+static void default_free(void* ctx, void* ptr){
+	(void)ctx;
+	free(ptr);
+}
+
+static void* mem_alloc(const struct datapack_allocator* a, size_t size){
+	return a->alloc(a->ctx, size);
+}
+
+static void* mem_calloc(const struct datapack_allocator* a, size_t n, size_t size){
+	if ( size > 0 && n > SIZE_MAX / size ){
+		return NULL;
+	}
+	void* ptr = a->alloc(a->ctx, n * size);
+	if ( ptr ){
+		memset(ptr, 0, n * size);
+	}
+	return ptr;
+}
+
+static void* mem_realloc(const struct datapack_allocator* a, void* ptr, size_t size){
+	return a->realloc(a->ctx, ptr, size);
+}
+
+static void mem_free(const struct datapack_allocator* a, void* ptr){
+	if ( ptr ){
+		a->free(a->ctx, ptr);
+	}
+}
+
+static char* mem_strndup(const struct datapack_allocator* a, const char* str, size_t len){
+	char* dst = (char*)mem_alloc(a, len + 1);
+	if ( dst ){
+		memcpy(dst, str, len);
+		dst[len] = 0;
+	}
+	return dst;
+}
+
+static char* mem_strdup(const struct datapack_allocator* a, const char* str){
+	return mem_strndup(a, str, strlen(str));
+}
+
+/**
+ * Format a string like asprintf(3).
+ * @return String or NULL if out of memory.
+ */
+static char* mem_printf(const struct datapack_allocator* a, const char* fmt, ...){
+	va_list ap;
+	va_start(ap, fmt);
+	const int len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if ( len < 0 ){
+		return NULL;
+	}
+
+	char* str = (char*)mem_alloc(a, (size_t)len + 1);
+	if ( str ){
+		va_start(ap, fmt);
+		vsnprintf(str, (size_t)len + 1, fmt, ap);
+		va_end(ap);
+	}
+	return str;
+}
+
+static voidpf zlib_alloc(voidpf opaque, uInt items, uInt size){
+	return mem_alloc((const struct datapack_allocator*)opaque, (size_t)items * size);
+}
+
+static void zlib_free(voidpf opaque, voidpf ptr){
+	mem_free((const struct datapack_allocator*)opaque, ptr);
+}
+
+/**
+ * Free a handle using the allocator it was allocated with.
+ */
+static void handle_free(datapack_t handle){
+	const struct datapack_allocator owner = handle->owner;
+	mem_free(&owner, handle);
+}
+
+/**
+ * Allocator of data unpacked from a pack (the global allocator for in-process
+ * data).
+ */
+static const struct datapack_allocator* handle_allocator(datapack_t handle){
+	return handle ? &handle->allocator : &allocator;
+}
+
+static const struct datapack_allocator* entry_allocator(const struct datapack_entry* src){
+	return handle_allocator(src->handle);
+}
+
+/**
+ * Decode the next filename of a group over the previous one in name.
+ * @return Position of the following filename.
+ */
+static const char* compact_decode(const char* ptr, char* name, int first){
+	size_t shared = 0;
+	if ( !first ){
+		unsigned int shift = 0;
+		unsigned char byte;
+		do {
+			byte = (unsigned char)*ptr++;
+			shared |= (size_t)(byte & 0x7f) << shift;
+			shift += 7;
+		} while ( byte & 0x80 );
+	}
+	const size_t len = strlen(ptr);
+	memcpy(name + shared, ptr, len + 1);
+	return ptr + len + 1;
+}
+
+/**
+ * Compact counterpart of index_bound. If match is given it tells whether the
+ * name at the returned position compares equal to key.
+ */
+static size_t compact_bound(datapack_t handle, const char* key, size_t len, int upper, int* match){
+	const struct datapack_compact* compact = handle->compact;
+
+	/* groups before lo start before the bound */
+	size_t lo = 0;
+	size_t hi = compact->num_groups;
+	while ( lo < hi ){
+		const size_t mid = lo + (hi - lo) / 2;
+		const int cmp = strncmp(compact->names + compact->groups[mid], key, len);
+		if ( cmp < 0 || (upper && cmp == 0) ){
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if ( match ) *match = 0;
+	if ( lo == 0 ){
+		if ( match && handle->num_entries > 0 ){
+			*match = strncmp(compact->names, key, len) == 0;
+		}
+		return 0;
+	}
+
+	/* the bound lies within the last of those groups */
+	char name[PATH_MAX];
+	const size_t first = (lo - 1) * COMPACT_GROUP;
+	const size_t last = first + COMPACT_GROUP < handle->num_entries ? first + COMPACT_GROUP : handle->num_entries;
+	const char* ptr = compact->names + compact->groups[lo - 1];
+	for ( size_t i = first; i < last; i++ ){
+		ptr = compact_decode(ptr, name, i == first);
+		const int cmp = strncmp(name, key, len);
+		if ( !(cmp < 0 || (upper && cmp == 0)) ){
+			if ( match ) *match = cmp == 0;
+			return i;
+		}
+	}
+	if ( match && last < handle->num_entries ){
+		*match = strncmp(compact->names + compact->groups[lo], key, len) == 0;
+	}
+	return last;
+}
+
+/**
+ * Entry at position i of a compact index, created on first use.
+ * @return Entry or NULL if out of memory.
+ */
+static struct datapack_entry* compact_entry(datapack_t handle, size_t i){
+	struct datapack_compact* compact = handle->compact;
+	const size_t group = i / COMPACT_GROUP;
+	struct compact_entry** slots = __atomic_load_n(&compact->slots[group], __ATOMIC_ACQUIRE);
+	if ( !slots ){
+		struct compact_entry** tmp = (struct compact_entry**)mem_calloc(&handle->owner, COMPACT_GROUP, sizeof(struct compact_entry*));
+		if ( !tmp ){
+			return NULL;
+		}
+		if ( __atomic_compare_exchange_n(&compact->slots[group], &slots, tmp, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ){
+			slots = tmp;
+		} else {
+			mem_free(&handle->owner, tmp);
+		}
+	}
+
+	struct compact_entry* entry = __atomic_load_n(&slots[i % COMPACT_GROUP], __ATOMIC_ACQUIRE);
+	if ( entry ){
+		return &entry->entry;
+	}
+
+	char name[PATH_MAX];
+	const char* ptr = compact->names + compact->groups[group];
+	for ( size_t j = group * COMPACT_GROUP; j <= i; j++ ){
+		ptr = compact_decode(ptr, name, j == group * COMPACT_GROUP);
+	}
+	const size_t len = strlen(name);
+	entry = (struct compact_entry*)mem_alloc(&handle->owner, sizeof(struct compact_entry) + len + 1);
+	if ( !entry ){
+		return NULL;
+	}
+	memcpy(entry->filename, name, len + 1);
+	entry->index = i;
+
+	const struct compact_record* record = &compact->records[i];
+	struct datapack_entry* e = &entry->entry;
+	e->handle = handle;
+	e->filename = entry->filename;
+	e->data = NULL;
+	e->csize = record->csize;
+	e->usize = record->usize;
+	e->flags = record->flags;
+	e->ssize = record->ssize;
+	e->segments = record->ssize > 0 ? &compact->segments[record->segments] : NULL;
+	e->crc = record->crc;
+	e->volume = record->volume;
+	if ( record->block == DATAPACK_NO_BLOCK ){
+		e->offset = (long)record->offset;
+		e->block = NULL;
+		e->boffset = 0;
+		if ( handle->map && record->offset <= handle->map_size && e->csize <= handle->map_size - record->offset ){
+			e->data = handle->map + record->offset;
+		}
+	} else {
+		e->offset = 0;
+		e->block = &handle->blocks[record->block];
+		e->boffset = (size_t)record->offset;
+	}
+
+	/* another thread may have created it meanwhile */
+	struct compact_entry* expected = NULL;
+	if ( !__atomic_compare_exchange_n(&slots[i % COMPACT_GROUP], &expected, entry, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ){
+		mem_free(&handle->owner, entry);
+		return &expected->entry;
+	}
+	return &entry->entry;
+}
+
+/**
+ * Entry at position i of the sorted index.
+ * @return Entry or NULL if out of memory.
+ */
+static struct datapack_entry* index_entry(datapack_t handle, size_t i){
+	return handle->compact ? compact_entry(handle, i) : handle->index[i];
+}
+
+/**
+ * Create every entry of a compact index.
+ * @return 0 on success or ENOMEM.
+ */
+static int index_materialize(datapack_t handle){
+	for ( size_t i = 0; handle->compact && i < handle->num_entries; i++ ){
+		if ( !compact_entry(handle, i) ){
+			return ENOMEM;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Position of an entry of a pack file in its index (compact) or entry storage.
+ */
+static size_t entry_index(const struct datapack_entry* src){
+	if ( src->handle->compact ){
+		return ((const struct compact_entry*)src)->index;
+	}
+	return (size_t)(src - src->handle->entries);
+}
+
+static int index_compare(const void* a, const void* b){
+	const struct datapack_entry* const* x = (const struct datapack_entry* const*)a;
+	const struct datapack_entry* const* y = (const struct datapack_entry* const*)b;
+	return strcmp((*x)->filename, (*y)->filename);
+}
+
+/**
+ * Build the sorted name index used by lookups and prefix queries. Storage is
+ * allocated unless the handle already provides it.
+ */
+static int index_build(datapack_t handle){
+	const size_t n = handle->num_entries;
+	if ( !handle->index ){
+		handle->index = (struct datapack_entry**)mem_alloc(&handle->owner, sizeof(struct datapack_entry*) * (n + 1));
+		if ( !handle->index ){
+			return ENOMEM;
+		}
+	}
+
+	memcpy(handle->index, handle->filetable, sizeof(struct datapack_entry*) * n);
+	handle->index[n] = NULL;
+	qsort(handle->index, n, sizeof(struct datapack_entry*), index_compare);
+	return 0;
+}
+
+/**
+ * Find the first index position whose filename compares greater or equal
+ * (upper = 0) or greater (upper = 1) than the first len bytes of key.
+ */
+static size_t index_bound(datapack_t handle, const char* key, size_t len, int upper){
+	if ( handle->compact ){
+		return compact_bound(handle, key, len, upper, NULL);
+	}
+
+	size_t lo = 0;
+	size_t hi = handle->num_entries;
+	while ( lo < hi ){
+		const size_t mid = lo + (hi - lo) / 2;
+		const int cmp = strncmp(handle->index[mid]->filename, key, len);
+		if ( cmp < 0 || (upper && cmp == 0) ){
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/**
+ * Free a stream using the allocator it was created with.
+ */
+static void inflate_free(z_stream* strm){
+	struct inflate_stream* stream = (struct inflate_stream*)strm;
+	const struct datapack_allocator owner = stream->owner;
+	inflateEnd(strm);
+	mem_free(&owner, stream);
+}
+
+static void context_free(void* ptr){
+	struct thread_context* ctx = (struct thread_context*)ptr;
+	pthread_mutex_lock(&context_lock);
+	if ( ctx->prev ) ctx->prev->next = ctx->next;
+	else contexts = ctx->next;
+	if ( ctx->next ) ctx->next->prev = ctx->prev;
+	pthread_mutex_unlock(&context_lock);
+
+	pthread_mutex_destroy(&ctx->cache.lock);
+	for ( unsigned int i = 0; i < BLOCK_CACHE_SLOTS; i++ ){
+		mem_free(&ctx->cache.slot[i].allocator, ctx->cache.slot[i].data);
+	}
+	for ( size_t i = 0; i < ctx->num_streams; i++ ){
+		inflate_free(ctx->streams[i]);
+	}
+#ifdef HAVE_LIBDEFLATE
+	if ( ctx->decompressor ){
+		libdeflate_free_decompressor(ctx->decompressor);
+	}
+#endif
+	const struct datapack_allocator owner = ctx->owner;
+	mem_free(&owner, ctx);
+}
+
+static void context_lock_acquire(void){
+	pthread_mutex_lock(&context_lock);
+}
+
+static void context_lock_release(void){
+	pthread_mutex_unlock(&context_lock);
+}
+
+static void context_init(void){
+	pthread_key_create(&context_key, context_free);
+
+	/* a forked child must not inherit the list lock while held */
+	pthread_atfork(context_lock_acquire, context_lock_release, context_lock_release);
+}
+
+static struct thread_context* context_get(void){
+	pthread_once(&context_once, context_init);
+
+	struct thread_context* ctx = (struct thread_context*)pthread_getspecific(context_key);
+	if ( !ctx ){
+		ctx = (struct thread_context*)mem_calloc(&allocator, 1, sizeof(struct thread_context));
+		if ( ctx ){
+			ctx->owner = allocator;
+			pthread_mutex_init(&ctx->cache.lock, NULL);
+			pthread_setspecific(context_key, ctx);
+
+			pthread_mutex_lock(&context_lock);
+			ctx->next = contexts;
+			if ( contexts ) contexts->prev = ctx;
+			contexts = ctx;
+			pthread_mutex_unlock(&context_lock);
+		}
+	}
+
+	return ctx;
+}
+
+static struct block_cache* block_cache_get(void){
+	struct thread_context* ctx = context_get();
+	return ctx ? &ctx->cache : NULL;
+}
+
+/**
+ * Get an initialized inflate stream, from the pool of the calling thread if
+ * possible.
+ * @return Stream or NULL if out of memory.
+ */
+static z_stream* inflate_acquire(void){
+	struct thread_context* ctx = context_get();
+	if ( ctx && ctx->num_streams > 0 ){
+		return ctx->streams[--ctx->num_streams];
+	}
+
+	struct inflate_stream* stream = (struct inflate_stream*)mem_alloc(&allocator, sizeof(struct inflate_stream));
+	if ( !stream ){
+		return NULL;
+	}
+
+	z_stream* strm = &stream->strm;
+	stream->owner = allocator;
+	strm->zalloc = zlib_alloc;
+	strm->zfree = zlib_free;
+	strm->opaque = &stream->owner;
+	strm->avail_in = 0;
+	strm->next_in = Z_NULL;
+	if ( inflateInit(strm) != Z_OK ){
+		mem_free(&stream->owner, stream);
+		return NULL;
+	}
+
+	return strm;
+}
+
+/**
+ * Return stream to the pool of the calling thread (which may differ from the
+ * thread which acquired it).
+ */
+static void inflate_release(z_stream* strm){
+	struct thread_context* ctx = context_get();
+	if ( ctx && ctx->num_streams < INFLATE_POOL_SIZE && inflateReset(strm) == Z_OK ){
+		ctx->streams[ctx->num_streams++] = strm;
+		return;
+	}
+
+	inflate_free(strm);
+}
+
+/**
+ * Release cached blocks belonging to a pack from the caches of all threads.
+ */
+static void block_cache_purge(unsigned long serial){
+	pthread_mutex_lock(&context_lock);
+	for ( struct thread_context* ctx = contexts; ctx; ctx = ctx->next ){
+		pthread_mutex_lock(&ctx->cache.lock);
+		for ( unsigned int i = 0; i < BLOCK_CACHE_SLOTS; i++ ){
+			struct block_cache_slot* slot = &ctx->cache.slot[i];
+			if ( slot->data && slot->serial == serial ){
+				mem_free(&slot->allocator, slot->data);
+				memset(slot, 0, sizeof(struct block_cache_slot));
+			}
+		}
+		pthread_mutex_unlock(&ctx->cache.lock);
+	}
+	pthread_mutex_unlock(&context_lock);
+}
+
+static void datapack_proc_cleanup(datapack_t handle){
+	mem_free(&handle->owner, handle->index);
+}
+
+static datapack_t datapack_open_proc(){
+	void* dl = dlopen(NULL, RTLD_LAZY);
+	if ( !dl ){
+		errno = EINVAL;
+		return NULL;
+	}
+
+	const struct datapack_entry** filetable = (const struct datapack_entry**)dlsym(dl, "filetable");
+	if ( !filetable ){
+		errno = ENOENT;
+		return NULL;
+	}
+
+	size_t n = 0;
+	while ( filetable[n] ){
+		n++;
+	}
+
+	const size_t tablesize = sizeof(struct datapack_entry*) * (n + 1); /* +1 for sentinel */
+	datapack_t pak = (datapack_t)mem_alloc(&allocator, sizeof(struct datapack) + tablesize);
+	if ( !pak ){
+		errno = ENOMEM;
+		return NULL;
+	}
+	pak->fp = NULL;
+	pak->serial = 0;
+	pak->num_entries = n;
+	pak->num_blocks = 0;
+	pak->blocks = NULL;
+	pak->index = NULL;
+	pak->entries = NULL;
+	pak->verified = NULL;
+	pak->size = 0;
+	pak->locked = 0;
+	pak->identity[0] = 0;
+	pak->start = 0;
+	pak->map = NULL;
+	pak->map_size = 0;
+	pak->base = NULL;
+	pak->patch = NULL;
+	pak->volumes = NULL;
+	pak->num_volumes = 0;
+	pak->refs = 1;
+	pak->watch = NULL;
+	pak->pinned = 0;
+	pak->pinned_next = NULL;
+	pak->compact = NULL;
+	pak->owner = allocator;
+	pak->allocator = allocator;
+	pak->cleanup = datapack_proc_cleanup;
+	memcpy(pak->filetable, filetable, tablesize);
+	/** @todo fill handle */
+
+	if ( index_build(pak) != 0 ){
+		mem_free(&allocator, pak);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return pak;
+}
+
+static void datapack_file_cleanup(datapack_t handle){
+	/* entries, names and index all live in the same allocation as the handle */
+	for ( size_t i = 0; handle->compact && i < handle->compact->num_groups; i++ ){
+		struct compact_entry** slots = handle->compact->slots[i];
+		if ( !slots ) continue;
+		for ( unsigned int j = 0; j < COMPACT_GROUP; j++ ){
+			mem_free(&handle->owner, slots[j]);
+		}
+		mem_free(&handle->owner, slots);
+	}
+	if ( handle->map ){
+		munmap(handle->map, handle->map_size);
+	}
+	for ( size_t i = 1; i < handle->num_volumes; i++ ){
+		close(handle->volumes[i]);
+	}
+	mem_free(&handle->owner, handle->volumes);
+	fclose(handle->fp);
+}
+
+/**
+ * Descriptor of a volume file (the pack file itself for volume 0).
+ */
+static int volume_fd(datapack_t handle, unsigned int volume){
+	return volume < handle->num_volumes ? handle->volumes[volume] : fileno(handle->fp);
+}
+
+/**
+ * Read exactly size bytes at offset from the pack file or one of its volumes.
+ */
+static int read_at(datapack_t handle, unsigned int volume, void* dst, size_t size, long offset){
+	const int fd = volume_fd(handle, volume);
+	char* ptr = (char*)dst;
+	while ( size > 0 ){
+		const ssize_t bytes = pread(fd, ptr, size, (off_t)offset);
+		if ( bytes < 0 && errno == EINTR ) continue;
+		if ( bytes <= 0 ){
+			return EBADF;
+		}
+		ptr += bytes;
+		offset += bytes;
+		size -= (size_t)bytes;
+	}
+	return 0;
+}
+
+/**
+ * Get the verified flag of an entry, or of its block for solid entries.
+ * @return Flag or NULL if the data needs no verification.
+ */
+static unsigned char* verify_flag(const struct datapack_entry* src){
+	const datapack_t handle = src->handle;
+	if ( !handle || !handle->verified || !(src->flags & DATAPACK_CHECKSUM) ){
+		return NULL;
+	}
+
+	unsigned char* flag = src->block
+		? &handle->verified[handle->num_entries + (size_t)(src->block - handle->blocks)]
+		: &handle->verified[entry_index(src)];
+	return __atomic_load_n(flag, __ATOMIC_ACQUIRE) ? NULL : flag;
+}
+
+/**
+ * Check data against its checksum and mark it as verified.
+ * @return 0 if data matches, EBADMSG otherwise.
+ */
+static int verify_data(unsigned char* flag, const unsigned char* data, size_t size, uint32_t crc){
+	if ( datapack_crc32c(0, data, size) != crc ){
+		return EBADMSG;
+	}
+	__atomic_store_n(flag, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+ * Verify the checksum of every entry and block by reading all data.
+ */
+static int verify_all(datapack_t handle){
+	const struct datapack_allocator* a = &handle->allocator;
+	unsigned char* buf = (unsigned char*)mem_alloc(a, VERIFY_CHUNK);
+	if ( !buf ){
+		return ENOMEM;
+	}
+
+	for ( size_t i = 0; i < handle->num_entries; i++ ){
+		const struct datapack_entry* entry = handle->filetable[i];
+		unsigned char* flag = verify_flag(entry);
+		if ( !flag ) continue;
+
+		const unsigned int volume = entry->block ? entry->block->volume : entry->volume;
+		long offset = entry->block ? entry->block->offset : entry->offset;
+		size_t left = entry->block ? entry->block->csize : entry->csize;
+		const uint32_t expected = entry->block ? entry->block->crc : entry->crc;
+		uint32_t crc = 0;
+		while ( left > 0 ){
+			const size_t bytes = left < VERIFY_CHUNK ? left : VERIFY_CHUNK;
+			if ( read_at(handle, volume, buf, bytes, offset) != 0 ){
+				mem_free(a, buf);
+				return EBADF;
+			}
+			crc = datapack_crc32c(crc, buf, bytes);
+			offset += (long)bytes;
+			left -= bytes;
+		}
+		if ( crc != expected ){
+			mem_free(a, buf);
+			return EBADMSG;
+		}
+		*flag = 1;
+	}
+
+	mem_free(a, buf);
+	return 0;
+}
+
+/**
+ * Sizes needed to hold the index of a pack.
+ */
+struct datapack_layout {
+	size_t num_entries;
+	size_t num_blocks;
+	size_t num_segments;            /* total number of segment sizes */
+	size_t name_bytes;              /* total length of filenames including null-terminators */
+	size_t records;                 /* bytes of block and file entry records in the directory */
+};
+
+/**
+ * Cursors into the arena used while filling it.
+ */
+struct datapack_arena {
+	struct datapack_entry* entry;
+	uint32_t* segments;
+	char* names;
+};
+
+/**
+ * Allocate a handle with the whole index in a single allocation: the handle
+ * itself, the filetable, entries, blocks, sorted index, segment tables, all
+ * filenames packed back to back and finally the checksum state. A single free
+ * releases it all.
+ */
+static datapack_t datapack_alloc(FILE* fp, const struct datapack_layout* layout, struct datapack_arena* arena){
+	const size_t n = layout->num_entries;
+	const size_t tablesize = sizeof(struct datapack_entry*) * (n + 1); /* +1 for sentinel */
+	const size_t size =
+		sizeof(struct datapack) + tablesize +
+		sizeof(struct datapack_entry) * n +
+		sizeof(struct datapack_block) * layout->num_blocks +
+		sizeof(struct datapack_entry*) * (n + 1) +
+		sizeof(uint32_t) * layout->num_segments +
+		layout->name_bytes +
+		n + layout->num_blocks;
+
+	char* ptr = (char*)mem_alloc(&allocator, size);
+	if ( !ptr ){
+		return NULL;
+	}
+
+	datapack_t pak = (datapack_t)ptr;
+	ptr += sizeof(struct datapack) + tablesize;
+	arena->entry = (struct datapack_entry*)ptr;
+	ptr += sizeof(struct datapack_entry) * n;
+	pak->blocks = (struct datapack_block*)ptr;
+	ptr += sizeof(struct datapack_block) * layout->num_blocks;
+	pak->index = (struct datapack_entry**)ptr;
+	ptr += sizeof(struct datapack_entry*) * (n + 1);
+	arena->segments = (uint32_t*)ptr;
+	ptr += sizeof(uint32_t) * layout->num_segments;
+	arena->names = ptr;
+	ptr += layout->name_bytes;
+	pak->entries = arena->entry;
+	pak->verified = NULL;
+	if ( verify_mode != DATAPACK_VERIFY_NONE ){
+		pak->verified = (unsigned char*)ptr;
+		memset(pak->verified, 0, n + layout->num_blocks);
+	}
+
+	pak->size = size;
+	pak->locked = 0;
+	pak->start = 0;
+	pak->map = NULL;
+	pak->map_size = 0;
+	pak->base = NULL;
+	pak->patch = NULL;
+	pak->volumes = NULL;
+	pak->num_volumes = 0;
+	pak->refs = 1;
+	pak->watch = NULL;
+	pak->pinned = 0;
+	pak->pinned_next = NULL;
+	pak->compact = NULL;
+	pak->owner = allocator;
+	pak->allocator = allocator;
+	pak->fp = fp;
+	pak->serial = __atomic_add_fetch(&serial_counter, 1, __ATOMIC_RELAXED);
+	pak->num_entries = n;
+	pak->num_blocks = layout->num_blocks;
+	pak->cleanup = datapack_file_cleanup;
+	for ( size_t i = 0; i < n; i++ ){
+		pak->filetable[i] = &arena->entry[i];
+	}
+	pak->filetable[n] = NULL;
+
+	return pak;
+}
+
+/**
+ * Copy a filename into the arena.
+ */
+static const char* arena_name(struct datapack_arena* arena, const char* src, size_t len){
+	char* dst = arena->names;
+	memcpy(dst, src, len);
+	dst[len] = 0;
+	arena->names += len + 1;
+	return dst;
+}
+
+static datapack_t datapack_open_v1(FILE* fp){
+	/* read and validate header */
+	struct datapack_pak_header header;
+	if ( fread(&header, sizeof(struct datapack_pak_header), 1, fp) != 1 ){
+		return NULL;
+	}
+
+	/* parse header */
+	const long offset = be16toh(header.dp_offset);
+	struct datapack_layout layout = {0, 0, 0, 0, 0};
+	layout.num_entries = (size_t)be16toh(header.dp_num_entries);
+
+	/* first pass: size filenames (entries are interleaved with data) */
+	fseek(fp, offset, SEEK_SET);
+	for ( size_t i = 0; i < layout.num_entries; i++ ){
+		struct datapack_pakfile_entry packed;
+		if ( fread(&packed, sizeof(struct datapack_pakfile_entry), 1, fp) != 1 ){
+			errno = EBADF;
+			return NULL;
+		}
+		const size_t fsize = be32toh(packed.fsize);
+		layout.name_bytes += fsize + 1; /* +1 for null-terminator */
+		fseek(fp, (long)(fsize + be32toh(packed.csize)), SEEK_CUR);
+	}
+
+	struct datapack_arena arena;
+	datapack_t pak = datapack_alloc(fp, &layout, &arena);
+	if ( !pak ){
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	fseek(fp, offset, SEEK_SET);
+	for ( unsigned int i = 0; i < layout.num_entries; i++ ){
+		/* read entry and filename */
+		struct datapack_pakfile_entry packed;
+		const char* filename = arena.names;
+		if ( fread(&packed, sizeof(struct datapack_pakfile_entry), 1, fp) != 1 ){
+			handle_free(pak);
+			errno = EBADF;
+			return NULL;
+		}
+		const size_t fsize = be32toh(packed.fsize);
+		if ( fread(arena.names, fsize, 1, fp) != 1 ){
+			handle_free(pak);
+			errno = EBADF;
+			return NULL;
+		}
+		arena.names[fsize] = 0;
+		arena.names += fsize + 1;
+		const size_t csize = be32toh(packed.csize);
+
+		/* store entry */
+		struct datapack_entry* entry = pak->filetable[i];
+		entry->handle = pak;
+		entry->filename = filename;
+		entry->data = NULL;
+		entry->offset = ftell(fp);
+		entry->csize = csize;
+		entry->usize = be32toh(packed.usize);
+		entry->block = NULL;
+		entry->boffset = 0;
+		entry->flags = 0;
+		entry->ssize = 0;
+		entry->segments = NULL;
+		entry->crc = 0;
+		entry->volume = 0;
+
+		/* skip data */
+		fseek(fp, (long)csize, SEEK_CUR);
+	}
+
+	return pak;
+}
+
+/**
+ * Walk the raw version 2 directory, validating record bounds. When arena is
+ * NULL only the layout is computed, otherwise entries are filled in.
+ * @return Non-zero if the directory is truncated or malformed.
+ */
+static int directory_parse_v2(const char* dir, size_t size, datapack_t pak, struct datapack_arena* arena, struct datapack_layout* layout){
+	const char* ptr = dir + sizeof(struct datapack_pakfile_block) * layout->num_blocks;
+	const char* end = dir + size;
+	if ( sizeof(struct datapack_pakfile_block) * layout->num_blocks > size ){
+		return EBADF;
+	}
+
+	for ( size_t i = 0; i < layout->num_entries; i++ ){
+		struct datapack_pakfile_entry_v2 packed;
+		if ( (size_t)(end - ptr) < sizeof(packed) ){
+			return EBADF;
+		}
+		memcpy(&packed, ptr, sizeof(packed));
+		ptr += sizeof(packed);
+
+		const size_t fsize = be32toh(packed.fsize);
+		const size_t usize = be32toh(packed.usize);
+		const size_t ssize = be32toh(packed.ssize);
+		const size_t block = be32toh(packed.block);
+		const size_t num_segments = ssize > 0 ? (usize + ssize - 1) / ssize : 0;
+		if ( (size_t)(end - ptr) < fsize || (size_t)(end - ptr - (long)fsize) / sizeof(uint32_t) < num_segments ||
+		     (block != DATAPACK_NO_BLOCK && block >= layout->num_blocks) ){
+			return EBADF;
+		}
+		const char* filename = ptr;
+		ptr += fsize;
+		const char* segments = ptr;
+		ptr += sizeof(uint32_t) * num_segments;
+
+		if ( !arena ){
+			layout->name_bytes += fsize + 1; /* +1 for null-terminator */
+			layout->num_segments += num_segments;
+			continue;
+		}
+
+		struct datapack_entry* entry = pak->filetable[i];
+		entry->handle = pak;
+		entry->filename = arena_name(arena, filename, fsize);
+		entry->data = NULL;
+		entry->csize = be32toh(packed.csize);
+		entry->usize = usize;
+		entry->flags = be32toh(packed.flags);
+		entry->ssize = ssize;
+		entry->segments = NULL;
+		entry->crc = be32toh(packed.crc);
+		if ( ssize > 0 ){
+			memcpy(arena->segments, segments, sizeof(uint32_t) * num_segments);
+			for ( size_t j = 0; j < num_segments; j++ ){
+				arena->segments[j] = be32toh(arena->segments[j]);
+			}
+			entry->segments = arena->segments;
+			arena->segments += num_segments;
+		}
+		if ( block == DATAPACK_NO_BLOCK ){
+			entry->offset = (long)be64toh(packed.offset);
+			entry->block = NULL;
+			entry->boffset = 0;
+		} else {
+			entry->offset = 0;
+			entry->block = &pak->blocks[block];
+			entry->boffset = be64toh(packed.offset);
+		}
+		entry->volume = 0;
+	}
+
+	layout->records = (size_t)(ptr - dir);
+	return 0;
+}
+
+/**
+ * Read the volume table following the records of a version 2 directory and
+ * open each volume file.
+ * @param filename Filename of the pack, volume filenames are relative to it.
+ */
+static int directory_volumes(datapack_t pak, const char* ptr, size_t size, const char* filename){
+	const size_t records = pak->num_blocks + pak->num_entries;
+	uint32_t num_volumes;
+	if ( size / sizeof(uint32_t) < records + 1 ){
+		return EBADF;
+	}
+	memcpy(&num_volumes, ptr + sizeof(uint32_t) * records, sizeof(uint32_t));
+	num_volumes = be32toh(num_volumes);
+
+	/* volume of each record */
+	for ( size_t i = 0; i < records; i++ ){
+		uint32_t volume;
+		memcpy(&volume, ptr + sizeof(uint32_t) * i, sizeof(uint32_t));
+		volume = be32toh(volume);
+		if ( volume > num_volumes ){
+			return EBADF;
+		}
+		if ( i < pak->num_blocks ){
+			pak->blocks[i].volume = volume;
+		} else {
+			pak->filetable[i - pak->num_blocks]->volume = volume;
+		}
+	}
+
+	pak->volumes = (int*)mem_alloc(&pak->owner, sizeof(int) * (num_volumes + 1));
+	if ( !pak->volumes ){
+		return ENOMEM;
+	}
+	pak->volumes[0] = fileno(pak->fp);
+	pak->num_volumes = 1;
+
+	const char* slash = strrchr(filename, '/');
+	const int dirlen = slash ? (int)(slash - filename) + 1 : 0;
+	const char* end = ptr + size;
+	ptr += sizeof(uint32_t) * (records + 1);
+	for ( uint32_t i = 0; i < num_volumes; i++ ){
+		uint32_t len;
+		if ( (size_t)(end - ptr) < sizeof(uint32_t) ){
+			return EBADF;
+		}
+		memcpy(&len, ptr, sizeof(uint32_t));
+		len = be32toh(len);
+		ptr += sizeof(uint32_t);
+		if ( (size_t)(end - ptr) < len || len == 0 ){
+			return EBADF;
+		}
+
+		/* the packer writes bare basenames, anything else could point
+		 * outside the directory of the index */
+		if ( memchr(ptr, '/', len) || memchr(ptr, 0, len) ||
+		     (len == 1 && ptr[0] == '.') || (len == 2 && ptr[0] == '.' && ptr[1] == '.') ){
+			return EBADF;
+		}
+
+		char* path = mem_printf(&allocator, "%.*s%.*s", dirlen, filename, (int)len, ptr);
+		if ( !path ){
+			return ENOMEM;
+		}
+		const int fd = open(path, O_RDONLY | O_CLOEXEC);
+		const int err = errno;
+		mem_free(&allocator, path);
+		if ( fd == -1 ){
+			return err;
+		}
+		pak->volumes[pak->num_volumes++] = fd;
+		ptr += len;
+	}
+
+	return 0;
+}
+
+static datapack_t datapack_open_v2(FILE* fp, const char* filename){
+	static unsigned char expected[] = DATAPACK_MAGIC;
+
+	/* read footer */
+	struct datapack_pak_footer footer;
+	if ( fseek(fp, -(long)sizeof(struct datapack_pak_footer), SEEK_END) != 0 ||
+	     fread(&footer, sizeof(struct datapack_pak_footer), 1, fp) != 1 ){
+		return NULL;
+	}
+	if ( footer.dp_version != 2 || memcmp(footer.dp_magic, expected, sizeof(expected)) != 0 ){
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* directory spans from its offset up to the footer */
+	const long footer_offset = ftell(fp) - (long)sizeof(struct datapack_pak_footer);
+	const long start = (long)be64toh(footer.dp_start);
+	const long dir_offset = (long)be64toh(footer.dp_offset);
+	if ( start < 0 || dir_offset < start || dir_offset > footer_offset ){
+		errno = EBADF;
+		return NULL;
+	}
+
+	/* the header tells if data is split into volumes (appended packs have none) */
+	struct datapack_pak_header_v2 header;
+	if ( fseek(fp, start + (long)sizeof(expected), SEEK_SET) != 0 || fread(&header, sizeof(header), 1, fp) != 1 ){
+		errno = EBADF;
+		return NULL;
+	}
+
+	/* read the whole directory at once */
+	const size_t dir_size = (size_t)(footer_offset - dir_offset);
+	char* dir = (char*)mem_alloc(&allocator, dir_size + 1);
+	if ( !dir ){
+		errno = ENOMEM;
+		return NULL;
+	}
+	if ( fseek(fp, dir_offset, SEEK_SET) != 0 || (dir_size > 0 && fread(dir, dir_size, 1, fp) != 1) ){
+		mem_free(&allocator, dir);
+		errno = EBADF;
+		return NULL;
+	}
+
+	/* first pass sizes the index, second pass fills it */
+	struct datapack_layout layout = {0, 0, 0, 0, 0};
+	layout.num_blocks = be32toh(footer.dp_num_blocks);
+	layout.num_entries = be32toh(footer.dp_num_entries);
+	if ( directory_parse_v2(dir, dir_size, NULL, NULL, &layout) != 0 ){
+		mem_free(&allocator, dir);
+		errno = EBADF;
+		return NULL;
+	}
+
+	struct datapack_arena arena;
+	datapack_t pak = datapack_alloc(fp, &layout, &arena);
+	if ( !pak ){
+		mem_free(&allocator, dir);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	for ( size_t i = 0; i < layout.num_blocks; i++ ){
+		struct datapack_pakfile_block packed;
+		memcpy(&packed, dir + sizeof(struct datapack_pakfile_block) * i, sizeof(packed));
+
+		struct datapack_block* block = &pak->blocks[i];
+		block->data = NULL;
+		block->offset = (long)be64toh(packed.offset);
+		block->csize = be32toh(packed.csize);
+		block->usize = be32toh(packed.usize);
+		block->crc = be32toh(packed.crc);
+		block->volume = 0;
+	}
+
+	directory_parse_v2(dir, dir_size, pak, &arena, &layout);
+	pak->start = start;
+
+	if ( header.dp_flags & DATAPACK_PAK_VOLUMES ){
+		const int ret = directory_volumes(pak, dir + layout.records, dir_size - layout.records, filename);
+		if ( ret != 0 ){
+			mem_free(&allocator, dir);
+			for ( size_t i = 1; i < pak->num_volumes; i++ ){
+				close(pak->volumes[i]);
+			}
+			mem_free(&pak->owner, pak->volumes);
+			handle_free(pak);
+			errno = ret;
+			return NULL;
+		}
+	}
+	mem_free(&allocator, dir);
+
+	return pak;
+}
+
+/**
+ * Map a pack appended to another file into memory and point entries and blocks
+ * at the mapping so no reads are needed. Data outside the file is left to
+ * fail when read.
+ */
+static void datapack_map(datapack_t pak){
+	struct stat st;
+	if ( fstat(fileno(pak->fp), &st) != 0 || st.st_size == 0 ){
+		return;
+	}
+
+	const size_t size = (size_t)st.st_size;
+	char* ptr = (char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(pak->fp), 0);
+	if ( ptr == MAP_FAILED ){
+		return;
+	}
+	pak->map = ptr;
+	pak->map_size = size;
+
+	for ( size_t i = 0; i < pak->num_blocks; i++ ){
+		struct datapack_block* block = &pak->blocks[i];
+		if ( (size_t)block->offset <= size && block->csize <= size - (size_t)block->offset ){
+			block->data = ptr + block->offset;
+		}
+	}
+	for ( size_t i = 0; i < pak->num_entries; i++ ){
+		struct datapack_entry* entry = &pak->entries[i];
+		if ( !entry->block && (size_t)entry->offset <= size && entry->csize <= size - (size_t)entry->offset ){
+			entry->data = ptr + entry->offset;
+		}
+	}
+}
+
+/**
+ * Front-code name following prev (NULL for the first name of a group) into
+ * dst, which may be NULL to only size it.
+ * @return Encoded size in bytes.
+ */
+static size_t compact_encode(char* dst, const char* prev, const char* name){
+	unsigned char varint[10];
+	size_t bytes = 0;
+	size_t shared = 0;
+	if ( prev ){
+		while ( prev[shared] && prev[shared] == name[shared] ){
+			shared++;
+		}
+		size_t value = shared;
+		do {
+			varint[bytes] = (unsigned char)(value & 0x7f);
+			value >>= 7;
+			varint[bytes++] |= value ? 0x80 : 0;
+		} while ( value );
+	}
+
+	const size_t len = strlen(name + shared) + 1;
+	if ( dst ){
+		memcpy(dst, varint, bytes);
+		memcpy(dst + bytes, name + shared, len);
+	}
+	return bytes + len;
+}
+
+/**
+ * Replace the index of an opened pack by a compact index, in a single
+ * allocation holding the handle, the compact index, blocks, records, segment
+ * tables, group offsets, names and checksum state.
+ * @return New handle or pak itself if the index is kept.
+ */
+static datapack_t datapack_compact(datapack_t pak){
+	const size_t n = pak->num_entries;
+	const size_t num_groups = (n + COMPACT_GROUP - 1) / COMPACT_GROUP;
+
+	size_t name_bytes = 0;
+	size_t num_segments = 0;
+	for ( size_t i = 0; i < n; i++ ){
+		const struct datapack_entry* entry = pak->index[i];
+		if ( strlen(entry->filename) >= PATH_MAX ){
+			return pak;
+		}
+		name_bytes += compact_encode(NULL, i % COMPACT_GROUP ? pak->index[i-1]->filename : NULL, entry->filename);
+		num_segments += entry->segments ? (entry->usize + entry->ssize - 1) / entry->ssize : 0;
+	}
+	if ( name_bytes > UINT32_MAX || num_segments > UINT32_MAX ){
+		return pak;
+	}
+
+	const size_t states = pak->verified ? n + pak->num_blocks : 0;
+	const size_t size =
+		sizeof(struct datapack) + sizeof(struct datapack_entry*) +
+		sizeof(struct datapack_compact) + sizeof(struct compact_entry**) * num_groups +
+		sizeof(struct datapack_block) * pak->num_blocks +
+		sizeof(struct compact_record) * n +
+		sizeof(uint32_t) * num_segments +
+		sizeof(uint32_t) * num_groups +
+		name_bytes + states;
+	char* ptr = (char*)mem_calloc(&pak->owner, 1, size);
+	if ( !ptr ){
+		return pak;
+	}
+
+	/* the handle keeps its file, mapping and volumes */
+	datapack_t compact = (datapack_t)ptr;
+	memcpy(compact, pak, sizeof(struct datapack));
+	compact->filetable[0] = NULL;
+	ptr += sizeof(struct datapack) + sizeof(struct datapack_entry*);
+	struct datapack_compact* c = (struct datapack_compact*)ptr;
+	ptr += sizeof(struct datapack_compact) + sizeof(struct compact_entry**) * num_groups;
+	compact->blocks = (struct datapack_block*)ptr;
+	ptr += sizeof(struct datapack_block) * pak->num_blocks;
+	c->records = (struct compact_record*)ptr;
+	ptr += sizeof(struct compact_record) * n;
+	c->segments = (uint32_t*)ptr;
+	ptr += sizeof(uint32_t) * num_segments;
+	c->groups = (uint32_t*)ptr;
+	ptr += sizeof(uint32_t) * num_groups;
+	c->names = ptr;
+	c->num_groups = num_groups;
+	compact->index = NULL;
+	compact->entries = NULL;
+	compact->verified = pak->verified ? (unsigned char*)ptr + name_bytes : NULL;
+	compact->size = size;
+	compact->compact = c;
+
+	memcpy(compact->blocks, pak->blocks, sizeof(struct datapack_block) * pak->num_blocks);
+	if ( pak->verified ){
+		memcpy(compact->verified + n, pak->verified + n, pak->num_blocks);
+	}
+
+	size_t name_offset = 0;
+	size_t segment = 0;
+	for ( size_t i = 0; i < n; i++ ){
+		const struct datapack_entry* entry = pak->index[i];
+		struct compact_record* record = &c->records[i];
+		record->offset = entry->block ? (uint64_t)entry->boffset : (uint64_t)entry->offset;
+		record->csize = (uint32_t)entry->csize;
+		record->usize = (uint32_t)entry->usize;
+		record->block = entry->block ? (uint32_t)(entry->block - pak->blocks) : DATAPACK_NO_BLOCK;
+		record->flags = entry->flags;
+		record->ssize = (uint32_t)entry->ssize;
+		record->crc = entry->crc;
+		record->segments = (uint32_t)segment;
+		record->volume = entry->volume;
+		if ( entry->segments ){
+			const size_t num = (entry->usize + entry->ssize - 1) / entry->ssize;
+			memcpy(&c->segments[segment], entry->segments, sizeof(uint32_t) * num);
+			segment += num;
+		}
+		if ( pak->verified ){
+			compact->verified[i] = pak->verified[entry - pak->entries];
+		}
+
+		if ( i % COMPACT_GROUP == 0 ){
+			c->groups[i / COMPACT_GROUP] = (uint32_t)name_offset;
+		}
+		name_offset += compact_encode((char*)c->names + name_offset, i % COMPACT_GROUP ? pak->index[i-1]->filename : NULL, entry->filename);
+	}
+
+	/* everything else moved to the new handle */
+	handle_free(pak);
+	return compact;
+}
+
+datapack_t datapack_open(const char* filename){
+	if ( !filename ){
+		datapack_t pak = datapack_open_proc();
+		if ( pak || errno != ENOENT ){
+			return pak;
+		}
+
+		/* no data linked into the executable, look for a pack appended to it */
+		pak = datapack_open("/proc/self/exe");
+		if ( !pak ){
+			errno = ENOENT;
+		}
+		return pak;
+	}
+
+	FILE* fp = fopen(filename, "r");
+	if ( !fp ) return NULL;
+
+	static unsigned char expected[] = DATAPACK_MAGIC;
+	static unsigned char actual[sizeof(expected)];
+	if ( fread(actual, sizeof(expected), 1, fp) != 1 ){
+		fclose(fp);
+		return NULL;
+	}
+
+	/* packs appended to another file are located by the version 2 footer,
+	 * otherwise peek version and let each version read its own header */
+	const int appended = memcmp(expected, actual, sizeof(expected)) != 0;
+	const int version = appended ? 2 : fgetc(fp);
+	fseek(fp, sizeof(expected), SEEK_SET);
+
+	datapack_t pak = NULL;
+	switch ( version ){
+	case 1:
+		pak = datapack_open_v1(fp);
+		break;
+	case 2:
+		pak = datapack_open_v2(fp, filename);
+		break;
+	default:
+		errno = EINVAL;
+		break;
+	}
+
+	if ( !pak ){
+		const int saved = errno;
+		fclose(fp);
+		errno = saved;
+		return NULL;
+	}
+
+	index_build(pak);
+	if ( appended ){
+		datapack_map(pak);
+	}
+
+	/* device, inode, size and modification time identify this version of the pack */
+	struct stat st;
+	pak->identity[0] = 0;
+	if ( fstat(fileno(fp), &st) == 0 ){
+		snprintf(pak->identity, sizeof(pak->identity), "%lx-%lx-%lx-%lx.%lx",
+		         (unsigned long)st.st_dev, (unsigned long)st.st_ino, (unsigned long)st.st_size,
+		         (unsigned long)st.st_mtim.tv_sec, (unsigned long)st.st_mtim.tv_nsec);
+	}
+
+	if ( verify_mode == DATAPACK_VERIFY_OPEN ){
+		const int ret = verify_all(pak);
+		if ( ret != 0 ){
+			datapack_close(pak);
+			errno = ret;
+			return NULL;
+		}
+	}
+
+	if ( index_mode == DATAPACK_INDEX_COMPACT ){
+		pak = datapack_compact(pak);
+	}
+
+	return pak;
+}
+
+/**
+ * CRC32C of the directory and footer of a version 2 pack. A patch records it
+ * to identify the exact pack it was created from.
+ */
+static int directory_checksum(datapack_t handle, uint32_t* crc){
+	struct stat st;
+	struct datapack_pak_footer footer;
+	if ( !handle->fp || fstat(fileno(handle->fp), &st) != 0 || (size_t)st.st_size < sizeof(footer) ||
+	     read_at(handle, 0, &footer, sizeof(footer), (long)st.st_size - (long)sizeof(footer)) != 0 ||
+	     footer.dp_version != 2 ){
+		return EINVAL;
+	}
+
+	long offset = (long)be64toh(footer.dp_offset);
+	if ( offset < 0 || offset > (long)st.st_size ){
+		return EINVAL;
+	}
+
+	unsigned char buf[CHUNK];
+	*crc = 0;
+	while ( offset < (long)st.st_size ){
+		const size_t bytes = (size_t)(st.st_size - offset) < CHUNK ? (size_t)(st.st_size - offset) : CHUNK;
+		if ( read_at(handle, 0, buf, bytes, offset) != 0 ){
+			return EBADF;
+		}
+		*crc = datapack_crc32c(*crc, buf, bytes);
+		offset += (long)bytes;
+	}
+	return 0;
+}
+
+static void datapack_patch_cleanup(datapack_t handle){
+	/* entries belong to the base and patch packs, only the patch is owned */
+	datapack_close(handle->patch);
+}
+
+datapack_t datapack_open_patch(const char* filename, datapack_t base){
+	static unsigned char magic[] = DATAPACK_MAGIC;
+	if ( !filename || !base || base->patch || base->watch ){
+		errno = EINVAL;
+		return NULL;
+	}
+
+	datapack_t patch = datapack_open(filename);
+	if ( !patch ){
+		return NULL;
+	}
+
+	/* the header tells which pack the patch was created from */
+	struct datapack_pak_header_v2 header;
+	uint32_t crc;
+	if ( read_at(patch, 0, &header, sizeof(header), patch->start + (long)sizeof(magic)) != 0 ||
+	     header.dp_version != 2 || !(header.dp_flags & DATAPACK_PAK_PATCH) ||
+	     directory_checksum(base, &crc) != 0 || crc != be32toh(header.dp_base_crc) ){
+		datapack_close(patch);
+		errno = EINVAL;
+		return NULL;
+	}
+	patch->base = base;
+
+	/* the merged index refers to every entry so compact indexes create them all */
+	if ( index_materialize(base) != 0 || index_materialize(patch) != 0 ){
+		datapack_close(patch);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	/* entries of the base pack not present in the patch are unchanged */
+	size_t n = 0;
+	for ( size_t i = 0; i < patch->num_entries; i++ ){
+		n += !(index_entry(patch, i)->flags & DATAPACK_DELETED);
+	}
+	for ( size_t i = 0; i < base->num_entries; i++ ){
+		n += !unpack_find(patch, index_entry(base, i)->filename);
+	}
+
+	/* handle, filetable and index in a single allocation */
+	const size_t tablesize = sizeof(struct datapack_entry*) * (n + 1); /* +1 for sentinel */
+	const size_t size = sizeof(struct datapack) + tablesize * 2;
+	datapack_t pak = (datapack_t)mem_alloc(&allocator, size);
+	if ( !pak ){
+		datapack_close(patch);
+		errno = ENOMEM;
+		return NULL;
+	}
+	pak->fp = NULL;
+	pak->serial = __atomic_add_fetch(&serial_counter, 1, __ATOMIC_RELAXED);
+	pak->num_entries = n;
+	pak->num_blocks = 0;
+	pak->blocks = NULL;
+	pak->index = (struct datapack_entry**)((char*)pak + sizeof(struct datapack) + tablesize);
+	pak->entries = NULL;
+	pak->verified = NULL;
+	pak->size = size;
+	pak->locked = 0;
+	pak->identity[0] = 0;
+	pak->start = 0;
+	pak->map = NULL;
+	pak->map_size = 0;
+	pak->base = base;
+	pak->patch = patch;
+	pak->volumes = NULL;
+	pak->num_volumes = 0;
+	pak->refs = 1;
+	pak->watch = NULL;
+	pak->pinned = 0;
+	pak->pinned_next = NULL;
+	pak->compact = NULL;
+	pak->owner = allocator;
+	pak->allocator = allocator;
+	pak->cleanup = datapack_patch_cleanup;
+
+	n = 0;
+	for ( size_t i = 0; i < base->num_entries; i++ ){
+		struct datapack_entry* entry = index_entry(base, i);
+		if ( !unpack_find(patch, entry->filename) ){
+			pak->filetable[n++] = entry;
+		}
+	}
+	for ( size_t i = 0; i < patch->num_entries; i++ ){
+		struct datapack_entry* entry = index_entry(patch, i);
+		if ( !(entry->flags & DATAPACK_DELETED) ){
+			pak->filetable[n++] = entry;
+		}
+	}
+	pak->filetable[n] = NULL;
+	index_build(pak);
+
+	return pak;
+}
+
+/**
+ * State of a handle from datapack_open_watch. Readers take a reference to the
+ * current version without locking: they announce themselves in one of two
+ * counters before loading the pointer and a reload only drops its reference
+ * to the replaced version once no reader can be about to take another one.
+ */
+struct datapack_watch {
+	datapack_t current;             /* current version of the pack */
+	datapack_t pinned;              /* versions entries were handed out from, kept until closed */
+	unsigned long readers[2];       /* readers between loading current and taking a reference */
+	unsigned int phase;             /* counter used by new readers */
+	int lock;                       /* set if indexes are locked in memory */
+	pthread_mutex_t reload;         /* serializes reloads */
+	char* filename;
+	const char* name;               /* filename without directory */
+	int inotify;                    /* -1 if the file is not watched */
+	int wakeup[2];                  /* pipe stopping the watcher (closed on cleanup) */
+	pthread_t thread;
+};
+
+datapack_t datapack_snapshot(datapack_t handle){
+	if ( !handle ){
+		errno = EINVAL;
+		return NULL;
+	}
+	if ( !handle->watch ){
+		__atomic_add_fetch(&handle->refs, 1, __ATOMIC_RELAXED);
+		return handle;
+	}
+
+	struct datapack_watch* w = handle->watch;
+	const unsigned int phase = __atomic_load_n(&w->phase, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&w->readers[phase], 1, __ATOMIC_SEQ_CST);
+	datapack_t pak = __atomic_load_n(&w->current, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&pak->refs, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&w->readers[phase], 1, __ATOMIC_SEQ_CST);
+	return pak;
+}
+
+/**
+ * Replace the current version. Readers announced in the old phase may still
+ * hold the old pointer without a reference, once both counters have drained
+ * after the exchange every reader has either taken its reference or sees the
+ * new version.
+ */
+static void watch_swap(struct datapack_watch* w, datapack_t pak){
+	datapack_t old = __atomic_exchange_n(&w->current, pak, __ATOMIC_SEQ_CST);
+	for ( int i = 0; i < 2; i++ ){
+		const unsigned int phase = __atomic_fetch_xor(&w->phase, 1, __ATOMIC_SEQ_CST);
+		while ( __atomic_load_n(&w->readers[phase], __ATOMIC_SEQ_CST) > 0 ){
+			sched_yield();
+		}
+	}
+	datapack_close(old);
+}
+
+/**
+ * Keep a version until the watch handle is closed, as entries looked up
+ * through the handle carry no reference of their own.
+ */
+static void watch_pin(struct datapack_watch* w, datapack_t pak){
+	if ( __atomic_exchange_n(&pak->pinned, 1, __ATOMIC_RELAXED) ){
+		return;
+	}
+	__atomic_add_fetch(&pak->refs, 1, __ATOMIC_RELAXED);
+	pak->pinned_next = __atomic_load_n(&w->pinned, __ATOMIC_RELAXED);
+	while ( !__atomic_compare_exchange_n(&w->pinned, &pak->pinned_next, pak, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED) ){}
+}
+
+int datapack_reload(datapack_t handle){
+	if ( !handle || !handle->watch ){
+		return EINVAL;
+	}
+
+	struct datapack_watch* w = handle->watch;
+	pthread_mutex_lock(&w->reload);
+	int ret = 0;
+	datapack_t pak = datapack_open(w->filename);
+	if ( !pak ){
+		ret = errno;
+	} else if ( pak->identity[0] && strcmp(pak->identity, w->current->identity) == 0 ){
+		/* same version of the file */
+		datapack_close(pak);
+	} else {
+		if ( w->lock ){
+			datapack_lock_index(pak, 1);
+		}
+		pak->allocator = handle->allocator;
+		watch_swap(w, pak);
+	}
+	pthread_mutex_unlock(&w->reload);
+
+	return ret;
+}
+
+static void* watch_worker(void* ptr){
+	datapack_t handle = (datapack_t)ptr;
+	struct datapack_watch* w = handle->watch;
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd fds[2] = {
+		{ .fd = w->inotify, .events = POLLIN },
+		{ .fd = w->wakeup[0], .events = POLLIN },
+	};
+
+	for (;;){
+		if ( poll(fds, 2, -1) == -1 ){
+			if ( errno == EINTR ) continue;
+			break;
+		}
+		if ( fds[1].revents ){
+			break;
+		}
+
+		const ssize_t len = read(w->inotify, buf, sizeof(buf));
+		int changed = 0;
+		for ( ssize_t i = 0; i < len; ){
+			const struct inotify_event* event = (const struct inotify_event*)&buf[i];
+			changed |= event->len > 0 && strcmp(event->name, w->name) == 0;
+			i += (ssize_t)(sizeof(struct inotify_event) + event->len);
+		}
+
+		/* the index of the new version is built here, a file which cannot be
+		 * opened (yet) is retried on the next event */
+		if ( changed ){
+			datapack_reload(handle);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Start watching the directory of the pack, replacing the file by rename
+ * creates a new inode so the file itself cannot be watched.
+ */
+static int watch_start(datapack_t handle){
+	struct datapack_watch* w = handle->watch;
+	const char* slash = strrchr(w->filename, '/');
+	char* dir = slash ? mem_strndup(&handle->owner, w->filename, slash > w->filename ? (size_t)(slash - w->filename) : 1) : mem_strdup(&handle->owner, ".");
+	w->name = slash ? slash + 1 : w->filename;
+	if ( !dir ){
+		return ENOMEM;
+	}
+
+	w->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	int ret = 0;
+	if ( w->inotify == -1 || inotify_add_watch(w->inotify, dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1 ){
+		ret = errno;
+	} else if ( pipe2(w->wakeup, O_CLOEXEC) == -1 ){
+		ret = errno;
+	} else if ( (ret=pthread_create(&w->thread, NULL, watch_worker, handle)) != 0 ){
+		close(w->wakeup[0]);
+		close(w->wakeup[1]);
+	}
+	if ( ret != 0 && w->inotify != -1 ){
+		close(w->inotify);
+		w->inotify = -1;
+	}
+
+	mem_free(&handle->owner, dir);
+	return ret;
+}
+
+static void datapack_watch_cleanup(datapack_t handle){
+	struct datapack_watch* w = handle->watch;
+	if ( w->inotify != -1 ){
+		close(w->wakeup[1]);
+		pthread_join(w->thread, NULL);
+		close(w->wakeup[0]);
+		close(w->inotify);
+	}
+	datapack_close(w->current);
+	while ( w->pinned ){
+		datapack_t next = w->pinned->pinned_next;
+		datapack_close(w->pinned);
+		w->pinned = next;
+	}
+	pthread_mutex_destroy(&w->reload);
+	mem_free(&handle->owner, w->filename);
+	mem_free(&handle->owner, w);
+}
+
+datapack_t datapack_open_watch(const char* filename){
+	if ( !filename ){
+		errno = EINVAL;
+		return NULL;
+	}
+
+	datapack_t pak = datapack_open(filename);
+	if ( !pak ){
+		return NULL;
+	}
+
+	/* the handle holds no entries itself, only the sentinel */
+	datapack_t handle = (datapack_t)mem_calloc(&allocator, 1, sizeof(struct datapack) + sizeof(struct datapack_entry*));
+	struct datapack_watch* w = (struct datapack_watch*)mem_calloc(&allocator, 1, sizeof(struct datapack_watch));
+	char* copy = mem_strdup(&allocator, filename);
+	if ( !handle || !w || !copy ){
+		mem_free(&allocator, handle);
+		mem_free(&allocator, w);
+		mem_free(&allocator, copy);
+		datapack_close(pak);
+		errno = ENOMEM;
+		return NULL;
+	}
+	handle->serial = __atomic_add_fetch(&serial_counter, 1, __ATOMIC_RELAXED);
+	handle->refs = 1;
+	handle->watch = w;
+	handle->cleanup = datapack_watch_cleanup;
+	handle->owner = allocator;
+	handle->allocator = allocator;
+	w->current = pak;
+	w->filename = copy;
+	pthread_mutex_init(&w->reload, NULL);
+
+	/* without inotify the handle can still be reloaded using datapack_reload */
+	watch_start(handle);
+
+	return handle;
+}
+
+void datapack_close(datapack_t handle){
+	/* freed once snapshots, streams and mappings using it are closed too */
+	if ( __atomic_sub_fetch(&handle->refs, 1, __ATOMIC_ACQ_REL) > 0 ){
+		return;
+	}
+
+	if ( handle->locked ){
+		munlock(handle, handle->size);
+	}
+	block_cache_purge(handle->serial);
+	handle->cleanup(handle);
+	handle_free(handle);
+}
+
+void datapack_set_allocator(datapack_t handle, const struct datapack_allocator* a){
+	static const struct datapack_allocator fallback = {default_alloc, default_realloc, default_free, NULL};
+	if ( !a ){
+		a = &fallback;
+	}
+	if ( !handle ){
+		allocator = *a;
+		return;
+	}
+
+	/* owned packs unpack entries of the handle too (entries of the base of a
+	 * patch belong to the base) */
+	handle->allocator = *a;
+	if ( handle->patch ){
+		handle->patch->allocator = *a;
+	}
+	if ( handle->watch ){
+		pthread_mutex_lock(&handle->watch->reload);
+		handle->watch->current->allocator = *a;
+		pthread_mutex_unlock(&handle->watch->reload);
+	}
+}
+
+void datapack_set_threads(unsigned int threads){
+	max_threads = threads;
+}
+
+void datapack_set_verify(datapack_verify_t mode){
+	verify_mode = mode;
+}
+
+void datapack_set_index(datapack_index_t mode){
+	index_mode = mode;
+}
+
+static void trace_init(void){
+	const char* filename = getenv("DATAPACK_TRACE");
+	if ( filename && filename[0] ){
+		clock_gettime(CLOCK_MONOTONIC, &trace_begin);
+		trace_fp = fopen(filename, "w");
+	}
+}
+
+int datapack_trace(const char* filename){
+	pthread_once(&trace_once, trace_init);
+
+	FILE* fp = NULL;
+	if ( filename && !(fp=fopen(filename, "w")) ){
+		return errno;
+	}
+
+	pthread_mutex_lock(&trace_lock);
+	if ( trace_fp ){
+		fclose(trace_fp);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &trace_begin);
+	__atomic_store_n(&trace_fp, fp, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&trace_lock);
+
+	return 0;
+}
+
+/**
+ * Append entry to the access trace (if tracing is enabled).
+ */
+static void trace_access(const struct datapack_entry* entry){
+	pthread_once(&trace_once, trace_init);
+	if ( !__atomic_load_n(&trace_fp, __ATOMIC_ACQUIRE) ){
+		return;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&trace_lock);
+	if ( trace_fp ){
+		const long ms = (now.tv_sec - trace_begin.tv_sec) * 1000 + (now.tv_nsec - trace_begin.tv_nsec) / 1000000;
+		fprintf(trace_fp, "%ld\t%s\n", ms, entry->filename);
+		fflush(trace_fp);
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+int unpack_override(const char* dir){
+	mem_free(&local_owner, local);
+
+	size_t len = strlen(dir);
+	if ( dir[len-1] == '/' ) len--;
+	local_owner = allocator;
+	local = mem_strndup(&local_owner, dir, len);
+
+	return 0;
+}
+
+/**
+ * Get compressed data, either directly from memory or by reading from file. If
+ * data is read from file *tmp is set to a buffer the caller must free using
+ * the allocator of the handle.
+ */
+static int read_compressed(datapack_t handle, unsigned int volume, const char* data, long offset, size_t csize, const unsigned char** src, unsigned char** tmp){
+	*tmp = NULL;
+	if ( data ){
+		*src = (const unsigned char*)data;
+		return 0;
+	}
+
+	unsigned char* buf = (unsigned char*)mem_alloc(&handle->allocator, csize);
+	if ( !buf ){
+		return ENOMEM;
+	}
+	if ( read_at(handle, volume, buf, csize, offset) != 0 ){
+		mem_free(&handle->allocator, buf);
+		return EBADF;
+	}
+
+	*src = *tmp = buf;
+	return 0;
+}
+
+/**
+ * Inflate a complete zlib stream into dst.
+ * @param written Set to number of bytes written to dst.
+ */
+static int inflate_buffer(const unsigned char* src, size_t csize, char* dst, size_t usize, size_t* written){
+#ifdef HAVE_LIBDEFLATE
+	/* the whole stream and output size is known so use the single-shot decoder */
+	struct thread_context* ctx = context_get();
+	if ( ctx && !ctx->decompressor ){
+		ctx->decompressor = libdeflate_alloc_decompressor();
+	}
+	if ( ctx && ctx->decompressor ){
+		switch ( libdeflate_zlib_decompress(ctx->decompressor, src, csize, dst, usize, written) ){
+		case LIBDEFLATE_SUCCESS:
+			return Z_OK;
+		default:
+			*written = 0;
+			return Z_DATA_ERROR;
+		}
+	}
+#endif
+
+	z_stream* strm = inflate_acquire();
+	if ( !strm ){
+		return Z_MEM_ERROR;
+	}
+
+	strm->avail_in = (unsigned int) csize;
+	strm->next_in = (Bytef*)src;
+	strm->avail_out = (unsigned int) usize;
+	strm->next_out = (unsigned char*)dst;
+	int ret = inflate(strm, Z_FINISH);
+	*written = usize - strm->avail_out;
+	inflate_release(strm);
+
+	switch (ret) {
+	case Z_STREAM_END:
+		return Z_OK;
+	case Z_MEM_ERROR:
+		return ret;
+	default:
+		return Z_DATA_ERROR;
+	}
+}
+
+struct segment_job {
+	const struct datapack_entry* src;
+	const unsigned char* data;     /* compressed data of all segments */
+	const size_t* offset;          /* offset to each segment in data */
+	char* dst;
+	size_t num_segments;
+	size_t next;                   /* next segment to decode (atomic) */
+	int ret;                       /* first error (atomic) */
+	unsigned int helpers;          /* pool workers that may still join */
+	unsigned int active;           /* pool workers decoding segments */
+	struct segment_job* next_job;  /* next job waiting for workers */
+};
+
+/**
+ * Workers decoding segments, started on first use and kept until unloaded so
+ * each keeps its thread context (inflate streams and caches) between calls.
+ */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work;           /* signalled when jobs are queued or on stop */
+	pthread_cond_t done;           /* signalled when a worker leaves a job */
+	struct segment_job* jobs;      /* jobs with segments left */
+	pthread_t* thread;
+	unsigned int num_threads;
+	struct datapack_allocator owner; /* allocator of thread */
+	int stop;
+} segment_pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+static void* segment_worker(void* ptr){
+	struct segment_job* job = (struct segment_job*)ptr;
+	const struct datapack_entry* src = job->src;
+
+	size_t i;
+	while ( (i=__atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->num_segments ){
+		const size_t begin = i * src->ssize;
+		const size_t usize = src->usize - begin < src->ssize ? src->usize - begin : src->ssize;
+
+		size_t bytes;
+		int ret = inflate_buffer(job->data + job->offset[i], src->segments[i], job->dst + begin, usize, &bytes);
+		if ( ret == Z_OK && bytes != usize ){
+			ret = Z_DATA_ERROR;
+		}
+		if ( ret != Z_OK ){
+			int expected = Z_OK;
+			__atomic_compare_exchange_n(&job->ret, &expected, ret, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		}
+	}
+
+	return NULL;
+}
+
+static void* segment_pool_worker(void* ptr){
+	(void)ptr;
+	pthread_mutex_lock(&segment_pool.lock);
+	while ( !segment_pool.stop ){
+		struct segment_job* job = segment_pool.jobs;
+		while ( job && (job->helpers == 0 || __atomic_load_n(&job->next, __ATOMIC_RELAXED) >= job->num_segments) ){
+			job = job->next_job;
+		}
+		if ( !job ){
+			pthread_cond_wait(&segment_pool.work, &segment_pool.lock);
+			continue;
+		}
+
+		job->helpers--;
+		job->active++;
+		pthread_mutex_unlock(&segment_pool.lock);
+		segment_worker(job);
+		pthread_mutex_lock(&segment_pool.lock);
+		if ( --job->active == 0 ){
+			pthread_cond_broadcast(&segment_pool.done);
+		}
+	}
+	pthread_mutex_unlock(&segment_pool.lock);
+	return NULL;
+}
+
+/**
+ * The workers do not exist in a forked child, which starts a pool of its own.
+ */
+static void segment_pool_child(void){
+	pthread_mutex_init(&segment_pool.lock, NULL);
+	pthread_cond_init(&segment_pool.work, NULL);
+	pthread_cond_init(&segment_pool.done, NULL);
+	segment_pool.jobs = NULL;
+	segment_pool.num_threads = 0;
+}
+
+/**
+ * Grow the pool to at least num workers (must hold the pool lock).
+ * @return number of workers, fewer if threads cannot be created.
+ */
+static unsigned int segment_pool_grow(unsigned int num){
+	if ( num <= segment_pool.num_threads || segment_pool.stop ){
+		return segment_pool.num_threads;
+	}
+	if ( !segment_pool.thread ){
+		segment_pool.owner = allocator;
+		pthread_atfork(NULL, NULL, segment_pool_child);
+	}
+
+	pthread_t* thread = (pthread_t*)mem_realloc(&segment_pool.owner, segment_pool.thread, sizeof(pthread_t) * num);
+	if ( !thread ){
+		return segment_pool.num_threads;
+	}
+	segment_pool.thread = thread;
+	while ( segment_pool.num_threads < num ){
+		if ( pthread_create(&thread[segment_pool.num_threads], NULL, segment_pool_worker, NULL) != 0 ) break;
+		segment_pool.num_threads++;
+	}
+	return segment_pool.num_threads;
+}
+
+/**
+ * Stop and join the workers when the library is unloaded.
+ */
+__attribute__((destructor)) static void segment_pool_stop(void){
+	pthread_mutex_lock(&segment_pool.lock);
+	segment_pool.stop = 1;
+	pthread_cond_broadcast(&segment_pool.work);
+	pthread_mutex_unlock(&segment_pool.lock);
+
+	for ( unsigned int i = 0; i < segment_pool.num_threads; i++ ){
+		pthread_join(segment_pool.thread[i], NULL);
+	}
+	mem_free(&segment_pool.owner, segment_pool.thread);
+	segment_pool.thread = NULL;
+	segment_pool.num_threads = 0;
+}
+
+static unsigned int thread_count(size_t jobs){
+	unsigned int n = max_threads;
+	if ( n == 0 ){
+		const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		n = cpus > 0 ? (unsigned int)cpus : 1;
+	}
+	return jobs < n ? (unsigned int)jobs : n;
+}
+
+/**
+ * Inflate all segments of a segmented entry into dst, spreading segments
+ * over the worker pool. The calling thread decodes segments as well.
+ */
+static int inflate_segments(const struct datapack_entry* src, const unsigned char* data, char* dst){
+	if ( src->ssize == 0 || !src->segments ){
+		return Z_DATA_ERROR;
+	}
+
+	const struct datapack_allocator* a = entry_allocator(src);
+	const size_t n = (src->usize + src->ssize - 1) / src->ssize;
+	size_t* offset = (size_t*)mem_alloc(a, sizeof(size_t) * (n + 1));
+	if ( !offset ){
+		return ENOMEM;
+	}
+
+	/* locate segments */
+	size_t pos = 0;
+	for ( size_t i = 0; i < n; i++ ){
+		offset[i] = pos;
+		pos += src->segments[i];
+	}
+	if ( pos != src->csize ){
+		mem_free(a, offset);
+		return Z_DATA_ERROR;
+	}
+
+	struct segment_job job = {
+		.src = src,
+		.data = data,
+		.offset = offset,
+		.dst = dst,
+		.num_segments = n,
+		.next = 0,
+		.ret = Z_OK,
+		.helpers = 0,
+		.active = 0,
+		.next_job = NULL,
+	};
+
+	/* queue the job for up to threads-1 workers */
+	const unsigned int threads = thread_count(n);
+	int queued = 0;
+	if ( threads > 1 ){
+		pthread_mutex_lock(&segment_pool.lock);
+		if ( (queued=segment_pool_grow(threads - 1) > 0) ){
+			job.helpers = threads - 1;
+			job.next_job = segment_pool.jobs;
+			segment_pool.jobs = &job;
+			pthread_cond_broadcast(&segment_pool.work);
+		}
+		pthread_mutex_unlock(&segment_pool.lock);
+	}
+
+	segment_worker(&job);
+
+	/* all segments are taken, dequeue and wait for workers still decoding */
+	if ( queued ){
+		pthread_mutex_lock(&segment_pool.lock);
+		struct segment_job** cur = &segment_pool.jobs;
+		while ( *cur != &job ){
+			cur = &(*cur)->next_job;
+		}
+		*cur = job.next_job;
+		while ( job.active > 0 ){
+			pthread_cond_wait(&segment_pool.done, &segment_pool.lock);
+		}
+		pthread_mutex_unlock(&segment_pool.lock);
+	}
+
+	mem_free(a, offset);
+	return job.ret;
+}
+
+/**
+ * Get the decompressed solid block holding src. The returned data is owned by
+ * the block cache of the calling thread and is valid until the next call.
+ */
+static int block_fetch(const struct datapack_entry* src, const char** dstptr){
+	const struct datapack_block* block = src->block;
+	const unsigned long serial = src->handle ? src->handle->serial : 0;
+	if ( src->boffset + src->usize > block->usize ){
+		return Z_DATA_ERROR;
+	}
+
+	struct block_cache* cache = block_cache_get();
+	if ( !cache ){
+		return ENOMEM;
+	}
+
+	/* lookup cached block */
+	pthread_mutex_lock(&cache->lock);
+	for ( unsigned int i = 0; i < BLOCK_CACHE_SLOTS; i++ ){
+		struct block_cache_slot* slot = &cache->slot[i];
+		if ( slot->data && slot->block == block && slot->serial == serial ){
+			slot->used = ++cache->clock;
+			*dstptr = slot->data;
+			pthread_mutex_unlock(&cache->lock);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	/* decompress block */
+	const struct datapack_allocator* a = entry_allocator(src);
+	char* dst = (char*)mem_alloc(a, block->usize + 1);
+	if ( !dst ){
+		return ENOMEM;
+	}
+
+	const unsigned char* srcbuf;
+	unsigned char* tmp;
+	int ret = read_compressed(src->handle, block->volume, block->data, block->offset, block->csize, &srcbuf, &tmp);
+	if ( ret != 0 ){
+		mem_free(a, dst);
+		return ret;
+	}
+
+	unsigned char* flag = verify_flag(src);
+	if ( flag && (ret=verify_data(flag, srcbuf, block->csize, block->crc)) != 0 ){
+		mem_free(a, tmp);
+		mem_free(a, dst);
+		return ret;
+	}
+
+	size_t bytes;
+	ret = inflate_buffer(srcbuf, block->csize, dst, block->usize, &bytes);
+	mem_free(a, tmp);
+	if ( ret != Z_OK || bytes != block->usize ){
+		mem_free(a, dst);
+		return ret != Z_OK ? ret : Z_DATA_ERROR;
+	}
+
+	/* replace least recently used slot (slots may have been purged meanwhile) */
+	pthread_mutex_lock(&cache->lock);
+	struct block_cache_slot* victim = &cache->slot[0];
+	for ( unsigned int i = 1; i < BLOCK_CACHE_SLOTS; i++ ){
+		if ( cache->slot[i].used < victim->used ){
+			victim = &cache->slot[i];
+		}
+	}
+	mem_free(&victim->allocator, victim->data);
+	victim->allocator = *a;
+	victim->serial = serial;
+	victim->block = block;
+	victim->data = dst;
+	victim->used = ++cache->clock;
+	pthread_mutex_unlock(&cache->lock);
+
+	*dstptr = dst;
+	return 0;
+}
+
+/**
+ * Apply delta instructions to the data of the base entry, writing exactly
+ * usize bytes to dst.
+ */
+static int delta_apply(const unsigned char* delta, size_t dsize, const char* old, size_t osize, char* dst, size_t usize){
+	const unsigned char* end = delta + dsize;
+	size_t pos = 0;
+	while ( delta < end ){
+		const int op = *delta++;
+		const size_t nargs = op == DATAPACK_DELTA_COPY ? 2 : 1;
+		uint32_t args[2];
+		if ( (size_t)(end - delta) < sizeof(uint32_t) * nargs ){
+			return Z_DATA_ERROR;
+		}
+		memcpy(args, delta, sizeof(uint32_t) * nargs);
+		delta += sizeof(uint32_t) * nargs;
+
+		const size_t len = be32toh(args[nargs - 1]);
+		if ( len > usize - pos ){
+			return Z_DATA_ERROR;
+		}
+
+		switch ( op ){
+		case DATAPACK_DELTA_COPY:
+		{
+			const size_t offset = be32toh(args[0]);
+			if ( offset > osize || len > osize - offset ){
+				return Z_DATA_ERROR;
+			}
+			memcpy(dst + pos, old + offset, len);
+		}
+		break;
+
+		case DATAPACK_DELTA_ADD:
+			if ( (size_t)(end - delta) < len ){
+				return Z_DATA_ERROR;
+			}
+			memcpy(dst + pos, delta, len);
+			delta += len;
+			break;
+
+		default:
+			return Z_DATA_ERROR;
+		}
+		pos += len;
+	}
+
+	return pos == usize ? Z_OK : Z_DATA_ERROR;
+}
+
+static int unpack_into(const struct datapack_entry* src, char* dst);
+
+/**
+ * Rebuild a delta entry from the entry with the same name in the base pack.
+ */
+static int unpack_delta(const struct datapack_entry* src, char* dst){
+	const datapack_t base = src->handle ? src->handle->base : NULL;
+	const struct datapack_entry* old = base ? unpack_find(base, src->filename) : NULL;
+	if ( !old ){
+		return EINVAL;
+	}
+	if ( src->csize < sizeof(uint32_t) ){
+		return Z_DATA_ERROR;
+	}
+
+	const struct datapack_allocator* a = entry_allocator(src);
+	const unsigned char* srcbuf;
+	unsigned char* tmp;
+	int ret = read_compressed(src->handle, src->volume, src->data, src->offset, src->csize, &srcbuf, &tmp);
+	if ( ret != 0 ){
+		return ret;
+	}
+
+	unsigned char* flag = verify_flag(src);
+	if ( flag && (ret=verify_data(flag, srcbuf, src->csize, src->crc)) != 0 ){
+		mem_free(a, tmp);
+		return ret;
+	}
+
+	uint32_t dsize;
+	memcpy(&dsize, srcbuf, sizeof(uint32_t));
+	dsize = be32toh(dsize);
+
+	unsigned char* delta = (unsigned char*)mem_alloc(a, dsize + 1);
+	char* olddata = (char*)mem_alloc(a, old->usize + 1);
+	if ( !delta || !olddata ){
+		ret = ENOMEM;
+	} else {
+		size_t bytes;
+		ret = inflate_buffer(srcbuf + sizeof(uint32_t), src->csize - sizeof(uint32_t), (char*)delta, dsize, &bytes);
+		if ( ret == Z_OK && bytes != dsize ){
+			ret = Z_DATA_ERROR;
+		}
+		if ( ret == Z_OK ){
+			ret = unpack_into(old, olddata);
+		}
+		if ( ret == Z_OK ){
+			ret = delta_apply(delta, dsize, olddata, old->usize, dst, src->usize);
+		}
+	}
+
+	mem_free(a, olddata);
+	mem_free(a, delta);
+	mem_free(a, tmp);
+	return ret;
+}
+
+/**
+ * Verify and decompress the compressed data of an entry which is not in a
+ * solid block into dst. Stored entries must already be copied into dst.
+ */
+static int unpack_decode(const struct datapack_entry* src, const unsigned char* data, char* dst){
+	unsigned char* flag = verify_flag(src);
+	if ( src->flags & DATAPACK_STORED ){
+		return flag ? verify_data(flag, (const unsigned char*)dst, src->usize, src->crc) : 0;
+	}
+
+	int ret;
+	if ( flag && (ret=verify_data(flag, data, src->csize, src->crc)) != 0 ){
+		return ret;
+	}
+
+	size_t bytes = src->usize;
+	if ( src->flags & DATAPACK_SEGMENTED ){
+		ret = inflate_segments(src, data, dst);
+	} else {
+		ret = inflate_buffer(data, src->csize, dst, src->usize, &bytes);
+	}
+	if ( ret == Z_OK && bytes != src->usize ){
+		ret = Z_DATA_ERROR;
+	}
+
+	return ret;
+}
+
+/**
+ * Decompress entry into dst which must hold at least usize bytes.
+ */
+static int unpack_into(const struct datapack_entry* src, char* dst){
+	const size_t bufsize = src->usize;
+
+	if ( src->flags & DATAPACK_DELTA ){
+		return unpack_delta(src, dst);
+	}
+
+	/* entries in solid blocks are copied from the decompressed block */
+	if ( src->block ){
+		const char* block;
+		int ret = block_fetch(src, &block);
+		if ( ret != 0 ){
+			return ret;
+		}
+
+		memcpy(dst, block + src->boffset, bufsize);
+		return 0;
+	}
+
+	/* stored entries are copied as-is */
+	if ( src->flags & DATAPACK_STORED ){
+		if ( src->data ){
+			memcpy(dst, src->data, bufsize);
+		} else if ( read_at(src->handle, src->volume, dst, bufsize, src->offset) != 0 ){
+			return EBADF;
+		}
+		return unpack_decode(src, NULL, dst);
+	}
+
+	/* prepare source buffer */
+	const unsigned char* srcbuf;
+	unsigned char* tmp;
+	int ret = read_compressed(src->handle, src->volume, src->data, src->offset, src->csize, &srcbuf, &tmp);
+	if ( ret != 0 ){
+		return ret;
+	}
+
+	ret = unpack_decode(src, srcbuf, dst);
+	mem_free(entry_allocator(src), tmp);
+	return ret;
+}
+
+int unpack(const struct datapack_entry* src, char** dstptr){
+	const struct datapack_allocator* a = entry_allocator(src);
+	if ( local ){
+		char* local_path = mem_printf(&allocator, "%s/%s", local, src->filename);
+		if ( !local_path ){
+			return ENOMEM;
+		}
+
+		FILE* fp = fopen(local_path, "r");
+		mem_free(&allocator, local_path);
+
+		if ( fp ){
+			fseek(fp, 0, SEEK_END);
+			const long size = ftell(fp);
+			fseek(fp, 0, SEEK_SET);
+
+			char* dst = (char*)mem_alloc(a, (size_t)(size+1)); /* must fit null-terminator */
+			if ( !dst ){
+				fclose(fp);
+				return ENOMEM;
+			}
+			if ( fread(dst, (size_t)size, 1, fp) == 0 ){
+				const int err = errno;
+				mem_free(a, dst);
+				fclose(fp);
+				return err;
+			}
+
+			dst[size] = 0; /* force null-terminator */
+			*dstptr = dst; /* return pointer to caller */
+			fclose(fp);
+
+			return 0;
+		}
+	}
+
+	trace_access(src);
+
+	/* prepare destination buffer */
+	*dstptr = NULL;
+	char* dst = (char*)mem_alloc(a, src->usize+1); /* must fit null-terminator */
+	if ( !dst ){
+		return ENOMEM;
+	}
+
+	const int ret = unpack_into(src, dst);
+	if ( ret != 0 ){
+		mem_free(a, dst);
+		return ret;
+	}
+
+	dst[src->usize] = 0; /* force null-terminator */
+	*dstptr = dst;       /* return pointer to caller */
+	return 0;
+}
+
+/**
+ * Read of the compressed data of an entry unpacked by unpack_many.
+ */
+struct batch_read {
+	const struct datapack_entry* src;
+	char* dst;                  /* decompressed data */
+	unsigned char* buf;         /* data read from file (dst for stored entries) */
+	size_t size;                /* bytes to read */
+	size_t done;                /* bytes read so far */
+	int status;                 /* result of unpacking (EBADF until finished) */
+#ifdef HAVE_IO_URING
+	struct iovec iov;
+	int fallback;               /* remaining data is read using pread */
+#endif
+};
+
+static void batch_finish(struct batch_read* r){
+	r->status = unpack_decode(r->src, r->buf, r->dst);
+	if ( r->buf != (unsigned char*)r->dst ){
+		mem_free(entry_allocator(r->src), r->buf);
+	}
+	r->buf = NULL;
+}
+
+/**
+ * Read the remaining data of r using pread and finish it.
+ */
+static void batch_pread(struct batch_read* r){
+	if ( read_at(r->src->handle, r->src->volume, r->buf + r->done, r->size - r->done, r->src->offset + (long)r->done) != 0 ){
+		r->status = EIO;
+		return;
+	}
+	r->done = r->size;
+	batch_finish(r);
+}
+
+#ifdef HAVE_IO_URING
+/**
+ * Minimal io_uring using the raw system calls.
+ */
+struct uring {
+	int fd;
+	unsigned int* sq_tail;
+	unsigned int* sq_mask;
+	unsigned int* sq_array;
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	unsigned int* cq_mask;
+	struct io_uring_sqe* sqes;
+	struct io_uring_cqe* cqes;
+	void* sq_ring;
+	void* cq_ring;
+	size_t sq_size;
+	size_t cq_size;
+	size_t sqes_size;
+	unsigned int pending;       /* queued but not yet submitted */
+};
+
+static void uring_close(struct uring* ring){
+	munmap(ring->sqes, ring->sqes_size);
+	if ( ring->cq_ring != ring->sq_ring ){
+		munmap(ring->cq_ring, ring->cq_size);
+	}
+	munmap(ring->sq_ring, ring->sq_size);
+	close(ring->fd);
+}
+
+static int uring_open(struct uring* ring, unsigned int depth){
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	memset(ring, 0, sizeof(struct uring));
+	ring->fd = (int)syscall(__NR_io_uring_setup, depth, &p);
+	if ( ring->fd < 0 ){
+		return errno;
+	}
+
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ( p.features & IORING_FEAT_SINGLE_MMAP ){
+		ring->sq_size = ring->cq_size = ring->sq_size > ring->cq_size ? ring->sq_size : ring->cq_size;
+	}
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ring = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_ring = ring->sq_ring;
+	if ( ring->sq_ring != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP) ){
+		ring->cq_ring = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	}
+	ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if ( ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED ){
+		const int err = errno;
+		if ( ring->sqes != MAP_FAILED ) munmap(ring->sqes, ring->sqes_size);
+		if ( ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring ) munmap(ring->cq_ring, ring->cq_size);
+		if ( ring->sq_ring != MAP_FAILED ) munmap(ring->sq_ring, ring->sq_size);
+		close(ring->fd);
+		return err;
+	}
+
+	char* sq = (char*)ring->sq_ring;
+	char* cq = (char*)ring->cq_ring;
+	ring->sq_tail = (unsigned int*)(sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned int*)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int*)(sq + p.sq_off.array);
+	ring->cq_head = (unsigned int*)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned int*)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned int*)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+	return 0;
+}
+
+/**
+ * Queue read of the remaining data of r.
+ */
+static void uring_push(struct uring* ring, struct batch_read* r){
+	const unsigned int tail = *ring->sq_tail;
+	const unsigned int index = tail & *ring->sq_mask;
+	struct io_uring_sqe* sqe = &ring->sqes[index];
+
+	r->iov.iov_base = r->buf + r->done;
+	r->iov.iov_len = r->size - r->done;
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = volume_fd(r->src->handle, r->src->volume);
+	sqe->addr = (uintptr_t)&r->iov;
+	sqe->len = 1;
+	sqe->off = (uint64_t)r->src->offset + r->done;
+	sqe->user_data = (uintptr_t)r;
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->pending++;
+}
+
+/**
+ * Account a completed read of r, finishing r once all data is read.
+ * @return non-zero if more data must be read.
+ */
+static int batch_complete(struct batch_read* r, int res){
+	if ( res == -EINTR || res == -EAGAIN ){
+		return 1;
+	}
+	if ( res <= 0 ){
+		r->status = res < 0 ? -res : EIO; /* nothing read means the pack is truncated */
+		return 0;
+	}
+	r->done += (size_t)res;
+	if ( r->done < r->size ){
+		return 1; /* short read */
+	}
+	batch_finish(r);
+	return 0;
+}
+
+/**
+ * Wait for all submitted reads after io_uring_enter failed, as the kernel
+ * may still write to their buffers. Reads which were not submitted are taken
+ * back and, like reads left incomplete, marked for reading using pread.
+ */
+static void uring_drain(struct uring* ring, size_t inflight){
+	const unsigned int tail = *ring->sq_tail;
+	for ( unsigned int i = tail - ring->pending; i != tail; i++ ){
+		const struct io_uring_sqe* sqe = &ring->sqes[ring->sq_array[i & *ring->sq_mask]];
+		((struct batch_read*)(uintptr_t)sqe->user_data)->fallback = 1;
+	}
+	__atomic_store_n(ring->sq_tail, tail - ring->pending, __ATOMIC_RELEASE);
+	inflight -= ring->pending;
+	ring->pending = 0;
+
+	while ( inflight > 0 ){
+		/* completions are posted even if waiting for them fails */
+		if ( syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR ){
+			sched_yield();
+		}
+
+		unsigned int head = *ring->cq_head;
+		const unsigned int cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		for ( ; head != cq_tail; head++ ){
+			const struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+			struct batch_read* r = (struct batch_read*)(uintptr_t)cqe->user_data;
+			if ( batch_complete(r, cqe->res) ){
+				r->fallback = 1;
+			}
+			inflight--;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+}
+
+/**
+ * Read all data using io_uring with up to BATCH_DEPTH reads in flight,
+ * decompressing each entry as soon as its read completes.
+ * @return 0 if reads were made, otherwise io_uring is unavailable.
+ */
+static int batch_uring(struct batch_read* reads, size_t num){
+	struct uring ring;
+	if ( uring_open(&ring, BATCH_DEPTH) != 0 ){
+		return -1;
+	}
+
+	size_t next = 0;
+	size_t inflight = 0;
+	size_t completed = 0;
+	while ( completed < num ){
+		while ( next < num && inflight < BATCH_DEPTH ){
+			struct batch_read* r = &reads[next++];
+			if ( r->size == 0 ){
+				batch_finish(r);
+				completed++;
+				continue;
+			}
+			uring_push(&ring, r);
+			inflight++;
+		}
+		if ( inflight == 0 ){
+			continue;
+		}
+
+		const long submitted = syscall(__NR_io_uring_enter, ring.fd, ring.pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if ( submitted < 0 ){
+			if ( errno == EINTR || errno == EAGAIN || errno == EBUSY ) continue;
+
+			/* finish the remaining reads using pread */
+			uring_drain(&ring, inflight);
+			for ( size_t i = 0; i < num; i++ ){
+				if ( reads[i].fallback || i >= next ){
+					batch_pread(&reads[i]);
+				}
+			}
+			break;
+		}
+		ring.pending -= (unsigned int)submitted;
+
+		/* decompress completed reads while the remaining are in flight */
+		unsigned int head = *ring.cq_head;
+		const unsigned int tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		for ( ; head != tail; head++ ){
+			const struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+			struct batch_read* r = (struct batch_read*)(uintptr_t)cqe->user_data;
+			if ( batch_complete(r, cqe->res) ){
+				uring_push(&ring, r);
+			} else {
+				inflight--;
+				completed++;
+			}
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	uring_close(&ring);
+	return 0;
+}
+#endif
+
+static void batch_read_all(struct batch_read* reads, size_t num){
+#ifdef HAVE_IO_URING
+	if ( num > 1 && batch_uring(reads, num) == 0 ){
+		return;
+	}
+#endif
+
+	for ( size_t i = 0; i < num; i++ ){
+		batch_pread(&reads[i]);
+	}
+}
+
+int unpack_many(const struct datapack_entry* const* src, char** dst, size_t num){
+	for ( size_t i = 0; i < num; i++ ){
+		dst[i] = NULL;
+	}
+
+	struct batch_read* reads = (struct batch_read*)mem_calloc(&allocator, num + 1, sizeof(struct batch_read));
+	if ( !reads ){
+		return ENOMEM;
+	}
+
+	size_t num_reads = 0;
+	int ret = 0;
+	for ( size_t i = 0; i < num && ret == 0; i++ ){
+		const struct datapack_entry* e = src[i];
+
+		/* overrides, data in memory, solid blocks and deltas are unpacked directly */
+		if ( local || e->data || e->block || (e->flags & DATAPACK_DELTA) ){
+			ret = unpack(e, &dst[i]);
+			continue;
+		}
+
+		trace_access(e);
+		dst[i] = (char*)mem_alloc(entry_allocator(e), e->usize + 1); /* must fit null-terminator */
+		if ( !dst[i] ){
+			ret = ENOMEM;
+			break;
+		}
+		dst[i][e->usize] = 0; /* force null-terminator */
+
+		struct batch_read* r = &reads[num_reads++];
+		r->src = e;
+		r->dst = dst[i];
+		r->status = EBADF;
+		if ( e->flags & DATAPACK_STORED ){
+			r->size = e->usize;
+			r->buf = (unsigned char*)dst[i];
+		} else {
+			r->size = e->csize;
+			r->buf = (unsigned char*)mem_alloc(entry_allocator(e), e->csize + 1);
+			if ( !r->buf ){
+				ret = ENOMEM;
+			}
+		}
+	}
+
+	if ( ret == 0 ){
+		batch_read_all(reads, num_reads);
+	}
+	for ( size_t i = 0; i < num_reads; i++ ){
+		if ( reads[i].buf != (unsigned char*)reads[i].dst ){
+			mem_free(entry_allocator(reads[i].src), reads[i].buf);
+		}
+		if ( ret == 0 ){
+			ret = reads[i].status;
+		}
+	}
+	mem_free(&allocator, reads);
+
+	if ( ret != 0 ){
+		for ( size_t i = 0; i < num; i++ ){
+			if ( dst[i] ){
+				mem_free(entry_allocator(src[i]), dst[i]);
+			}
+			dst[i] = NULL;
+		}
+	}
+	return ret;
+}
+
+struct datapack_entry* unpack_find(datapack_t handle, const char* filename){
+	if ( !handle ) return NULL;
+	if ( handle->watch ){
+		datapack_t pak = datapack_snapshot(handle);
+		struct datapack_entry* entry = unpack_find(pak, filename);
+		if ( entry ){
+			watch_pin(handle->watch, pak);
+		}
+		datapack_close(pak);
+		return entry;
+	}
+
+	const size_t len = strlen(filename) + 1; /* include null-terminator for exact match */
+	if ( handle->compact ){
+		int match;
+		const size_t i = compact_bound(handle, filename, len, 0, &match);
+		return match ? compact_entry(handle, i) : NULL;
+	}
+
+	const size_t i = index_bound(handle, filename, len, 0);
+	if ( i < handle->num_entries && strcmp(handle->index[i]->filename, filename) == 0 ){
+		return handle->index[i];
+	}
+
+	return NULL;
+}
+
+size_t datapack_glob(datapack_t handle, const char* pattern, datapack_glob_callback callback, void* data){
+	if ( !handle ) return 0;
+	if ( handle->watch ){
+		datapack_t pak = datapack_snapshot(handle);
+		const size_t visited = datapack_glob(pak, pattern, callback, data);
+		if ( visited > 0 ){
+			watch_pin(handle->watch, pak);
+		}
+		datapack_close(pak);
+		return visited;
+	}
+
+	/* only the literal part before the first wildcard narrows the range, a
+	 * pattern without wildcards matches that one filename only */
+	const int all = pattern == NULL;
+	if ( all ) pattern = "";
+	const size_t plen = strcspn(pattern, "*?[\\");
+	const int literal = pattern[plen] == 0;
+	const size_t begin = index_bound(handle, pattern, plen, 0);
+	const size_t end = index_bound(handle, pattern, plen, 1);
+
+	size_t visited = 0;
+	for ( size_t i = begin; i < end; i++ ){
+		const struct datapack_entry* entry = index_entry(handle, i);
+		if ( !entry ){
+			break;
+		}
+		const int match = all || (literal ? entry->filename[plen] == 0 : fnmatch(pattern, entry->filename, 0) == 0);
+		if ( !match ){
+			continue;
+		}
+
+		visited++;
+		if ( callback && callback(entry, data) != 0 ){
+			break;
+		}
+	}
+
+	return visited;
+}
+
+/**
+ * Byte range of data, either in the pack file or in memory.
+ */
+struct advise_range {
+	const char* data;              /* NULL if range is in file */
+	int fd;                        /* pack file holding the range (patches span two files) */
+	long offset;
+	size_t size;
+};
+
+struct advise_ranges {
+	size_t num;
+	size_t max;
+	struct advise_range* range;
+};
+
+int datapack_entry_fd(const struct datapack_entry* src){
+	if ( !src || !src->handle || !src->handle->fp ){
+		return -1;
+	}
+	return volume_fd(src->handle, src->block ? src->block->volume : src->volume);
+}
+
+static int advise_collect(const struct datapack_entry* entry, void* data){
+	struct advise_ranges* ranges = (struct advise_ranges*)data;
+	if ( ranges->num == ranges->max ){
+		const size_t max = ranges->max > 0 ? ranges->max * 2 : 64;
+		struct advise_range* tmp = (struct advise_range*)mem_realloc(&allocator, ranges->range, sizeof(struct advise_range) * max);
+		if ( !tmp ){
+			return 1;
+		}
+		ranges->range = tmp;
+		ranges->max = max;
+	}
+
+	/* entries in solid blocks need the whole block */
+	struct advise_range* r = &ranges->range[ranges->num++];
+	r->fd = datapack_entry_fd(entry);
+	if ( entry->block ){
+		r->data = entry->block->data;
+		r->offset = entry->block->offset;
+		r->size = entry->block->csize;
+	} else {
+		r->data = entry->data;
+		r->offset = entry->offset;
+		r->size = entry->csize;
+	}
+	return 0;
+}
+
+static uintptr_t advise_begin(const struct advise_range* r){
+	return r->data ? (uintptr_t)r->data : (uintptr_t)r->offset;
+}
+
+/**
+ * Order file ranges by file and offset followed by memory ranges by address.
+ */
+static int advise_compare(const void* a, const void* b){
+	const struct advise_range* x = (const struct advise_range*)a;
+	const struct advise_range* y = (const struct advise_range*)b;
+	if ( (x->data == NULL) != (y->data == NULL) ){
+		return x->data ? 1 : -1;
+	}
+	if ( x->fd != y->fd ){
+		return x->fd < y->fd ? -1 : 1;
+	}
+	const uintptr_t xp = advise_begin(x);
+	const uintptr_t yp = advise_begin(y);
+	return xp < yp ? -1 : xp > yp;
+}
+
+/**
+ * Apply advice to a single merged range.
+ */
+static int advise_apply(const struct advise_range* r, datapack_advice_t advice){
+	if ( r->size == 0 ){
+		return 0;
+	}
+
+	if ( !r->data ){
+		static const int fadvice[] = {
+			[DATAPACK_ADVISE_NORMAL] = POSIX_FADV_NORMAL,
+			[DATAPACK_ADVISE_WILLNEED] = POSIX_FADV_WILLNEED,
+			[DATAPACK_ADVISE_DONTNEED] = POSIX_FADV_DONTNEED,
+			[DATAPACK_ADVISE_SEQUENTIAL] = POSIX_FADV_SEQUENTIAL,
+		};
+		return posix_fadvise(r->fd, (off_t)r->offset, (off_t)r->size, fadvice[advice]);
+	}
+
+	static const int madvice[] = {
+		[DATAPACK_ADVISE_NORMAL] = MADV_NORMAL,
+		[DATAPACK_ADVISE_WILLNEED] = MADV_WILLNEED,
+		[DATAPACK_ADVISE_DONTNEED] = MADV_DONTNEED,
+		[DATAPACK_ADVISE_SEQUENTIAL] = MADV_SEQUENTIAL,
+	};
+
+	/* madvise requires page alignment, only release pages fully covered */
+	const uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+	uintptr_t begin = (uintptr_t)r->data;
+	uintptr_t end = begin + r->size;
+	if ( advice == DATAPACK_ADVISE_DONTNEED ){
+		begin = (begin + page - 1) & ~(page - 1);
+		end &= ~(page - 1);
+	} else {
+		begin &= ~(page - 1);
+		end = (end + page - 1) & ~(page - 1);
+	}
+	if ( begin >= end ){
+		return 0;
+	}
+	return madvise((void*)begin, end - begin, madvice[advice]) == 0 ? 0 : errno;
+}
+
+int datapack_advise(datapack_t handle, const char* pattern, datapack_advice_t advice){
+	if ( !handle || advice < DATAPACK_ADVISE_NORMAL || advice > DATAPACK_ADVISE_SEQUENTIAL ){
+		return EINVAL;
+	}
+	if ( handle->watch ){
+		datapack_t pak = datapack_snapshot(handle);
+		const int ret = datapack_advise(pak, pattern, advice);
+		datapack_close(pak);
+		return ret;
+	}
+
+	struct advise_ranges ranges = {0, 0, NULL};
+	const size_t matches = datapack_glob(handle, pattern, advise_collect, &ranges);
+	if ( ranges.num < matches ){
+		mem_free(&allocator, ranges.range);
+		return ENOMEM;
+	}
+
+	/* merge overlapping and adjacent ranges (solid blocks are shared) */
+	qsort(ranges.range, ranges.num, sizeof(struct advise_range), advise_compare);
+	int ret = 0;
+	size_t cur = 0;
+	for ( size_t i = 1; i <= ranges.num && ranges.num > 0; i++ ){
+		struct advise_range* a = &ranges.range[cur];
+		if ( i < ranges.num ){
+			const struct advise_range* b = &ranges.range[i];
+			const uintptr_t begin = advise_begin(a);
+			if ( (a->data == NULL) == (b->data == NULL) && a->fd == b->fd && advise_begin(b) <= begin + a->size ){
+				const size_t size = advise_begin(b) + b->size - begin;
+				if ( size > a->size ) a->size = size;
+				continue;
+			}
+		}
+
+		const int err = advise_apply(a, advice);
+		if ( err != 0 && ret == 0 ){
+			ret = err;
+		}
+		cur = i;
+	}
+
+	mem_free(&allocator, ranges.range);
+	return ret;
+}
+
+int datapack_lock_index(datapack_t handle, int lock){
+	if ( handle && handle->watch ){
+		/* reloaded versions are locked as well */
+		struct datapack_watch* w = handle->watch;
+		pthread_mutex_lock(&w->reload);
+		w->lock = lock != 0;
+		const int ret = datapack_lock_index(w->current, lock);
+		pthread_mutex_unlock(&w->reload);
+		return ret;
+	}
+	if ( !handle || handle->size == 0 ){
+		return EINVAL;
+	}
+	if ( (lock != 0) == handle->locked ){
+		return 0;
+	}
+
+	if ( lock ? mlock(handle, handle->size) : munlock(handle, handle->size) ){
+		return errno;
+	}
+	handle->locked = lock != 0;
+	return 0;
+}
+
+datapack_dir_t datapack_opendir(datapack_t handle, const char* path){
+	if ( !handle ){
+		errno = EINVAL;
+		return NULL;
+	}
+	if ( !path ) path = "";
+
+	datapack_dir_t dir = (datapack_dir_t)mem_alloc(&allocator, sizeof(struct datapack_dir));
+	if ( !dir ){
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	/* normalize to prefix with trailing slash (root is the empty prefix) */
+	size_t len = strlen(path);
+	const size_t slash = len > 0 && path[len-1] != '/' ? 1 : 0;
+	dir->owner = allocator;
+	dir->prefix = (char*)mem_alloc(&dir->owner, len + slash + 1);
+	if ( !dir->prefix ){
+		mem_free(&allocator, dir);
+		errno = ENOMEM;
+		return NULL;
+	}
+	memcpy(dir->prefix, path, len);
+	if ( slash ) dir->prefix[len++] = '/';
+	dir->prefix[len] = 0;
+
+	dir->handle = datapack_snapshot(handle);
+	dir->plen = len;
+	dir->cur = index_bound(dir->handle, dir->prefix, len, 0);
+	dir->end = index_bound(dir->handle, dir->prefix, len, 1);
+	dir->dirent.name = NULL;
+	dir->dirent.is_dir = 0;
+	dir->dirent.entry = NULL;
+
+	if ( dir->cur == dir->end && len > 0 ){
+		datapack_close(dir->handle);
+		mem_free(&dir->owner, dir->prefix);
+		mem_free(&dir->owner, dir);
+		errno = ENOENT;
+		return NULL;
+	}
+
+	return dir;
+}
+
+const struct datapack_dirent* datapack_readdir(datapack_dir_t dir){
+	if ( dir->cur >= dir->end ){
+		return NULL;
+	}
+
+	const struct datapack_entry* entry = index_entry(dir->handle, dir->cur);
+	if ( !entry ){
+		return NULL;
+	}
+	const char* name = entry->filename + dir->plen;
+	const char* sep = strchr(name, '/');
+
+	/* plain file directly in this directory */
+	if ( !sep ){
+		dir->cur++;
+		dir->dirent.name = name;
+		dir->dirent.is_dir = 0;
+		dir->dirent.entry = entry;
+		return &dir->dirent;
+	}
+
+	/* subdirectory: report once and skip every entry below it */
+	const size_t sublen = (size_t)(sep - entry->filename) + 1; /* include slash */
+	dir->cur = index_bound(dir->handle, entry->filename, sublen, 1);
+
+	char* tmp = (char*)mem_realloc(&dir->owner, dir->prefix, sublen);
+	if ( !tmp ){
+		return NULL;
+	}
+	dir->prefix = tmp;
+	memcpy(dir->prefix, entry->filename, sublen - 1);
+	dir->prefix[sublen - 1] = 0;
+
+	dir->dirent.name = dir->prefix + dir->plen;
+	dir->dirent.is_dir = 1;
+	dir->dirent.entry = NULL;
+	return &dir->dirent;
+}
+
+void datapack_closedir(datapack_dir_t dir){
+	if ( !dir ) return;
+	datapack_close(dir->handle);
+	const struct datapack_allocator owner = dir->owner;
+	mem_free(&owner, dir->prefix);
+	mem_free(&owner, dir);
+}
+
+int datapack_set_shared_cache(const char* dir){
+	char* tmp = NULL;
+	if ( dir && !(tmp=mem_strdup(&allocator, dir)) ){
+		return ENOMEM;
+	}
+
+	mem_free(&shared_dir_owner, shared_dir);
+	shared_dir = tmp;
+	shared_dir_owner = allocator;
+	return 0;
+}
+
+/**
+ * Map size bytes of data privately and fill it by reading fd (if fd is not
+ * -1) or by decompressing src.
+ */
+static int shared_private(const struct datapack_entry* src, int fd, size_t size, const char** dst){
+	char* ptr = (char*)mmap(NULL, size + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if ( ptr == MAP_FAILED ){
+		return ENOMEM;
+	}
+
+	int ret = 0;
+	if ( fd != -1 ){
+		for ( size_t pos = 0; pos < size && ret == 0; ){
+			const ssize_t bytes = read(fd, ptr + pos, size - pos);
+			if ( bytes < 0 && errno == EINTR ) continue;
+			if ( bytes <= 0 ){
+				ret = EIO;
+				break;
+			}
+			pos += (size_t)bytes;
+		}
+	} else {
+		ret = unpack_into(src, ptr);
+	}
+	if ( ret != 0 ){
+		munmap(ptr, size + 1);
+		return ret;
+	}
+
+	mprotect(ptr, size + 1, PROT_READ);
+	*dst = ptr;
+	return 0;
+}
+
+/**
+ * Decompress entry into a new file in the shared cache, published by
+ * renaming it into place once complete so readers never see partial data.
+ */
+static int shared_publish(const struct datapack_entry* src, const char* name, const char** dst){
+	const size_t size = src->usize + 1; /* include null-terminator */
+
+	char* tmpname = mem_printf(&allocator, "%s.XXXXXX", name);
+	if ( !tmpname ){
+		return ENOMEM;
+	}
+	const int fd = mkstemp(tmpname);
+	if ( fd == -1 ){
+		const int ret = errno;
+		mem_free(&allocator, tmpname);
+		return ret;
+	}
+
+	/* allocate up front as running out of space while writing to the mapping would raise SIGBUS */
+	int ret = posix_fallocate(fd, 0, (off_t)size);
+	char* ptr = MAP_FAILED;
+	if ( ret == 0 ){
+		ptr = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		ret = ptr == MAP_FAILED ? errno : 0;
+	}
+	if ( ret == 0 ){
+		ret = unpack_into(src, ptr);
+	}
+	if ( ret == 0 && (fchmod(fd, 0444) != 0 || rename(tmpname, name) != 0) ){
+		ret = errno;
+	}
+	close(fd);
+
+	if ( ret != 0 ){
+		if ( ptr != MAP_FAILED ){
+			munmap(ptr, size);
+		}
+		unlink(tmpname);
+		mem_free(&allocator, tmpname);
+		return ret;
+	}
+
+	mprotect(ptr, size, PROT_READ);
+	mem_free(&allocator, tmpname);
+	*dst = ptr;
+	return 0;
+}
+
+/**
+ * Read an overriding file into a private mapping.
+ * @return 0 on success, an errno value or -1 if src is not overridden.
+ */
+static int map_override(const struct datapack_entry* src, const char** dst, size_t* size){
+	static const char empty[] = "";
+	if ( !local ){
+		return -1;
+	}
+
+	char* local_path = mem_printf(&allocator, "%s/%s", local, src->filename);
+	if ( !local_path ){
+		return ENOMEM;
+	}
+	const int fd = open(local_path, O_RDONLY);
+	mem_free(&allocator, local_path);
+	if ( fd == -1 ){
+		return -1;
+	}
+
+	struct stat st;
+	int ret = fstat(fd, &st) == 0 ? 0 : errno;
+	if ( ret == 0 && st.st_size == 0 ){
+		*dst = empty;
+	} else if ( ret == 0 && (ret=shared_private(NULL, fd, (size_t)st.st_size, dst)) == 0 ){
+		*size = (size_t)st.st_size;
+	}
+	close(fd);
+	return ret;
+}
+
+int unpack_shared(const struct datapack_entry* src, const char** dst, size_t* size){
+	static const char empty[] = "";
+	*dst = NULL;
+	*size = 0;
+
+	/* overridden files are read into a private mapping */
+	int ret = map_override(src, dst, size);
+	if ( ret != -1 ){
+		return ret;
+	}
+
+	trace_access(src);
+
+	if ( src->usize == 0 ){
+		*dst = empty;
+		return 0;
+	}
+
+	/* entries from pack files are looked up in the shared cache, keyed by the
+	 * location of their data which (unlike their position) does not depend on
+	 * the index mode of the process */
+	char* name = NULL;
+	if ( shared_dir && src->handle && src->handle->identity[0] && (src->handle->entries || src->handle->compact) ){
+		const unsigned int volume = src->block ? src->block->volume : src->volume;
+		const long offset = src->block ? src->block->offset : src->offset;
+		name = mem_printf(&allocator, "%s/datapack-%s-%x-%lx-%zx", shared_dir, src->handle->identity, volume, offset, src->boffset);
+	}
+
+	if ( name ){
+		const size_t mapsize = src->usize + 1;
+		const int fd = open(name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		if ( fd != -1 ){
+			/* only trust files published by this user which nobody else can modify */
+			struct stat st;
+			void* ptr = MAP_FAILED;
+			if ( fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_uid == geteuid()
+			     && !(st.st_mode & (S_IWGRP | S_IWOTH)) && (size_t)st.st_size == mapsize ){
+				ptr = mmap(NULL, mapsize, PROT_READ, MAP_SHARED, fd, 0);
+			}
+			close(fd);
+			if ( ptr != MAP_FAILED ){
+				mem_free(&allocator, name);
+				*dst = (const char*)ptr;
+				*size = src->usize;
+				return 0;
+			}
+		}
+
+		/* not cached yet, decompress and publish (falls back to a private
+		 * copy if the cache cannot be written) */
+		ret = shared_publish(src, name, dst);
+		mem_free(&allocator, name);
+		if ( ret == 0 ){
+			*size = src->usize;
+			return 0;
+		}
+	}
+
+	ret = shared_private(src, -1, src->usize, dst);
+	if ( ret == 0 ){
+		*size = src->usize;
+	}
+	return ret;
+}
+
+void unpack_shared_release(const char* data, size_t size){
+	if ( data && size > 0 ){
+		munmap((void*)data, size + 1);
+	}
+}
+
+/**
+ * Byte range [lo, hi) of the mapping filled when the given page is first
+ * touched, always whole pages. Segmented entries fill the pages covered by the
+ * segments overlapping the page, stored entries only the page itself and
+ * other compressed entries are decompressed as a whole.
+ */
+static void lazy_chunk(const struct lazy_map* map, size_t page, size_t* lo, size_t* hi){
+	const struct datapack_entry* src = map->src;
+	const size_t begin = page * lazy_page;
+	const size_t end = begin + lazy_page;
+	*lo = begin;
+	*hi = end;
+
+	/* only the null-terminator is past the data */
+	if ( begin >= src->usize ){
+		return;
+	}
+	if ( src->flags & DATAPACK_SEGMENTED ){
+		const size_t first = begin / src->ssize;
+		const size_t last = ((end < src->usize ? end : src->usize) + src->ssize - 1) / src->ssize;
+		const size_t bhi = last * src->ssize < src->usize ? last * src->ssize : src->usize;
+		*lo = (first * src->ssize + lazy_page - 1) / lazy_page * lazy_page;
+		*hi = bhi == src->usize ? map->size : bhi / lazy_page * lazy_page;
+		return;
+	}
+	if ( !(src->flags & DATAPACK_STORED) ){
+		*lo = 0;
+		*hi = map->size;
+	}
+}
+
+/**
+ * Hand out memory for zlib from the arena of a lazy mapping. Memory is never
+ * returned as the state and window stay for the lifetime of the mapping.
+ */
+static voidpf lazy_zalloc(voidpf opaque, uInt items, uInt size){
+	struct lazy_map* map = (struct lazy_map*)opaque;
+	const size_t bytes = ((size_t)items * size + 15) & ~(size_t)15;
+	if ( bytes > LAZY_ARENA - map->arena_used ){
+		return Z_NULL;
+	}
+	voidpf ptr = map->arena + map->arena_used;
+	map->arena_used += bytes;
+	return ptr;
+}
+
+static void lazy_zfree(voidpf opaque, voidpf ptr){
+	(void)opaque;
+	(void)ptr;
+}
+
+/**
+ * Inflate csize bytes of compressed data at offset (relative to the entry)
+ * into exactly usize bytes of dst using the decode state of the mapping.
+ * @return 0 on success, EIO if data cannot be read or EBADMSG if corrupt.
+ */
+static int lazy_inflate(struct lazy_map* map, size_t offset, size_t csize, char* dst, size_t usize){
+	const struct datapack_entry* src = map->src;
+	z_stream* strm = &map->strm;
+	inflateReset(strm);
+	strm->avail_in = 0;
+	strm->next_out = (unsigned char*)dst;
+	strm->avail_out = (unsigned int)usize;
+
+	size_t consumed = 0;
+	int ret = Z_OK;
+	while ( ret == Z_OK ){
+		if ( strm->avail_in == 0 && consumed < csize ){
+			size_t bytes = csize - consumed;
+			if ( src->data ){
+				strm->next_in = (unsigned char*)src->data + offset + consumed;
+			} else {
+				bytes = bytes < CHUNK ? bytes : CHUNK;
+				if ( read_at(src->handle, src->volume, map->input, bytes, src->offset + (long)(offset + consumed)) != 0 ){
+					return EIO;
+				}
+				strm->next_in = map->input;
+			}
+			strm->avail_in = (unsigned int)bytes;
+			consumed += bytes;
+		}
+		ret = inflate(strm, Z_NO_FLUSH);
+	}
+
+	return ret == Z_STREAM_END && strm->avail_out == 0 ? 0 : EBADMSG;
+}
+
+/**
+ * Verify the checksum of the whole entry before any of it is filled in,
+ * reading data from file through the input buffer of the mapping.
+ * @return 0 if data matches, EIO if it cannot be read or EBADMSG otherwise.
+ */
+static int lazy_verify(struct lazy_map* map){
+	const struct datapack_entry* src = map->src;
+	unsigned char* flag = verify_flag(src);
+	if ( !flag ){
+		return 0;
+	}
+	if ( src->data ){
+		return verify_data(flag, (const unsigned char*)src->data, src->csize, src->crc);
+	}
+
+	uint32_t crc = 0;
+	for ( size_t pos = 0; pos < src->csize; ){
+		const size_t bytes = src->csize - pos < CHUNK ? src->csize - pos : CHUNK;
+		if ( read_at(src->handle, src->volume, map->input, bytes, src->offset + (long)pos) != 0 ){
+			return EIO;
+		}
+		crc = datapack_crc32c(crc, map->input, bytes);
+		pos += bytes;
+	}
+	if ( crc != src->crc ){
+		return EBADMSG;
+	}
+	__atomic_store_n(flag, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+ * Fill dst with bytes [lo, hi) of the entry, zero past the end of data.
+ */
+static int lazy_fill(struct lazy_map* map, size_t lo, size_t hi, char* dst){
+	const struct datapack_entry* src = map->src;
+	if ( lo >= src->usize ){
+		return 0;
+	}
+	const size_t bytes = (hi < src->usize ? hi : src->usize) - lo;
+
+	int ret = lazy_verify(map);
+	if ( ret != 0 ){
+		return ret;
+	}
+
+	if ( src->flags & DATAPACK_STORED ){
+		if ( src->data ){
+			memcpy(dst, src->data + lo, bytes);
+			return 0;
+		}
+		return read_at(src->handle, src->volume, dst, bytes, src->offset + (long)lo) != 0 ? EIO : 0;
+	}
 
-struct datapack {
-	FILE* fp;
-	size_t num_entries;
-	void (*cleanup)(datapack_t handle);
-	char** filename;
-	struct datapack_entry* filetable[];
-};
+	/* whole entry (see lazy_chunk) */
+	if ( !(src->flags & DATAPACK_SEGMENTED) ){
+		return lazy_inflate(map, 0, src->csize, dst, src->usize);
+	}
 
-static void datapack_proc_cleanup(datapack_t handle){
-	/* nothing to cleanup */
+	/* decode the covering segments and copy the requested part */
+	const size_t first = lo / src->ssize;
+	const size_t last = (lo + bytes + src->ssize - 1) / src->ssize;
+	const size_t base = first * src->ssize;
+	const size_t size = (last * src->ssize < src->usize ? last * src->ssize : src->usize) - base;
+	for ( size_t i = first; i < last && ret == 0; i++ ){
+		const size_t pos = (i - first) * src->ssize;
+		const size_t usize = size - pos < src->ssize ? size - pos : src->ssize;
+		ret = lazy_inflate(map, map->offsets[i], src->segments[i], map->output + pos, usize);
+	}
+	if ( ret == 0 ){
+		memcpy(dst, map->output + lo - base, bytes);
+	}
+	return ret;
 }
 
-static datapack_t datapack_open_proc(){
-	void* dl = dlopen(NULL, RTLD_LAZY);
-	if ( !dl ){
-		errno = EINVAL;
-		return NULL;
+/**
+ * Fill the chunk covering a faulting address.
+ * @return 0 if served, -1 if address belongs to no lazy mapping or the error
+ *         filling the chunk (it reads as zeroes then).
+ */
+static int lazy_fault(uintptr_t address){
+	/* the list lock is only held for the lookup, the mapping is locked before
+	 * releasing it so unpack_munmap waits for the fault to be served */
+	pthread_mutex_lock(&lazy_lock);
+	struct lazy_map* map = lazy_maps;
+	while ( map && (address < (uintptr_t)map->addr || address >= (uintptr_t)map->addr + map->size) ){
+		map = map->next;
+	}
+	if ( !map ){
+		pthread_mutex_unlock(&lazy_lock);
+		return -1;
 	}
+	pthread_mutex_lock(&map->lock);
+	pthread_mutex_unlock(&lazy_lock);
 
-	const struct datapack_entry** filetable = (const struct datapack_entry**)dlsym(dl, "filetable");
-	if ( !filetable ){
-		errno = ENOENT;
-		return NULL;
+	const size_t page = (address - (uintptr_t)map->addr) / lazy_page;
+	if ( map->filled[page] ){
+#ifdef HAVE_LINUX_USERFAULTFD_H
+		if ( lazy_uffd != -1 ){
+			struct uffdio_range range = { .start = (uintptr_t)map->addr + page * lazy_page, .len = lazy_page };
+			ioctl(lazy_uffd, UFFDIO_WAKE, &range);
+		}
+#endif
+		pthread_mutex_unlock(&map->lock);
+		return 0;
 	}
 
-	size_t n = 1; /* 1 slot for sentinel */
-	const struct datapack_entry* cur = filetable[0];
-	while ( cur ){
-		cur = filetable[++n];
+	/* data which cannot be read, verified or decoded reads as zeroes, the
+	 * first error is kept for unpack_mmap_error */
+	size_t lo, hi;
+	lazy_chunk(map, page, &lo, &hi);
+	char* buf = (char*)mmap(NULL, hi - lo, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	const int ret = buf != MAP_FAILED ? lazy_fill(map, lo, hi, buf) : ENOMEM;
+	if ( ret != 0 ){
+		if ( buf != MAP_FAILED ){
+			memset(buf, 0, hi - lo);
+		}
+		if ( __atomic_load_n(&map->error, __ATOMIC_RELAXED) == 0 ){
+			__atomic_store_n(&map->error, ret, __ATOMIC_RELAXED);
+		}
 	}
 
-	const size_t tablesize = sizeof(struct datapack_entry) * n;
-	datapack_t pak = (datapack_t)malloc(sizeof(struct datapack) + tablesize);
-	pak->fp = NULL;
-	pak->num_entries = n;
-	pak->filename = NULL;
-	pak->cleanup = datapack_proc_cleanup;
-	memcpy(pak->filetable, filetable, tablesize);
-	/** @todo fill handle */
+#ifdef HAVE_LINUX_USERFAULTFD_H
+	if ( lazy_uffd != -1 ){
+		/* copy runs of pages not filled by earlier chunks, waking the faulting thread */
+		for ( size_t p = lo / lazy_page; p < hi / lazy_page && buf != MAP_FAILED; ){
+			size_t q = p;
+			while ( q < hi / lazy_page && !map->filled[q] ){
+				map->filled[q++] = 1;
+			}
+			if ( q > p ){
+				struct uffdio_copy copy = {
+					.dst = (uintptr_t)map->addr + p * lazy_page,
+					.src = (uintptr_t)buf + p * lazy_page - lo,
+					.len = (q - p) * lazy_page,
+					.mode = 0,
+				};
+				ioctl(lazy_uffd, UFFDIO_COPY, &copy);
+			}
+			p = q + 1;
+		}
+		if ( buf == MAP_FAILED ){
+			struct uffdio_zeropage zero = { .range = { .start = (uintptr_t)map->addr + page * lazy_page, .len = lazy_page } };
+			ioctl(lazy_uffd, UFFDIO_ZEROPAGE, &zero);
+			map->filled[page] = 1;
+		} else {
+			munmap(buf, hi - lo);
+		}
+		pthread_mutex_unlock(&map->lock);
+		return ret;
+	}
+#endif
 
-	return pak;
+	/* move the filled pages over the inaccessible ones in one step so other
+	 * threads never observe a partially filled page */
+	if ( buf == MAP_FAILED ){
+		mprotect(map->addr + page * lazy_page, lazy_page, PROT_READ);
+		map->filled[page] = 1;
+	} else {
+		mprotect(buf, hi - lo, PROT_READ);
+		mremap(buf, hi - lo, hi - lo, MREMAP_MAYMOVE | MREMAP_FIXED, map->addr + lo);
+		memset(&map->filled[lo / lazy_page], 1, (hi - lo) / lazy_page);
+	}
+	pthread_mutex_unlock(&map->lock);
+	return ret;
 }
 
-static void datapack_file_cleanup(datapack_t handle){
-	for ( unsigned int i = 0; i < handle->num_entries; i++ ){
-		free(handle->filename[i]);
-		free(handle->filetable[i]);
+static void lazy_signal(int sig, siginfo_t* info, void* uctx){
+	const int saved = errno;
+	const int ret = lazy_fault((uintptr_t)info->si_addr);
+	if ( ret != -1 ){
+		/* bad data raises SIGBUS just like a truncated file mapping, reading
+		 * on as zeroes if a handler returns */
+		if ( ret != 0 ){
+			raise(SIGBUS);
+		}
+		errno = saved;
+		return;
 	}
 
-	fclose(handle->fp);
-	free(handle->filename);
+	/* not a lazy mapping, pass on to the previous handler */
+	if ( lazy_oldact.sa_flags & SA_SIGINFO ){
+		lazy_oldact.sa_sigaction(sig, info, uctx);
+	} else if ( lazy_oldact.sa_handler != SIG_DFL && lazy_oldact.sa_handler != SIG_IGN ){
+		lazy_oldact.sa_handler(sig);
+	} else {
+		signal(sig, SIG_DFL); /* fault is repeated on return */
+	}
 }
 
-datapack_t datapack_open(const char* filename){
-	if ( !filename ){
-		return datapack_open_proc();
+#ifdef HAVE_LINUX_USERFAULTFD_H
+static void* lazy_worker(void* ptr){
+	for (;;){
+		struct uffd_msg msg;
+		const ssize_t bytes = read(lazy_uffd, &msg, sizeof(msg));
+		if ( bytes < 0 && (errno == EINTR || errno == EAGAIN) ) continue;
+		if ( bytes != sizeof(msg) ) break;
+		if ( msg.event == UFFD_EVENT_PAGEFAULT ){
+			lazy_fault((uintptr_t)msg.arg.pagefault.address);
+		}
 	}
+	return NULL;
+}
 
-	FILE* fp = fopen(filename, "r");
-	if ( !fp ) return NULL;
+/**
+ * Create the userfaultfd and its worker thread serving faults of all lazy
+ * mappings.
+ */
+static int lazy_init_uffd(void){
+	lazy_uffd = (int)syscall(SYS_userfaultfd, O_CLOEXEC);
+#ifdef UFFD_USER_MODE_ONLY
+	if ( lazy_uffd == -1 ){
+		/* unprivileged processes may only handle faults from user mode */
+		lazy_uffd = (int)syscall(SYS_userfaultfd, O_CLOEXEC | UFFD_USER_MODE_ONLY);
+	}
+#endif
+	if ( lazy_uffd == -1 ){
+		return -1;
+	}
 
-	static unsigned char expected[] = DATAPACK_MAGIC;
-	static unsigned char actual[sizeof(expected)];
-	if ( fread(actual, sizeof(expected), 1, fp) != 1 ){
-		return NULL;
+	struct uffdio_api api = { .api = UFFD_API, .features = 0 };
+	if ( ioctl(lazy_uffd, UFFDIO_API, &api) == -1 ){
+		close(lazy_uffd);
+		lazy_uffd = -1;
+		return -1;
 	}
-	if ( memcmp(expected, actual, sizeof(expected)) != 0 ){
-		errno = EINVAL;
-		return NULL;
+
+	/* worker must not receive signals meant for the application */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_t thread;
+	const int ret = pthread_create(&thread, NULL, lazy_worker, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if ( ret != 0 ){
+		close(lazy_uffd);
+		lazy_uffd = -1;
+		return -1;
 	}
+	pthread_detach(thread);
+	return 0;
+}
+#endif
 
-	/* read and validate header */
-	struct datapack_pak_header header;
-	if ( fread(&header, sizeof(struct datapack_pak_header), 1, fp) != 1 ){
-		return NULL;
+static void lazy_init(void){
+	lazy_page = (size_t)sysconf(_SC_PAGESIZE);
+#ifdef HAVE_LINUX_USERFAULTFD_H
+	if ( lazy_init_uffd() == 0 ){
+		return;
 	}
-	if ( header.dp_version != 1 ){
-		errno = EINVAL;
-		return NULL;
+#endif
+
+	struct sigaction act;
+	memset(&act, 0, sizeof(act));
+	act.sa_sigaction = lazy_signal;
+	act.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&act.sa_mask);
+	sigaction(SIGSEGV, &act, &lazy_oldact);
+}
+
+static void lazy_free(struct lazy_map* map){
+	if ( map->strm_ready ){
+		inflateEnd(&map->strm);
 	}
+	pthread_mutex_destroy(&map->lock);
+	const struct datapack_allocator owner = map->owner;
+	mem_free(&owner, map->arena);
+	mem_free(&owner, map->output);
+	mem_free(&owner, map->input);
+	mem_free(&owner, map->offsets);
+	mem_free(&owner, map->filled);
+	mem_free(&owner, map);
+}
 
-	/* parse header */
-	long offset = be16toh(header.dp_offset);
-	size_t num_entries = (size_t)be16toh(header.dp_num_entries);
-	fseek(fp, offset, SEEK_SET);
+int unpack_mmap(const struct datapack_entry* src, const char** dst, size_t* size){
+	static const char empty[] = "";
+	*dst = NULL;
+	*size = 0;
 
-	/* allocate new table (native format) */
-	const size_t tablesize = sizeof(struct datapack_entry) * (num_entries + 1); /* +1 for sentinel */
-	datapack_t pak = (datapack_t)malloc(sizeof(struct datapack) + tablesize);
-	pak->fp = fp;
-	pak->num_entries = num_entries;
-	pak->filename = (char**)malloc(sizeof(char*) * num_entries);
-	pak->cleanup = datapack_file_cleanup;
-	memset(&pak->filetable, 0, tablesize);
+	int ret = map_override(src, dst, size);
+	if ( ret != -1 ){
+		return ret;
+	}
 
-	for ( unsigned int i = 0; i < num_entries; i++ ){
-		/* read entry */
-		struct datapack_pakfile_entry packed;
-		if ( fread(&packed, sizeof(struct datapack_pakfile_entry), 1, fp) != 1 ){
-			errno = EBADF;
-			return NULL;
+	trace_access(src);
+
+	if ( src->usize == 0 ){
+		*dst = empty;
+		return 0;
+	}
+
+	/* solid blocks and deltas need state which cannot be set up front */
+	if ( src->block || (src->flags & DATAPACK_DELTA) ){
+		ret = shared_private(src, -1, src->usize, dst);
+		if ( ret == 0 ){
+			*size = src->usize;
 		}
-		const size_t csize = be32toh(packed.csize);
-		const size_t usize = be32toh(packed.usize);
-		const size_t fsize = be32toh(packed.fsize);
+		return ret;
+	}
 
-		/* read filename */
-		char* filename = (char*)malloc(fsize+1); /* +1 for null-terminator */
-		if ( fread(filename, fsize, 1, fp) != 1 ){
-			errno = EBADF;
-			return NULL;
+	pthread_once(&lazy_once, lazy_init);
+	struct lazy_map* map = (struct lazy_map*)mem_calloc(&allocator, 1, sizeof(struct lazy_map));
+	if ( !map ){
+		return ENOMEM;
+	}
+	map->owner = allocator;
+	map->src = src;
+	map->size = (src->usize + lazy_page) / lazy_page * lazy_page; /* +1 for null-terminator */
+	map->filled = (unsigned char*)mem_calloc(&map->owner, map->size / lazy_page, 1);
+	pthread_mutex_init(&map->lock, NULL);
+
+	/* offset of each segment within the compressed data, the output buffer
+	 * fits the segments overlapping a single page */
+	int ok = map->filled != NULL;
+	if ( ok && (src->flags & DATAPACK_SEGMENTED) ){
+		const size_t n = (src->usize + src->ssize - 1) / src->ssize;
+		const size_t span = (lazy_page / src->ssize + 2) * src->ssize;
+		map->offsets = (size_t*)mem_alloc(&map->owner, sizeof(size_t) * (n + 1));
+		map->output = (char*)mem_alloc(&map->owner, span < src->usize ? span : src->usize);
+		ok = map->offsets != NULL && map->output != NULL;
+		if ( ok ){
+			map->offsets[0] = 0;
+		}
+		for ( size_t i = 0; i < n && ok; i++ ){
+			map->offsets[i + 1] = map->offsets[i] + src->segments[i];
+		}
+	}
+	if ( ok && !src->data ){
+		/* compressed data and data being verified is read in chunks */
+		map->input = (unsigned char*)mem_alloc(&map->owner, CHUNK);
+		ok = map->input != NULL;
+	}
+	if ( ok && !(src->flags & DATAPACK_STORED) ){
+		map->arena = (char*)mem_alloc(&map->owner, LAZY_ARENA);
+		if ( ok && map->arena ){
+			map->strm.zalloc = lazy_zalloc;
+			map->strm.zfree = lazy_zfree;
+			map->strm.opaque = map;
+			map->strm.next_in = Z_NULL;
+			map->strm.avail_in = 0;
+			map->strm_ready = inflateInit(&map->strm) == Z_OK;
 		}
-		filename[fsize] = 0;
+		ok = ok && map->strm_ready;
+	}
+	if ( !ok ){
+		lazy_free(map);
+		return ENOMEM;
+	}
 
-		/* store entry */
-		struct datapack_entry* entry = malloc(sizeof(struct datapack_entry));
-		entry->handle = pak;
-		entry->filename = filename;
-		entry->data = NULL;
-		entry->offset = ftell(fp);
-		entry->csize = csize;
-		entry->usize = usize;
-		pak->filetable[i] = entry;
-		pak->filename[i] = filename;
+	/* reserve address space, pages are populated on first touch */
+	const int prot = lazy_uffd != -1 ? PROT_READ : PROT_NONE;
+	map->addr = (char*)mmap(NULL, map->size, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if ( map->addr == MAP_FAILED ){
+		lazy_free(map);
+		return ENOMEM;
+	}
+#ifdef HAVE_LINUX_USERFAULTFD_H
+	if ( lazy_uffd != -1 ){
+		struct uffdio_register reg = {
+			.range = { .start = (uintptr_t)map->addr, .len = map->size },
+			.mode = UFFDIO_REGISTER_MODE_MISSING,
+		};
+		if ( ioctl(lazy_uffd, UFFDIO_REGISTER, &reg) == -1 ){
+			ret = errno;
+			munmap(map->addr, map->size);
+			lazy_free(map);
+			return ret;
+		}
+	}
+#endif
 
-		/* skip data */
-		fseek(fp, (long)csize, SEEK_CUR);
+	pthread_mutex_lock(&lazy_lock);
+	map->next = lazy_maps;
+	lazy_maps = map;
+	pthread_mutex_unlock(&lazy_lock);
+
+	/* the pack stays open until unmapped */
+	if ( src->handle ){
+		__atomic_add_fetch(&src->handle->refs, 1, __ATOMIC_RELAXED);
 	}
 
-	return pak;
+	*dst = map->addr;
+	*size = src->usize;
+	return 0;
 }
 
-void datapack_close(datapack_t handle){
-	handle->cleanup(handle);
-	free(handle);
-}
+void unpack_munmap(const char* data, size_t size){
+	pthread_mutex_lock(&lazy_lock);
+	struct lazy_map** cur = &lazy_maps;
+	while ( *cur && (*cur)->addr != data ){
+		cur = &(*cur)->next;
+	}
+	struct lazy_map* map = *cur;
+	if ( map ){
+		*cur = map->next;
+	}
+	pthread_mutex_unlock(&lazy_lock);
 
-int unpack_override(const char* dir){
-	free((char*)local);
+	if ( map ){
+		/* wait for a fault being served */
+		pthread_mutex_lock(&map->lock);
+		munmap(map->addr, map->size);
+		pthread_mutex_unlock(&map->lock);
 
-	size_t len = strlen(dir);
-	if ( dir[len-1] == '/' ) len--;
-	local = strndup(dir, len);
+		datapack_t handle = map->src->handle;
+		lazy_free(map);
+		if ( handle ){
+			datapack_close(handle);
+		}
+	} else {
+		/* overridden files, solid and delta entries use a private copy */
+		unpack_shared_release(data, size);
+	}
+}
 
-	return 0;
+int unpack_mmap_error(const char* data){
+	pthread_mutex_lock(&lazy_lock);
+	const struct lazy_map* map = lazy_maps;
+	while ( map && map->addr != data ){
+		map = map->next;
+	}
+	const int ret = map ? __atomic_load_n(&map->error, __ATOMIC_RELAXED) : 0;
+	pthread_mutex_unlock(&lazy_lock);
+	return ret;
 }
 
-int unpack(const struct datapack_entry* src, char** dstptr){
-	if ( local ){
-		char* local_path;
-		if ( asprintf(&local_path, "%s/%s", local, src->filename) == -1 ){
-			return errno;
+/**
+ * Pass data to a sink in pieces of at most chunk bytes.
+ */
+static int stream_memory(const char* data, size_t size, datapack_sink_t sink, void* ctx, size_t chunk){
+	for ( size_t pos = 0; pos < size; pos += chunk ){
+		const int ret = sink(&data[pos], size - pos < chunk ? size - pos : chunk, ctx);
+		if ( ret != 0 ){
+			return ret;
 		}
+	}
+	return 0;
+}
 
-		FILE* fp = fopen(local_path, "r");
-		free(local_path);
+/**
+ * Stream a file overriding an entry.
+ * @return -1 if the entry is not overridden.
+ */
+static int stream_override(const struct datapack_entry* src, datapack_sink_t sink, void* ctx, size_t chunk){
+	char* local_path = mem_printf(&allocator, "%s/%s", local, src->filename);
+	if ( !local_path ){
+		return ENOMEM;
+	}
+	FILE* fp = fopen(local_path, "r");
+	mem_free(&allocator, local_path);
+	if ( !fp ){
+		return -1;
+	}
 
-		if ( fp ){
-			fseek(fp, 0, SEEK_END);
-			const long size = ftell(fp);
-			fseek(fp, 0, SEEK_SET);
+	char* buf = (char*)mem_alloc(&allocator, chunk);
+	int ret = buf ? 0 : ENOMEM;
+	size_t bytes;
+	while ( ret == 0 && (bytes=fread(buf, 1, chunk, fp)) > 0 ){
+		ret = sink(buf, bytes, ctx);
+	}
+	if ( ret == 0 && ferror(fp) ){
+		ret = EIO;
+	}
+	mem_free(&allocator, buf);
+	fclose(fp);
+	return ret;
+}
 
-			char* dst = (char*) malloc((size_t)(size+1)); /* must fit null-terminator */
-			if ( fread(dst, (size_t)size, 1, fp) == 0 ){
-				return errno;
-			}
+int unpack_stream(const struct datapack_entry* src, datapack_sink_t sink, void* ctx, size_t chunk){
+	if ( !src || !sink ){
+		return EINVAL;
+	}
+	if ( chunk == 0 ){
+		chunk = CHUNK;
+	}
 
-			dst[size] = 0; /* force null-terminator */
-			*dstptr = dst; /* return pointer to caller */
-			fclose(fp);
+	int ret;
+	if ( local && (ret=stream_override(src, sink, ctx, chunk)) != -1 ){
+		return ret;
+	}
 
-			return 0;
+	trace_access(src);
+
+	/* entries in solid blocks are small and deltas are rebuilt as a whole */
+	if ( src->block || (src->flags & DATAPACK_DELTA) ){
+		char* data = (char*)mem_alloc(&allocator, src->usize + 1);
+		if ( !data ){
+			return ENOMEM;
+		}
+		ret = unpack_into(src, data);
+		if ( ret == 0 ){
+			ret = stream_memory(data, src->usize, sink, ctx, chunk);
 		}
+		mem_free(&allocator, data);
+		return ret;
 	}
 
-	/* prepare destination buffer */
-	*dstptr = NULL;
-	const size_t bufsize = src->usize;
-	char* dst = (char*) malloc(bufsize+1); /* must fit null-terminator */
-
-	/* prepare source buffer */
-	unsigned char* srcbuf = (unsigned char*)malloc(src->csize);
+	/* data already in memory is verified up front, data read from file while
+	 * streaming (a mismatch is only detected after all data is passed on) */
+	unsigned char* flag = verify_flag(src);
+	if ( flag && src->data && verify_data(flag, (const unsigned char*)src->data, src->csize, src->crc) != 0 ){
+		return EBADMSG;
+	}
 	if ( src->data ){
-		memcpy(srcbuf, src->data, src->csize);
-	} else {
-		fseek(src->handle->fp, src->offset, SEEK_SET);
-		if ( fread(srcbuf, src->csize, 1, src->handle->fp) != 1 ){
-			/* @todo read in chunks */
-			return EBADF;
-		}
+		flag = NULL;
 	}
 
-	z_stream strm;
-	strm.zalloc = Z_NULL;
-	strm.zfree = Z_NULL;
-	strm.opaque = Z_NULL;
-	strm.avail_in = (unsigned int) src->csize;
-	strm.next_in = (Bytef*)srcbuf;
-	int ret = inflateInit(&strm);
-	if (ret != Z_OK)
-		return ret;
+	/* stored data is passed on directly */
+	if ( (src->flags & DATAPACK_STORED) && src->data ){
+		return stream_memory(src->data, src->usize, sink, ctx, chunk);
+	}
 
-	strm.avail_out = (unsigned int) bufsize;
-	strm.next_out = (unsigned char*)dst;
-	ret = inflate(&strm, Z_NO_FLUSH);
-	switch (ret) {
-	case Z_NEED_DICT:
-		ret = Z_DATA_ERROR;
-	case Z_DATA_ERROR:
-	case Z_MEM_ERROR:
-		inflateEnd(&strm);
+	/* no chunk is larger than the entry (+1 so inflate can detect excess data) */
+	if ( chunk > src->usize + 1 ){
+		chunk = src->usize + 1;
+	}
+	char* out = (char*)mem_alloc(&allocator, chunk + CHUNK);
+	unsigned char* input = (unsigned char*)out + chunk;
+	if ( !out ){
+		return ENOMEM;
+	}
+
+	uint32_t crc = 0;
+	if ( src->flags & DATAPACK_STORED ){
+		ret = 0;
+		for ( size_t pos = 0; pos < src->usize && ret == 0; pos += chunk ){
+			const size_t bytes = src->usize - pos < chunk ? src->usize - pos : chunk;
+			if ( read_at(src->handle, src->volume, out, bytes, src->offset + (long)pos) != 0 ){
+				ret = EIO;
+				break;
+			}
+			crc = flag ? datapack_crc32c(crc, (const unsigned char*)out, bytes) : 0;
+			ret = sink(out, bytes, ctx);
+		}
+		mem_free(&allocator, out);
+		if ( ret == 0 && flag ){
+			ret = crc == src->crc ? 0 : EBADMSG;
+			if ( ret == 0 ) __atomic_store_n(flag, 1, __ATOMIC_RELEASE);
+		}
 		return ret;
 	}
 
-	dst[bufsize-strm.avail_out] = 0; /* force null-terminator */
-	*dstptr = dst;                   /* return pointer to caller */
+	z_stream* strm = inflate_acquire();
+	if ( !strm ){
+		mem_free(&allocator, out);
+		return ENOMEM;
+	}
+	strm->avail_in = 0; /* pooled streams keep the state of their last use */
 
-	/* clean up and return */
-	free(srcbuf);
-	inflateEnd(&strm);
-	return ret == Z_STREAM_END ? Z_OK : Z_DATA_ERROR;
-}
+	/* inflate straight into chunks handed to the sink */
+	size_t consumed = 0;    /* compressed bytes fed to inflate */
+	size_t filled = 0;      /* bytes in the current chunk */
+	size_t total = 0;       /* bytes passed to the sink */
+	int eof = 0;
+	ret = 0;
+	while ( ret == 0 && !eof ){
+		if ( strm->avail_in == 0 && consumed < src->csize ){
+			const size_t bytes = src->csize - consumed < CHUNK ? src->csize - consumed : CHUNK;
+			if ( src->data ){
+				strm->next_in = (unsigned char*)&src->data[consumed];
+			} else if ( read_at(src->handle, src->volume, input, bytes, src->offset + (long)consumed) != 0 ){
+				ret = EIO;
+				break;
+			} else {
+				strm->next_in = input;
+				crc = flag ? datapack_crc32c(crc, input, bytes) : 0;
+			}
+			strm->avail_in = (unsigned int)bytes;
+			consumed += bytes;
 
-struct datapack_entry* unpack_find(datapack_t handle, const char* filename){
-	if ( !handle ) return NULL;
-	struct datapack_entry* cur = handle->filetable[0];
+			if ( flag && consumed == src->csize ){
+				if ( crc != src->crc ){
+					ret = EBADMSG;
+					break;
+				}
+				__atomic_store_n(flag, 1, __ATOMIC_RELEASE);
+			}
+		}
+
+		const size_t left = chunk - filled;
+		strm->next_out = (unsigned char*)&out[filled];
+		strm->avail_out = left < UINT_MAX ? (unsigned int)left : UINT_MAX;
+		const unsigned int avail = strm->avail_out;
+		const int z = inflate(strm, Z_NO_FLUSH);
+		if ( z == Z_STREAM_END ){
+			/* segments are consecutive streams */
+			if ( (src->flags & DATAPACK_SEGMENTED) && (strm->avail_in > 0 || consumed < src->csize) ){
+				inflateReset(strm);
+			} else {
+				eof = 1;
+			}
+		} else if ( z != Z_OK ){
+			ret = z == Z_MEM_ERROR ? ENOMEM : EIO; /* Z_BUF_ERROR if data is truncated */
+			break;
+		}
 
-	int i = 0;
-	while ( cur ){
-		if ( strcmp(filename, cur->filename) == 0 ){
-			return cur;
+		filled += avail - strm->avail_out;
+		if ( filled == chunk || (eof && filled > 0) ){
+			total += filled;
+			ret = total <= src->usize ? sink(out, filled, ctx) : EIO;
+			filled = 0;
 		}
-		cur = handle->filetable[++i];
 	}
 
-	return NULL;
+	inflate_release(strm);
+	mem_free(&allocator, out);
+	if ( ret == 0 && total != src->usize ){
+		ret = EIO;
+	}
+	return ret;
 }
 
 int unpack_filename(datapack_t handle, const char* filename, char** dst){
@@ -260,6 +4175,12 @@ int unpack_filename(datapack_t handle, const char* filename, char** dst){
 	if ( !handle ){
 		return EINVAL;
 	}
+	if ( handle->watch ){
+		datapack_t pak = datapack_snapshot(handle);
+		const int ret = unpack_filename(pak, filename, dst);
+		datapack_close(pak);
+		return ret;
+	}
 
 	struct datapack_entry* entry = unpack_find(handle, filename);
 	if ( !entry ){
@@ -273,7 +4194,8 @@ int unpack_filename(datapack_t handle, const char* filename, char** dst){
  * Recursive mkdir.
  */
 static void rec_mkdir(const char *path){
-	char* tmp = strdup(path);
+	char* tmp = mem_strdup(&allocator, path);
+	if ( !tmp ) return;
 	const size_t len = strlen(tmp);
 	if ( tmp[len-1] == '/' ) tmp[len-1] = 0;
 
@@ -291,42 +4213,116 @@ static void rec_mkdir(const char *path){
 		mkdir(tmp, S_IRWXU);
 	}
 
-	free(tmp);
+	mem_free(&allocator, tmp);
 }
 
 struct unpack_cookie_data {
 	const struct datapack_entry* src;
-	z_stream strm;
+	z_stream* strm;
+	long offset;                   /* file offset of compressed data not yet read */
+	size_t remaining;              /* compressed bytes not yet read from file */
+	int eof;                       /* set when stream end is reached */
+	int raw;                       /* set if data is read without inflating */
+	const char* mem;               /* uncompressed data (NULL if raw data is read from file) */
+	char* owned;                   /* copy of data from solid block (freed on close) */
+	size_t pos;                    /* read position of raw data */
+	unsigned char* verify;         /* verified flag if checksum is computed while reading (or NULL) */
+	uint32_t crc;                  /* checksum of data read from file so far */
+	struct datapack_allocator owner; /* allocator of the context and owned */
 	size_t bufsize;
 	unsigned char buffer[CHUNK];
+	unsigned char input[CHUNK];
 };
 
+/**
+ * Update the checksum of a stream with data read from file and check it once
+ * all data is read.
+ */
+static int unpack_verify(struct unpack_cookie_data* ctx, const unsigned char* data, size_t size, int last){
+	ctx->crc = datapack_crc32c(ctx->crc, data, size);
+	if ( !last ){
+		return 0;
+	}
+	if ( ctx->crc != ctx->src->crc ){
+		errno = EBADMSG;
+		return -1;
+	}
+
+	__atomic_store_n(ctx->verify, 1, __ATOMIC_RELEASE);
+	ctx->verify = NULL;
+	return 0;
+}
+
 static ssize_t unpack_read(void* cookie, char* buf, size_t size){
 	struct unpack_cookie_data* ctx = (struct unpack_cookie_data*)cookie;
 
-	const size_t left = CHUNK - ctx->bufsize;
+	/* entries from solid blocks or stored entries need no inflate */
+	if ( ctx->raw ){
+		const size_t left = ctx->src->usize - ctx->pos;
+		const size_t bytes = size < left ? size : left;
+		if ( ctx->mem ){
+			memcpy(buf, &ctx->mem[ctx->pos], bytes);
+		} else if ( read_at(ctx->src->handle, ctx->src->volume, buf, bytes, ctx->src->offset + (long)ctx->pos) != 0 ){
+			errno = EIO;
+			return -1;
+		}
+		ctx->pos += bytes;
+		if ( ctx->verify && unpack_verify(ctx, (const unsigned char*)buf, bytes, ctx->pos == ctx->src->usize) != 0 ){
+			return -1;
+		}
+		return (ssize_t) bytes;
+	}
+
+	while ( ctx->bufsize < size && ctx->bufsize < CHUNK && !ctx->eof ){
+		/* refill input from file */
+		if ( ctx->strm->avail_in == 0 ){
+			if ( ctx->remaining == 0 ){
+				errno = EIO;
+				return -1;
+			}
+
+			const size_t bytes = ctx->remaining < CHUNK ? ctx->remaining : CHUNK;
+			if ( read_at(ctx->src->handle, ctx->src->volume, ctx->input, bytes, ctx->offset) != 0 ){
+				errno = EIO;
+				return -1;
+			}
+			ctx->offset += (long)bytes;
+			ctx->remaining -= bytes;
+			if ( ctx->verify && unpack_verify(ctx, ctx->input, bytes, ctx->remaining == 0) != 0 ){
+				return -1;
+			}
+			ctx->strm->next_in = ctx->input;
+			ctx->strm->avail_in = (unsigned int) bytes;
+		}
 
-	if ( ctx->strm.avail_in > 0 ){
-		ctx->strm.avail_out = (unsigned int) left;
-		ctx->strm.next_out  = &ctx->buffer[ctx->bufsize];
+		const size_t left = CHUNK - ctx->bufsize;
+		ctx->strm->avail_out = (unsigned int) left;
+		ctx->strm->next_out  = &ctx->buffer[ctx->bufsize];
 
-		int ret = inflate(&ctx->strm, Z_NO_FLUSH);
+		int ret = inflate(ctx->strm, Z_NO_FLUSH);
 		switch (ret) {
 		case Z_NEED_DICT:
 		case Z_DATA_ERROR:
 		case Z_MEM_ERROR:
-			inflateEnd(&ctx->strm);
 			errno = EIO;
 			return -1;
+		case Z_STREAM_END:
+			/* segments are consecutive streams */
+			if ( (ctx->src->flags & DATAPACK_SEGMENTED) && (ctx->strm->avail_in > 0 || ctx->remaining > 0) ){
+				inflateReset(ctx->strm);
+			} else {
+				ctx->eof = 1;
+			}
+			break;
 		}
 
-		ctx->bufsize += left - ctx->strm.avail_out;
+		ctx->bufsize += left - ctx->strm->avail_out;
 	}
 
 	const size_t bytes = size < ctx->bufsize ? size : ctx->bufsize;
 
 	memcpy(buf, ctx->buffer, bytes);
-	memmove(ctx->buffer, &ctx->buffer[size], bytes);
+	memmove(ctx->buffer, &ctx->buffer[bytes], ctx->bufsize - bytes);
 	ctx->bufsize -= bytes;
 
 	return (ssize_t) bytes;
@@ -334,9 +4330,18 @@ static ssize_t unpack_read(void* cookie, char* buf, size_t size){
 
 static int unpack_close(void *cookie){
 	struct unpack_cookie_data* ctx = (struct unpack_cookie_data*)cookie;
+	datapack_t handle = ctx->src->handle;
 
-	inflateEnd(&ctx->strm);
-	free(ctx);
+	const struct datapack_allocator owner = ctx->owner;
+	if ( ctx->raw ){
+		mem_free(&owner, ctx->owned);
+	} else {
+		inflate_release(ctx->strm);
+	}
+	mem_free(&owner, ctx);
+	if ( handle ){
+		datapack_close(handle);
+	}
 
 	return 0;
 }
@@ -348,7 +4353,26 @@ static cookie_io_functions_t unpack_cookie_func = {
 	unpack_close
 };
 
+/**
+ * Open a stream reading ctx, the pack of the entry stays open until the
+ * stream is closed.
+ */
+static FILE* unpack_cookie_open(struct unpack_cookie_data* ctx, const char* mode){
+	FILE* fp = fopencookie(ctx, mode, unpack_cookie_func);
+	if ( fp && ctx->src->handle ){
+		__atomic_add_fetch(&ctx->src->handle->refs, 1, __ATOMIC_RELAXED);
+	}
+	return fp;
+}
+
 FILE* unpack_open(datapack_t handle, const char* filename, const char* mode){
+	if ( handle && handle->watch ){
+		datapack_t pak = datapack_snapshot(handle);
+		FILE* fp = unpack_open(pak, filename, mode);
+		datapack_close(pak);
+		return fp;
+	}
+
 	struct datapack_entry* entry = unpack_find(handle, filename);
 	if ( !entry ){
 		errno = ENOENT;
@@ -360,10 +4384,13 @@ FILE* unpack_open(datapack_t handle, const char* filename, const char* mode){
 
 	/* allow overriding with local path */
 	if ( read && local ){
-		char* local_path;
-		if(asprintf(&local_path, "%s/%s", local, filename) == -1) return NULL;
+		char* local_path = mem_printf(&allocator, "%s/%s", local, filename);
+		if ( !local_path ){
+			errno = ENOMEM;
+			return NULL;
+		}
 		FILE* fp = fopen(local_path, mode);
-		free(local_path);
+		mem_free(&allocator, local_path);
 		if ( fp ){
 			return fp;
 		}
@@ -380,30 +4407,82 @@ FILE* unpack_open(datapack_t handle, const char* filename, const char* mode){
 		rec_mkdir(local);
 
 		/* give file pointer directly from fopen */
-		char* local_path;
-		if(asprintf(&local_path, "%s/%s", local, filename) == -1) return NULL;
+		char* local_path = mem_printf(&allocator, "%s/%s", local, filename);
+		if ( !local_path ){
+			errno = ENOMEM;
+			return NULL;
+		}
 		FILE* fp = fopen(local_path, mode);
-		free(local_path);
+		mem_free(&allocator, local_path);
 
 		return fp;
 	}
 
-	struct unpack_cookie_data* ctx = (struct unpack_cookie_data*)malloc(sizeof(struct unpack_cookie_data));
+	trace_access(entry);
+
+	struct unpack_cookie_data* ctx = (struct unpack_cookie_data*)mem_alloc(&allocator, sizeof(struct unpack_cookie_data));
+	if ( !ctx ){
+		errno = ENOMEM;
+		return NULL;
+	}
+	ctx->owner = allocator;
 	ctx->src = entry;
+	ctx->eof = 0;
+	ctx->raw = 0;
+	ctx->mem = NULL;
+	ctx->owned = NULL;
+	ctx->pos = 0;
 	ctx->bufsize = 0;
+	ctx->verify = NULL;
+	ctx->crc = 0;
+
+	/* copy entry out of solid block as the cached block may be evicted, deltas
+	 * are rebuilt up front as well */
+	if ( entry->block || (entry->flags & DATAPACK_DELTA) ){
+		int ret = ENOMEM;
+		if ( !(ctx->owned = (char*)mem_alloc(&ctx->owner, entry->usize + 1)) || (ret=unpack_into(entry, ctx->owned)) != 0 ){
+			mem_free(&ctx->owner, ctx->owned);
+			mem_free(&ctx->owner, ctx);
+			errno = ret == ENOMEM ? ENOMEM : EIO;
+			return NULL;
+		}
+		ctx->mem = ctx->owned;
+		ctx->raw = 1;
+		return unpack_cookie_open(ctx, mode);
+	}
+
+	/* data read from file is verified while streaming, compressed data from
+	 * a mapped pack up front */
+	ctx->verify = verify_flag(entry);
+	if ( ctx->verify && entry->data && !(entry->flags & DATAPACK_STORED) ){
+		if ( verify_data(ctx->verify, (const unsigned char*)entry->data, entry->csize, entry->crc) != 0 ){
+			mem_free(&ctx->owner, ctx);
+			errno = EBADMSG;
+			return NULL;
+		}
+		ctx->verify = NULL;
+	}
+
+	/* stored entries are read directly */
+	if ( entry->flags & DATAPACK_STORED ){
+		ctx->mem = entry->data;
+		ctx->raw = 1;
+		return unpack_cookie_open(ctx, mode);
+	}
 
-	ctx->strm.avail_in = (unsigned int) entry->csize;
-	ctx->strm.next_in = (unsigned char*)entry->data;
-	ctx->strm.zalloc = Z_NULL;
-	ctx->strm.zfree = Z_NULL;
-	ctx->strm.opaque = Z_NULL;
-	int ret = inflateInit(&ctx->strm);
-	if (ret != Z_OK){
-		errno = EBADFD;
+	/* compressed data is either in memory or read from file in chunks */
+	ctx->offset = entry->offset;
+	ctx->remaining = entry->data ? 0 : entry->csize;
+	ctx->strm = inflate_acquire();
+	if ( !ctx->strm ){
+		mem_free(&ctx->owner, ctx);
+		errno = ENOMEM;
 		return NULL;
 	}
+	ctx->strm->avail_in = entry->data ? (unsigned int) entry->csize : 0;
+	ctx->strm->next_in = (unsigned char*)entry->data;
 
-	return fopencookie(ctx, mode, unpack_cookie_func);
+	return unpack_cookie_open(ctx, mode);
 }
 
 const char* datapack_version(datapack_version_t* version){